@@ -0,0 +1,297 @@
+#include "actor.h"
+#include "array.h"
+#include "dict.h"
+#include "parallel.h"
+#include "stack.h"
+#include "vm.h"
+#include <gc/gc.h>
+
+extern void raiseInvalid(VM* vm, AstNode* node, const char* msg);
+extern const char* gc_sprintf(const char* fmt, ...);
+
+#define DEFAULT_CAPACITY 1024
+
+const char* actorStatusNames[ACTOR_STATUS_COUNT] = {
+    "running", "done", "failed"
+};
+
+// Copies made so far of the lists, contexts and dicts of a message, so that
+// those it refers to more than once (or cyclically) are copied once.
+typedef struct sCopier {
+    VM* vm;
+    void** from;
+    Value* to;
+    int count, capacity; // power of two (or 0)
+} Copier;
+
+static u32 hashPointer(void* p) {
+    u64 x = (u64) (uintptr_t) p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (u32) x;
+}
+
+static Value* findCopy(Copier* c, void* from) {
+    if (!c->capacity) return NULL;
+    u32 mask = c->capacity - 1;
+    for (u32 i = hashPointer(from) & mask; c->from[i]; i = (i + 1) & mask) {
+        if (c->from[i] == from) return &c->to[i];
+    }
+    return NULL;
+}
+
+static void addCopy(Copier* c, void* from, Value to) {
+    if ((c->count + 1) * 2 > c->capacity) {
+        void** oldFrom = c->from;
+        Value* oldTo = c->to;
+        int oldCap = c->capacity;
+        c->capacity = oldCap ? oldCap * 2 : 16;
+        c->from = GC_MALLOC(sizeof(void*) * c->capacity);
+        c->to = GC_MALLOC(sizeof(Value) * c->capacity);
+        c->count = 0;
+        for (int i = 0; i < oldCap; i++) {
+            if (oldFrom[i]) addCopy(c, oldFrom[i], oldTo[i]);
+        }
+    }
+    u32 mask = c->capacity - 1;
+    u32 i = hashPointer(from) & mask;
+    while (c->from[i]) i = (i + 1) & mask;
+    c->from[i] = from;
+    c->to[i] = to;
+    c->count++;
+}
+
+// The list, context or dict v is, to be copied once, NULL if anything else.
+static void* copiedOnce(Value v) {
+    switch (GET_TYPE(v)) {
+        case TYPE_LIST: return GET_LIST(v);
+        case TYPE_CONTEXT: return GET_CONTEXT(v);
+        case TYPE_NATIVE: {
+            NativeKind kind = GET_NATIVE(v)->kind;
+            return kind == NATIVE_DICT || kind == NATIVE_SET ? GET_NATIVE(v) : NULL;
+        }
+        default: return NULL;
+    }
+}
+
+static bool copyValue(Copier* c, Value v, Value* result) {
+    void* from = copiedOnce(v);
+    if (from) {
+        Value* copied = findCopy(c, from);
+        if (copied) {
+            *result = *copied;
+            return true;
+        }
+    }
+    switch (GET_TYPE(v)) {
+        case TYPE_LIST: {
+            Stack* list = from;
+            Stack* to = GC_MALLOC(sizeof(Stack));
+            *to = (Stack) {};
+            *result = FROM_LIST(to);
+            addCopy(c, from, *result);
+            Stack_reserve(to, list->next);
+            for (int i = 0; i < list->next; i++) {
+                if (!copyValue(c, list->values[i], &to->values[i])) return false;
+            }
+            to->next = list->next;
+        } break;
+        case TYPE_CONTEXT: {
+            Context* ctx = from;
+            Context* to = Context_createSized(NULL, ctx->shape->count);
+            *result = FROM_CONTEXT(to);
+            addCopy(c, from, *result);
+            for (int i = 0; i < ctx->shape->capacity; i++) {
+                Symbol key = Context_keyAt(ctx, i);
+                if (!key) continue;
+                Value value;
+                if (!copyValue(c, *Context_getLocal(ctx, key), &value)) return false;
+                Context_bind(to, key, value);
+            }
+        } break;
+        case TYPE_CLOSURE: {
+            raiseInvalid(c->vm, NULL, "cannot send closures between actors");
+            return false;
+        }
+        case TYPE_NATIVE: {
+            NativeKind kind = GET_NATIVE(v)->kind;
+            if (kind == NATIVE_DICT || kind == NATIVE_SET) {
+                Dict* dict = from;
+                Dict* to = Dict_create(kind, dict->count);
+                *result = FROM_NATIVE(to);
+                addCopy(c, from, *result);
+                for (int i = 0; i < dict->used; i++) {
+                    DictEntry* e = &dict->entries[i];
+                    if (IS_UNBOUND(e->key)) continue;
+                    Value key, value;
+                    if (!copyValue(c, e->key, &key)) return false;
+                    if (!copyValue(c, e->value, &value)) return false;
+                    if (!Dict_set(c->vm, to, key, value)) return false;
+                }
+            } else if (kind == NATIVE_ARRAY || kind == NATIVE_RANGE || kind == NATIVE_ACTOR) {
+                *result = v;
+            } else {
+                raiseInvalid(c->vm, NULL, gc_sprintf("cannot send %s between actors",
+                    Symbol_name(c->vm->symNatives[kind])));
+                return false;
+            }
+        } break;
+        default: { // numbers, symbols, oddballs, strings and blobs
+            *result = v;
+        }
+    }
+    return true;
+}
+
+bool Actor_copy(VM* vm, Value v, Value* result) {
+    switch (GET_TYPE(v)) {
+        case TYPE_LIST: case TYPE_CONTEXT: case TYPE_CLOSURE: case TYPE_NATIVE: {
+            Copier c = { vm };
+            return copyValue(&c, v, result);
+        }
+        default: {
+            *result = v;
+            return true;
+        }
+    }
+}
+
+static Actor* create(VM* vm, const char* path, int capacity) {
+    // uncollectable, as its thread refers to it only from its own stack
+    Actor* a = GC_MALLOC_UNCOLLECTABLE(sizeof(Actor));
+    *a = (Actor) { { NATIVE_ACTOR }, vm, path, ACTOR_RUNNING };
+    pthread_mutex_init(&a->lock, NULL);
+    pthread_cond_init(&a->received, NULL);
+    pthread_cond_init(&a->taken, NULL);
+    pthread_cond_init(&a->finished, NULL);
+    a->args = GC_MALLOC(sizeof(Stack));
+    *a->args = (Stack) {};
+    a->messages = GC_MALLOC(sizeof(Value) * capacity);
+    a->capacity = capacity;
+    return a;
+}
+
+static void* runActor(void* arg) {
+    Actor* a = arg;
+    VM* vm = a->vm;
+    // as main.c does
+    bool ok = Module_import(vm, "dragon", false);
+    if (ok) {
+        vm->root = GET_CONTEXT(Stack_pop(vm->stack));
+        ok = Module_fromFile(vm, a->path, true);
+    }
+    pthread_mutex_lock(&a->lock);
+    if (!ok) {
+        a->exSymbol = vm->exSymbol;
+        a->exMessage = vm->exMessage;
+        a->exTraceFirst = vm->exTraceFirst;
+        a->exTraceLast = vm->exTraceLast;
+        a->exSourceHasTrace = vm->exSourceHasTrace;
+    }
+    a->status = ok ? ACTOR_DONE : ACTOR_FAILED;
+    // senders waiting for room raise instead
+    pthread_cond_broadcast(&a->taken);
+    pthread_cond_broadcast(&a->finished);
+    pthread_mutex_unlock(&a->lock);
+    actorsActive--;
+    return NULL;
+}
+
+Actor* Actor_spawn(VM* vm, const char* path, Stack* args, int capacity) {
+    Value copy;
+    if (!Actor_copy(vm, FROM_LIST(args), &copy)) return NULL;
+    VM* child = GC_MALLOC_UNCOLLECTABLE(sizeof(VM));
+    *child = (VM) { .fullTrace = vm->fullTrace, .noLock = vm->noLock };
+    VM_startup(child);
+    Actor* a = create(child, path, capacity);
+    child->actor = a;
+    a->args = GET_LIST(copy);
+    // set before the thread starts, so that it is never zero while it runs
+    actorsActive++;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runActor, a) != 0) {
+        actorsActive--;
+        raiseInvalid(vm, NULL, "could not start actor thread");
+        return NULL;
+    }
+    pthread_detach(thread);
+    return a;
+}
+
+Actor* Actor_self(VM* vm) {
+    if (!vm->actor) vm->actor = create(vm, NULL, DEFAULT_CAPACITY);
+    return vm->actor;
+}
+
+bool Actor_send(VM* vm, Actor* a, Value message) {
+    Value copy;
+    if (!Actor_copy(vm, message, &copy)) return false;
+    pthread_mutex_lock(&a->lock);
+    while (a->count == a->capacity && a->status == ACTOR_RUNNING) {
+        a->sending++;
+        pthread_cond_wait(&a->taken, &a->lock);
+        a->sending--;
+    }
+    if (a->status != ACTOR_RUNNING) {
+        pthread_mutex_unlock(&a->lock);
+        raiseInvalid(vm, NULL, "cannot send to an actor which has finished");
+        return false;
+    }
+    a->messages[(a->head + a->count++) % a->capacity] = copy;
+    if (a->receiving) pthread_cond_signal(&a->received);
+    pthread_mutex_unlock(&a->lock);
+    return true;
+}
+
+// Take the oldest message, with the lock held.
+static Value take(Actor* a) {
+    Value message = a->messages[a->head];
+    a->messages[a->head] = VAL_NIL;
+    a->head = (a->head + 1) % a->capacity;
+    a->count--;
+    if (a->sending) pthread_cond_signal(&a->taken);
+    return message;
+}
+
+void Actor_receive(VM* vm) {
+    Actor* a = Actor_self(vm);
+    pthread_mutex_lock(&a->lock);
+    while (!a->count) {
+        a->receiving++;
+        pthread_cond_wait(&a->received, &a->lock);
+        a->receiving--;
+    }
+    Value message = take(a);
+    pthread_mutex_unlock(&a->lock);
+    Stack_push(vm->stack, message);
+}
+
+void Actor_poll(VM* vm) {
+    Actor* a = Actor_self(vm);
+    pthread_mutex_lock(&a->lock);
+    bool any = a->count > 0;
+    Value message = any ? take(a) : VAL_NIL;
+    pthread_mutex_unlock(&a->lock);
+    if (any) Stack_push(vm->stack, message);
+    Stack_push(vm->stack, any ? VAL_TRUE : VAL_FALSE);
+}
+
+bool Actor_wait(VM* vm, Actor* a) {
+    if (!a->path || a->vm == vm) {
+        raiseInvalid(vm, NULL, a->vm == vm ? "actor cannot wait for itself" :
+            "cannot wait for an actor which was not spawned");
+        return false;
+    }
+    pthread_mutex_lock(&a->lock);
+    while (a->status == ACTOR_RUNNING) pthread_cond_wait(&a->finished, &a->lock);
+    pthread_mutex_unlock(&a->lock);
+    if (atomic_load(&a->status) == ACTOR_FAILED) {
+        vm->exSymbol = a->exSymbol;
+        vm->exMessage = a->exMessage;
+        vm->exTraceFirst = VM_copyTrace(a->exTraceFirst, &vm->exTraceLast);
+        vm->exSourceHasTrace = a->exSourceHasTrace;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct sVM VM;
+typedef struct sExceptionTrace ExceptionTrace;
+typedef struct sStack Stack;
+typedef struct sActor Actor;
+
+// note: keep in sync with actorStatusNames in actor.c
+typedef enum {
+    ACTOR_RUNNING,
+    ACTOR_DONE,
+    ACTOR_FAILED, // raised an exception
+    ACTOR_STATUS_COUNT
+} ActorStatus;
+
+// A VM running a file on a thread of its own, and the mailbox it receives
+// messages through. Unlike pmap and tasks, an actor shares no code or
+// contexts with any other VM: it imports its own copy of dragon and every
+// other module, and messages are copied into it, so it runs with inline
+// caches and quickening as usual. Mailboxes are bounded, with senders waiting
+// while full. Every VM has a mailbox once asked for, so actors can reply to
+// the VM which spawned them. Actors are never freed, like VMs.
+struct sActor {
+    Native header;
+    VM* vm;
+    const char* path; // of the file it runs, NULL if not spawned
+    Stack* args; // copies of the values it was spawned with
+    atomic_int status; // set with lock held
+    pthread_mutex_t lock; // guards the fields below
+    pthread_cond_t received, taken, finished;
+    Value* messages; // a ring of capacity, the oldest at head
+    int head, count, capacity;
+    int receiving, sending; // threads waiting for a message, or for room
+    // the exception the file raised, once failed
+    Symbol exSymbol;
+    const char* exMessage;
+    ExceptionTrace* exTraceFirst, * exTraceLast;
+    bool exSourceHasTrace;
+};
+
+extern const char* actorStatusNames[ACTOR_STATUS_COUNT];
+
+// Start a VM running the file at path on a new thread, with copies of args
+// for it to read as sys.args is read by the main file.
+Actor* Actor_spawn(VM* vm, const char* path, Stack* args, int capacity);
+// The VM's own actor, created with a mailbox of the default size if needed.
+Actor* Actor_self(VM* vm);
+// Copy a message into an actor's mailbox, waiting for room if full. Raises if
+// the message cannot be sent, or the actor has finished.
+bool Actor_send(VM* vm, Actor* actor, Value message);
+// Push the oldest message of the VM's mailbox, waiting for one if empty.
+void Actor_receive(VM* vm);
+// Push the oldest message and true if there is one, false otherwise.
+void Actor_poll(VM* vm);
+// Wait for an actor to finish, raising its exception if it raised one.
+bool Actor_wait(VM* vm, Actor* actor);
+// Deep copy a value to be sent between VMs. Strings, blobs, arrays, ranges
+// and actors are immutable, so shared rather than copied, while contexts are
+// copied without their parents. Raises for closures and other values tied
+// to the VM they came from.
+bool Actor_copy(VM* vm, Value v, Value* result);
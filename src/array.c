@@ -0,0 +1,278 @@
+#include "array.h"
+#include <gc/gc.h>
+#include <math.h>
+
+const char* arrayTypeNames[ARRAY_TYPE_COUNT] = { "u8", "i32", "f64" };
+const int arrayTypeSizes[ARRAY_TYPE_COUNT] = { 1, 4, 8 };
+
+// Kernels work on VEC_BYTES at a time through GCC vector extensions, which
+// compile to whatever SIMD the target has (or are split up if it has none),
+// followed by a scalar loop for the remainder. Loads and stores go through
+// memcpy so data need not be aligned.
+#define VEC_BYTES 32
+typedef u8 U8x __attribute__((vector_size(VEC_BYTES)));
+typedef u32 U32x __attribute__((vector_size(VEC_BYTES)));
+typedef double F64x __attribute__((vector_size(VEC_BYTES)));
+
+// Kernels take a and b either as arrays of n elements, or as one element
+// standing for all of them, if scalar & 1 (for a) or scalar & 2 (for b).
+typedef void (*Kernel)(void* restrict r, const void* a, const void* b, int n, int scalar);
+
+// i32 arithmetic is done unsigned, to wrap around on overflow like u8
+#define ARITH_KERNEL(name, T, V, OP) \
+    static void name(void* restrict pr, const void* pa, const void* pb, int n, int scalar) { \
+        enum { LANES = VEC_BYTES / sizeof(T) }; \
+        T* r = pr; \
+        const T* a = pa, * b = pb; \
+        V x, y, z; \
+        for (int j = 0; j < LANES; j++) { \
+            x[j] = a[0]; \
+            y[j] = b[0]; \
+        } \
+        int i = 0; \
+        for (; i + LANES <= n; i += LANES) { \
+            if (!(scalar & 1)) memcpy(&x, a + i, VEC_BYTES); \
+            if (!(scalar & 2)) memcpy(&y, b + i, VEC_BYTES); \
+            z = x OP y; \
+            memcpy(r + i, &z, VEC_BYTES); \
+        } \
+        for (; i < n; i++) r[i] = a[scalar & 1 ? 0 : i] OP b[scalar & 2 ? 0 : i]; \
+    }
+
+// comparisons narrow to u8, so are left to the compiler to vectorize
+#define COMPARE_KERNEL(name, T, OP) \
+    static void name(void* restrict pr, const void* pa, const void* pb, int n, int scalar) { \
+        u8* r = pr; \
+        const T* a = pa, * b = pb; \
+        if (scalar & 1) for (int i = 0; i < n; i++) r[i] = a[0] OP b[i]; \
+        else if (scalar & 2) for (int i = 0; i < n; i++) r[i] = a[i] OP b[0]; \
+        else for (int i = 0; i < n; i++) r[i] = a[i] OP b[i]; \
+    }
+
+#define KERNELS(suffix, T, AT, V) \
+    ARITH_KERNEL(add##suffix, AT, V, +) \
+    ARITH_KERNEL(sub##suffix, AT, V, -) \
+    ARITH_KERNEL(mul##suffix, AT, V, *) \
+    COMPARE_KERNEL(eq##suffix, T, ==) \
+    COMPARE_KERNEL(neq##suffix, T, !=) \
+    COMPARE_KERNEL(lt##suffix, T, <) \
+    COMPARE_KERNEL(gt##suffix, T, >) \
+    COMPARE_KERNEL(lteq##suffix, T, <=) \
+    COMPARE_KERNEL(gteq##suffix, T, >=)
+
+KERNELS(U8, u8, u8, U8x)
+KERNELS(I32, int32_t, u32, U32x)
+KERNELS(F64, double, double, F64x)
+ARITH_KERNEL(divF64, double, F64x, /)
+
+// indexed by ArrayOp then ArrayType, NULL where the operands are converted to
+// f64 first
+static const Kernel kernels[][ARRAY_TYPE_COUNT] = {
+    { addU8, addI32, addF64 },
+    { subU8, subI32, subF64 },
+    { mulU8, mulI32, mulF64 },
+    { NULL, NULL, divF64 },
+    { eqU8, eqI32, eqF64 },
+    { neqU8, neqI32, neqF64 },
+    { ltU8, ltI32, ltF64 },
+    { gtU8, gtI32, gtF64 },
+    { lteqU8, lteqI32, lteqF64 },
+    { gteqU8, gteqI32, gteqF64 },
+};
+
+// Conversions from f64 wrap around like integer arithmetic does, rather than
+// being undefined when out of range.
+static inline int32_t toI32(double x) {
+    if (!(fabs(x) < 9e18)) return 0;
+    return (int32_t) (u32) (int64_t) x;
+}
+
+static inline u8 toU8(double x) {
+    return (u8) toI32(x);
+}
+
+Array* Array_create(ArrayType type, int length) {
+    Array* array = GC_MALLOC(sizeof(Array));
+    void* data = length ? GC_MALLOC_ATOMIC(length * arrayTypeSizes[type]) : NULL;
+    *array = (Array) { { NATIVE_ARRAY }, type, length, data };
+    return array;
+}
+
+Array* Array_wrap(ArrayType type, int length, const void* data, const void* owner) {
+    if ((uintptr_t) data % arrayTypeSizes[type] == 0) {
+        Array* array = GC_MALLOC(sizeof(Array));
+        *array = (Array) { { NATIVE_ARRAY }, type, length, data, owner };
+        return array;
+    }
+    Array* array = Array_create(type, length);
+    memcpy(Array_data(array), data, length * arrayTypeSizes[type]);
+    return array;
+}
+
+#define CONVERT(FromT, ToT, CAST) { \
+        const FromT* src = array->data; \
+        ToT* dst = Array_data(result); \
+        for (int i = 0; i < array->length; i++) dst[i] = CAST(src[i]); \
+    } break;
+
+Array* Array_convert(Array* array, ArrayType type) {
+    if (array->type == type) return array;
+    Array* result = Array_create(type, array->length);
+    switch (array->type * ARRAY_TYPE_COUNT + type) {
+        case ARRAY_U8 * ARRAY_TYPE_COUNT + ARRAY_I32: CONVERT(u8, int32_t, )
+        case ARRAY_U8 * ARRAY_TYPE_COUNT + ARRAY_F64: CONVERT(u8, double, )
+        case ARRAY_I32 * ARRAY_TYPE_COUNT + ARRAY_U8: CONVERT(int32_t, u8, (u8))
+        case ARRAY_I32 * ARRAY_TYPE_COUNT + ARRAY_F64: CONVERT(int32_t, double, )
+        case ARRAY_F64 * ARRAY_TYPE_COUNT + ARRAY_U8: CONVERT(double, u8, toU8)
+        case ARRAY_F64 * ARRAY_TYPE_COUNT + ARRAY_I32: CONVERT(double, int32_t, toI32)
+    }
+    return result;
+}
+
+double Array_get(Array* array, int i) {
+    switch (array->type) {
+        case ARRAY_U8: return ((const u8*) array->data)[i];
+        case ARRAY_I32: return ((const int32_t*) array->data)[i];
+        default: return ((const double*) array->data)[i];
+    }
+}
+
+void Array_set(Array* array, int i, double x) {
+    switch (array->type) {
+        case ARRAY_U8: ((u8*) Array_data(array))[i] = toU8(x); break;
+        case ARRAY_I32: ((int32_t*) Array_data(array))[i] = toI32(x); break;
+        default: ((double*) Array_data(array))[i] = x; break;
+    }
+}
+
+// The narrowest type holding every element of an operand.
+static ArrayType operandType(ArrayOperand o) {
+    if (o.array) return o.array->type;
+    if (o.number >= 0 && o.number <= 255 && o.number == (int) o.number) return ARRAY_U8;
+    if (fabs(o.number) <= INT32_MAX && o.number == (int32_t) o.number) return ARRAY_I32;
+    return ARRAY_F64;
+}
+
+static bool operandLength(ArrayOperand* operands, int count, int* length) {
+    *length = -1;
+    for (int i = 0; i < count; i++) {
+        if (!operands[i].array) continue;
+        if (*length >= 0 && operands[i].array->length != *length) return false;
+        *length = operands[i].array->length;
+    }
+    assert(*length >= 0 && "expected an array operand");
+    return true;
+}
+
+// Get the data of an operand as type, setting bit in *scalar for numbers,
+// which are written to one element of buf.
+static const void* operandData(ArrayOperand o, ArrayType type, double* buf,
+    int bit, int* scalar) {
+    if (o.array) return Array_convert(o.array, type)->data;
+    *scalar |= bit;
+    switch (type) {
+        case ARRAY_U8: *(u8*) buf = toU8(o.number); break;
+        case ARRAY_I32: *(int32_t*) buf = toI32(o.number); break;
+        default: *buf = o.number; break;
+    }
+    return buf;
+}
+
+Array* Array_binary(ArrayOp op, ArrayOperand a, ArrayOperand b) {
+    ArrayOperand operands[] = { a, b };
+    int length;
+    if (!operandLength(operands, 2, &length)) return NULL;
+    ArrayType type = operandType(a) > operandType(b) ? operandType(a) : operandType(b);
+    if (!kernels[op][type]) type = ARRAY_F64;
+    Array* result = Array_create(op >= ARRAY_EQ ? ARRAY_U8 : type, length);
+    if (!length) return result;
+    double bufA, bufB;
+    int scalar = 0;
+    const void* pa = operandData(a, type, &bufA, 1, &scalar);
+    const void* pb = operandData(b, type, &bufB, 2, &scalar);
+    kernels[op][type](Array_data(result), pa, pb, length, scalar);
+    return result;
+}
+
+Array* Array_fma(ArrayOperand a, ArrayOperand b, ArrayOperand c) {
+    ArrayOperand operands[] = { a, b, c };
+    int length;
+    if (!operandLength(operands, 3, &length)) return NULL;
+    Array* result = Array_create(ARRAY_F64, length);
+    if (!length) return result;
+    double bufA, bufB, bufC;
+    int scalar = 0;
+    const double* pa = operandData(a, ARRAY_F64, &bufA, 1, &scalar);
+    const double* pb = operandData(b, ARRAY_F64, &bufB, 2, &scalar);
+    const double* pc = operandData(c, ARRAY_F64, &bufC, 4, &scalar);
+    double* r = Array_data(result);
+    enum { LANES = VEC_BYTES / sizeof(double) };
+    F64x x, y, z, w;
+    for (int j = 0; j < LANES; j++) {
+        x[j] = pa[0];
+        y[j] = pb[0];
+        z[j] = pc[0];
+    }
+    int i = 0;
+    for (; i + LANES <= length; i += LANES) {
+        if (!(scalar & 1)) memcpy(&x, pa + i, VEC_BYTES);
+        if (!(scalar & 2)) memcpy(&y, pb + i, VEC_BYTES);
+        if (!(scalar & 4)) memcpy(&z, pc + i, VEC_BYTES);
+        w = x * y + z;
+        memcpy(r + i, &w, VEC_BYTES);
+    }
+    for (; i < length; i++) {
+        r[i] = pa[scalar & 1 ? 0 : i] * pb[scalar & 2 ? 0 : i] + pc[scalar & 4 ? 0 : i];
+    }
+    return result;
+}
+
+Array* Array_unary(ArrayFn fn, Array* array) {
+    // floor and abs keep integer types, where floor does nothing
+    if (fn == ARRAY_SQRT || (fn == ARRAY_FLOOR && array->type == ARRAY_F64)) {
+        const double* src = Array_convert(array, ARRAY_F64)->data;
+        Array* result = Array_create(ARRAY_F64, array->length);
+        double* dst = Array_data(result);
+        if (fn == ARRAY_SQRT) {
+            for (int i = 0; i < array->length; i++) dst[i] = sqrt(src[i]);
+        } else {
+            for (int i = 0; i < array->length; i++) dst[i] = floor(src[i]);
+        }
+        return result;
+    }
+    if (fn == ARRAY_FLOOR || array->type == ARRAY_U8) return array;
+    Array* result = Array_create(array->type, array->length);
+    if (array->type == ARRAY_I32) {
+        const int32_t* src = array->data;
+        u32* dst = Array_data(result);
+        for (int i = 0; i < array->length; i++) {
+            dst[i] = src[i] < 0 ? -(u32) src[i] : (u32) src[i];
+        }
+    } else {
+        const double* src = array->data;
+        double* dst = Array_data(result);
+        for (int i = 0; i < array->length; i++) dst[i] = fabs(src[i]);
+    }
+    return result;
+}
+
+double Array_sum(Array* array) {
+    if (array->type != ARRAY_F64) {
+        int64_t sum = 0;
+        for (int i = 0; i < array->length; i++) sum += (int64_t) Array_get(array, i);
+        return sum;
+    }
+    // summed in LANES interleaved parts, then those are added together
+    enum { LANES = VEC_BYTES / sizeof(double) };
+    const double* data = array->data;
+    F64x sums = { 0 }, x;
+    int i = 0;
+    for (; i + LANES <= array->length; i += LANES) {
+        memcpy(&x, data + i, VEC_BYTES);
+        sums += x;
+    }
+    double sum = 0;
+    for (int j = 0; j < LANES; j++) sum += sums[j];
+    for (; i < array->length; i++) sum += data[i];
+    return sum;
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+
+typedef struct sArray Array;
+
+// Element types, narrowest first, so the wider of two is the greater
+// note: keep in sync with arrayTypeNames in array.c
+typedef enum {
+    ARRAY_U8,
+    ARRAY_I32,
+    ARRAY_F64,
+    ARRAY_TYPE_COUNT
+} ArrayType;
+
+typedef enum {
+    ARRAY_ADD, ARRAY_SUB, ARRAY_MUL, ARRAY_DIV,
+    ARRAY_EQ, ARRAY_NEQ, ARRAY_LT, ARRAY_GT, ARRAY_LTEQ, ARRAY_GTEQ
+} ArrayOp;
+
+typedef enum {
+    ARRAY_SQRT, ARRAY_ABS, ARRAY_FLOOR
+} ArrayFn;
+
+// Packed array of numbers, all of one element type. Arrays are immutable like
+// blobs, so converting between the two shares the data instead of copying.
+struct sArray {
+    Native header;
+    ArrayType type;
+    int length;
+    const void* data;
+    const void* owner; // as for Blob (see value.h)
+};
+
+// An operand of an elementwise operation: an array, or if array is NULL, a
+// number standing for every element.
+typedef struct sArrayOperand {
+    Array* array;
+    double number;
+} ArrayOperand;
+
+extern const char* arrayTypeNames[ARRAY_TYPE_COUNT];
+extern const int arrayTypeSizes[ARRAY_TYPE_COUNT];
+
+// Create an array of zeroes, to be filled through Array_data before use.
+Array* Array_create(ArrayType type, int length);
+// Create an array viewing data, which is copied only if misaligned, keeping
+// owner alive while viewed.
+Array* Array_wrap(ArrayType type, int length, const void* data, const void* owner);
+Array* Array_convert(Array* array, ArrayType type);
+static inline void* Array_data(Array* array) { return (void*) array->data; }
+
+double Array_get(Array* array, int i);
+void Array_set(Array* array, int i, double x);
+
+// The functions below return NULL if the lengths of their array operands
+// differ. At least one operand must be an array. Arithmetic gives the wider
+// type of its operands (division always gives f64), and comparisons give u8
+// arrays of 0 or 1.
+Array* Array_binary(ArrayOp op, ArrayOperand a, ArrayOperand b);
+// a * b + c, as f64
+Array* Array_fma(ArrayOperand a, ArrayOperand b, ArrayOperand c);
+
+Array* Array_unary(ArrayFn fn, Array* array);
+double Array_sum(Array* array);
@@ -0,0 +1,286 @@
+// Benchmark driver for make bench: runs each workload as a child fp process
+// a few times to warm up and then n times, measuring wall time, peak RSS and
+// the GC heap size reported by fp -G. Results are written as JSON, and when
+// given a baseline of the same form, compared against it.
+//
+// usage: bench [-n reps] [-w warmup] [-o out.json] [-b baseline.json]
+//              [-t threshold] [workload...]
+// run from the repository root, after building fp
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef struct sWorkload {
+    const char* name;
+    const char* dir; // relative to the repository root, or NULL for a scratch copy of web
+    const char* args[6];
+} Workload;
+
+static const Workload workloads[] = {
+    { "nbody", "examples", { "nbody.fj", "20000" } },
+    { "mandelbrot", "examples", { "mandelbrot.fj" } },
+    { "misc.bench", ".", { "-e", "import misc misc.bench" } },
+    // workloads of their own, in src/bench
+    { "coswitch", "src/bench", { "coswitch.fj", "1000000" } },
+    { "pfib", "src/bench", { "pfib.fj", "64" } },
+    { "pfib1", "src/bench", { "-j", "1", "pfib.fj", "64" } },
+    // task scaling from one thread to one per core
+    { "tfib1", "src/bench", { "-j", "1", "tfib.fj", "30" } },
+    { "tfib2", "src/bench", { "-j", "2", "tfib.fj", "30" } },
+    { "tfib4", "src/bench", { "-j", "4", "tfib.fj", "30" } },
+    { "tfib", "src/bench", { "tfib.fj", "30" } },
+    { "sortnums1", "src/bench", { "-j", "1", "sortnums.fj", "2000000" } },
+    { "sortnums", "src/bench", { "sortnums.fj", "2000000" } },
+    { "sortkeys", "src/bench", { "sortkeys.fj", "500000" } },
+    { "filelines", "src/bench", { "filelines.fj", "500000" } },
+    // messages between actors, each a VM on a thread of its own
+    { "actors.fanout", "examples", { "actors.fj", "fanout", "4", "200000" } },
+    { "actors.rpc", "examples", { "actors.fj", "rpc", "20000" } },
+    { "web.gen", NULL, { "-l", "gen.fj" } },
+};
+
+#define WORKLOAD_COUNT (int) (sizeof(workloads) / sizeof(workloads[0]))
+#define MAX_REPS 1000
+
+typedef struct sResult {
+    const char* name;
+    int reps;
+    double median, mad; // wall seconds
+    long peakRss; // kilobytes, the most of any run
+    long gcHeap; // bytes, the most of any run, -1 if not reported
+    bool failed;
+} Result;
+
+static char fpPath[PATH_MAX], modulePath[PATH_MAX], rootPath[PATH_MAX];
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Run a workload once, returning false if it could not be run or failed.
+static bool runOnce(const Workload* w, const char* dir, double* wall,
+    long* rss, long* heap) {
+    int errPipe[2];
+    if (pipe(errPipe)) return false;
+    double start = nowSeconds();
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        const char* argv[12] = { fpPath, "-G", "-M", modulePath };
+        int argc = 4;
+        for (int i = 0; w->args[i]; i++) argv[argc++] = w->args[i];
+        argv[argc] = NULL;
+        close(errPipe[0]);
+        dup2(errPipe[1], 2);
+        freopen("/dev/null", "w", stdout);
+        if (chdir(dir)) _exit(127);
+        execv(fpPath, (char**) argv);
+        _exit(127);
+    }
+    close(errPipe[1]);
+    // keep only the last line, where -G writes its statistics
+    FILE* err = fdopen(errPipe[0], "r");
+    char line[512], last[512] = "";
+    while (fgets(line, sizeof(line), err)) strcpy(last, line);
+    fclose(err);
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) return false;
+    *wall = nowSeconds() - start;
+    *rss = usage.ru_maxrss;
+    unsigned long heapSize;
+    *heap = sscanf(last, "gc heap %lu", &heapSize) == 1 ? (long) heapSize : -1;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(double* values, int n) {
+    qsort(values, n, sizeof(double), compareDoubles);
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+static Result runWorkload(const Workload* w, int warmup, int reps) {
+    Result r = { w->name, reps, 0, 0, 0, -1, false };
+    char dir[PATH_MAX * 2], scratch[] = "/tmp/fpbenchXXXXXX";
+    if (w->dir) {
+        snprintf(dir, sizeof(dir), "%s/%s", rootPath, w->dir);
+    } else {
+        // web/gen.fj writes its output next to itself
+        char cmd[PATH_MAX * 2 + 16];
+        if (!mkdtemp(scratch)) {
+            r.failed = true;
+            return r;
+        }
+        snprintf(cmd, sizeof(cmd), "cp -r '%s/web/.' '%s'", rootPath, scratch);
+        if (system(cmd)) r.failed = true;
+        strcpy(dir, scratch);
+    }
+    double walls[MAX_REPS], deviations[MAX_REPS];
+    for (int i = 0; i < warmup + reps && !r.failed; i++) {
+        double wall;
+        long rss, heap;
+        if (!runOnce(w, dir, &wall, &rss, &heap)) {
+            r.failed = true;
+            break;
+        }
+        if (i < warmup) continue;
+        walls[i - warmup] = wall;
+        if (rss > r.peakRss) r.peakRss = rss;
+        if (heap > r.gcHeap) r.gcHeap = heap;
+    }
+    if (!w->dir) {
+        char cmd[PATH_MAX + 16];
+        snprintf(cmd, sizeof(cmd), "rm -rf '%s'", scratch);
+        if (system(cmd)) fprintf(stderr, "bench: could not remove %s\n", scratch);
+    }
+    if (r.failed) return r;
+    r.median = median(walls, reps);
+    for (int i = 0; i < reps; i++) deviations[i] = fabs(walls[i] - r.median);
+    r.mad = median(deviations, reps);
+    return r;
+}
+
+static void writeResults(FILE* f, Result* results, int n) {
+    fprintf(f, "{\n  \"workloads\": [\n");
+    for (int i = 0; i < n; i++) {
+        Result* r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"reps\": %d, \"failed\": %s, "
+            "\"median\": %.6f, \"mad\": %.6f, \"peak_rss_kb\": %ld, "
+            "\"gc_heap_bytes\": %ld}%s\n",
+            r->name, r->reps, r->failed ? "true" : "false", r->median, r->mad,
+            r->peakRss, r->gcHeap, i + 1 < n ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+// Find a workload's median and mad in a baseline written by writeResults.
+static bool baselineOf(const char* json, const char* name, double* med, double* mad) {
+    char key[128];
+    snprintf(key, sizeof(key), "\"name\": \"%s\"", name);
+    const char* entry = strstr(json, key);
+    if (!entry) return false;
+    const char* m = strstr(entry, "\"median\": ");
+    const char* d = strstr(entry, "\"mad\": ");
+    if (!m || !d) return false;
+    *med = strtod(m + strlen("\"median\": "), NULL);
+    *mad = strtod(d + strlen("\"mad\": "), NULL);
+    return true;
+}
+
+static char* readFile(const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char* buf = malloc(size + 1);
+    buf[fread(buf, 1, size, f)] = 0;
+    fclose(f);
+    return buf;
+}
+
+// A workload regresses when its median is slower than the baseline's by more
+// than threshold (a fraction), and by more than the noise of either run.
+static bool compare(Result* results, int n, const char* json, double threshold) {
+    bool ok = true;
+    printf("\n%-12s %10s %10s %8s\n", "workload", "baseline", "now", "change");
+    for (int i = 0; i < n; i++) {
+        Result* r = &results[i];
+        double med, mad;
+        if (r->failed || !baselineOf(json, r->name, &med, &mad) || med <= 0) {
+            printf("%-12s %10s\n", r->name, r->failed ? "FAILED" : "no baseline");
+            if (r->failed) ok = false;
+            continue;
+        }
+        double change = r->median / med - 1;
+        bool slower = change > threshold && r->median - med > 3 * (mad + r->mad);
+        printf("%-12s %9.3fs %9.3fs %+7.1f%%%s\n", r->name, med, r->median,
+            change * 100, slower ? "  REGRESSED" : "");
+        if (slower) ok = false;
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    int reps = 5, warmup = 1;
+    const char* outPath = "build/bench.json";
+    const char* baselinePath = NULL;
+    double threshold = 0.1;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:w:o:b:t:")) != -1) {
+        switch (option) {
+            case 'n': reps = atoi(optarg); break;
+            case 'w': warmup = atoi(optarg); break;
+            case 'o': outPath = optarg; break;
+            case 'b': baselinePath = optarg; break;
+            case 't': threshold = atof(optarg); break;
+            default: return 2;
+        }
+    }
+    if (reps < 1 || reps > MAX_REPS || warmup < 0) {
+        fprintf(stderr, "bench: reps must be 1 to %d, warmup at least 0\n", MAX_REPS);
+        return 2;
+    }
+    if (!realpath(".", rootPath) || !realpath("fp", fpPath) ||
+        !realpath("modules", modulePath)) {
+        fprintf(stderr, "bench: run from the repository root, after building fp\n");
+        return 2;
+    }
+
+    Result results[WORKLOAD_COUNT];
+    int n = 0;
+    for (int i = 0; i < WORKLOAD_COUNT; i++) {
+        const Workload* w = &workloads[i];
+        if (optind < argc) {
+            bool selected = false;
+            for (int j = optind; j < argc; j++) selected |= !strcmp(argv[j], w->name);
+            if (!selected) continue;
+        }
+        Result r = runWorkload(w, warmup, reps);
+        if (r.failed) {
+            printf("%-12s FAILED\n", r.name);
+        } else {
+            printf("%-12s %8.3fs +- %.3fs  %7ld KB rss  %9ld B gc heap\n",
+                r.name, r.median, r.mad, r.peakRss, r.gcHeap);
+        }
+        fflush(stdout);
+        results[n++] = r;
+    }
+
+    FILE* out = fopen(outPath, "w");
+    if (!out) {
+        fprintf(stderr, "bench: could not open %s\n", outPath);
+        return 2;
+    }
+    writeResults(out, results, n);
+    fclose(out);
+
+    bool ok = true;
+    for (int i = 0; i < n; i++) ok &= !results[i].failed;
+    if (baselinePath) {
+        char* json = readFile(baselinePath);
+        if (json) {
+            ok &= compare(results, n, json, threshold);
+        } else {
+            printf("no baseline at %s, save one with make bench-baseline\n", baselinePath);
+        }
+    }
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -1,14 +1,28 @@
 #include "common.h"
+#include "compiler.h"
 #include "context.h"
+#include "actor.h"
+#include "array.h"
+#include "coroutine.h"
+#include "dict.h"
+#include "file.h"
+#include "iter.h"
+#include "profiler.h"
+#include "sort.h"
 #include "stack.h"
+#include "task.h"
 #include "value.h"
 #include "vm.h"
 #include "fruity.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <gc/gc.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <math.h>
@@ -21,17 +35,29 @@ bool builtin_stksize(VM* vm) {
 }
 
 bool builtin_reverse(VM* vm) {
-    Stack_reverse(vm->stack);
+    Stack_reverse(vm->stack, vm->base);
     return true;
 }
 
 bool builtin_dump(VM* vm) {
+    // groups are delimited by the bases of enclosing groups on scopes
     Stack* stk = vm->stack;
-    for (int level = 0; stk; stk = stk->previous, level--) {
+    int begin = vm->base, end = stk->next;
+    int scope = vm->scopes->next;
+    for (int level = 0; begin >= 0; level--) {
         printf("Stack %d (size %d, capacity %d)\n",
-            level, stk->next, stk->capacity);
-        for (int i = stk->next-1; i >= 0; i--) {
-            printf("  [%d] = %s\n", i, fpRepr(stk->values[i]));
+            level, end - begin, stk->capacity);
+        for (int i = end-1; i >= begin; i--) {
+            printf("  [%d] = %s\n", i - begin, fpRepr(stk->values[i]));
+        }
+        end = begin;
+        begin = -1;
+        while (scope > 0) {
+            Value v = vm->scopes->values[--scope];
+            if (GET_TYPE(v) == TYPE_NUMBER) {
+                begin = GET_NUMBER(v);
+                break;
+            }
         }
     }
     return true;
@@ -118,14 +144,15 @@ bool builtin_lsv(VM* vm) {
     int marker = vm->stack->next;
     while (c) {
         int end = vm->stack->next;
-        for (int i = 0; i < c->capacity; i++) {
-            if (c->keys[i]) {
+        for (int i = 0; i < c->shape->capacity; i++) {
+            Symbol key = Context_keyAt(c, i);
+            if (key) {
                 for (int j = marker; j < end; j++) {
-                    if (GET_SYMBOL(vm->stack->values[j]) == c->keys[i]) {
+                    if (GET_SYMBOL(vm->stack->values[j]) == key) {
                         goto skip_pushing;
                     }
                 }
-                fpPush(vm, FROM_SYMBOL(c->keys[i]));
+                fpPush(vm, FROM_SYMBOL(key));
                 skip_pushing:;
             }
         }
@@ -139,22 +166,16 @@ bool builtin_hasb(VM* vm) {
     Symbol s;
     // todo: string-or-symbol char in extract?
     if (!fpExtract(vm, "cy", &c, &s)) return false;
-    bool found = false;
-    for (int i = 0; i < c->capacity; i++) {
-        if (c->keys[i] == s) {
-            found = true;
-            break;
-        }
-    }
-    fpPush(vm, found ? VAL_TRUE : VAL_FALSE);
+    fpPush(vm, Context_getLocal(c, s) ? VAL_TRUE : VAL_FALSE);
     return true;
 }
 
 bool builtin_lsb(VM* vm) {
     Context* c;
     if (!fpExtract(vm, "c", &c)) return false;
-    for (int i = 0; i < c->capacity; i++) {
-        if (c->keys[i]) fpPush(vm, FROM_SYMBOL(c->keys[i]));
+    for (int i = 0; i < c->shape->capacity; i++) {
+        Symbol key = Context_keyAt(c, i);
+        if (key) fpPush(vm, FROM_SYMBOL(key));
     }
     return true;
 }
@@ -162,7 +183,12 @@ bool builtin_lsb(VM* vm) {
 bool builtin_type(VM* vm) {
     Value v;
     if (!fpExtract(vm, "v", &v)) return false;
-    fpPush(vm, FROM_SYMBOL(vm->symTypes[GET_TYPE(v)]));
+    Type t = GET_TYPE(v);
+    if (t == TYPE_NATIVE) {
+        fpPush(vm, FROM_SYMBOL(vm->symNatives[GET_NATIVE(v)->kind]));
+    } else {
+        fpPush(vm, FROM_SYMBOL(vm->symTypes[t]));
+    }
     return true;
 }
 
@@ -174,7 +200,7 @@ bool builtin_getp(VM* vm) {
         if (parent) fpPush(vm, fpFromContext(parent));
         else fpPush(vm, VAL_NIL);
     } else {
-        fpPush(vm, fpFromContext(vm->typeProtos[GET_TYPE(v)]));
+        fpPush(vm, fpFromContext(getContext(vm, v)));
     }
     return true;
 }
@@ -228,6 +254,7 @@ bool builtin_bitshift(VM* vm) {
 bool builtin_strcat(VM* vm) {
     int n;
     const char** strs;
+    int top = vm->stack->next;
     if (!fpExtract(vm, "*s", &n, &strs)) return false;
     int length = 0;
     for (int i = 0; i < n; i++) length += strlen(strs[i]);
@@ -237,7 +264,9 @@ bool builtin_strcat(VM* vm) {
     }
     buf[length] = 0;
     // todo: some helper stack wipe function?
-    memset(vm->stack->values, 0, vm->stack->capacity * sizeof(Value));
+    // (the pointers were written over the extracted values, below top)
+    memset(&vm->stack->values[vm->stack->next], 0,
+        (top - vm->stack->next) * sizeof(Value));
     fpPush(vm, fpFromString(buf));
     return true;
 }
@@ -343,31 +372,30 @@ bool builtin_strstr(VM* vm) {
     return true;
 }
 
+// one string per ascii char, 8 byte aligned so they can be NaN-boxed as is
 static char* charpool;
+static pthread_once_t charpoolOnce = PTHREAD_ONCE_INIT;
 
-bool builtin_stropen(VM* vm) {
-    if (!charpool) {
-        charpool = GC_MALLOC_ATOMIC(128 * 2);
-        for (int i = 0; i < 128; i++) {
-            charpool[i*2] = i;
-            charpool[i*2+1] = 0;
-        }
+static void initCharpool(void) {
+    charpool = GC_MALLOC_ATOMIC(128 * 8);
+    for (int i = 0; i < 128; i++) {
+        charpool[i*8] = i;
+        charpool[i*8+1] = 0;
     }
+}
+
+// Get a string of the single char c (also used by iter.c).
+Value charString(unsigned char c) {
+    pthread_once(&charpoolOnce, initCharpool);
+    if (c < 128) return fpFromString(&charpool[c*8]);
+    char tmp[2] = { c, 0 };
+    return fpFromString(GC_strdup(tmp));
+}
 
+bool builtin_stropen(VM* vm) {
     const char* str;
     if (!fpExtract(vm, "s", &str)) return false;
-
-    char tmp[2];
-    tmp[1] = 0;
-    for (int i = 0; str[i]; i++) {
-        unsigned char c = str[i];
-        if (c < 128) {
-            fpPush(vm, fpFromString(&charpool[c*2]));
-        } else {
-            tmp[0] = str[i];
-            fpPush(vm, fpFromString(GC_strdup(tmp)));
-        }
-    }
+    for (int i = 0; str[i]; i++) fpPush(vm, charString(str[i]));
     return true;
 }
 
@@ -537,6 +565,14 @@ bool builtin_clock(VM* vm) {
     return true;
 }
 
+// pushes seconds on a monotonic clock, for timing across threads
+bool builtin_now(VM* vm) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    fpPush(vm, fpFromDouble(ts.tv_sec + ts.tv_nsec * 1e-9));
+    return true;
+}
+
 bool builtin_gccollect(VM* vm) {
     GC_gcollect_and_unmap();
     return true;
@@ -552,6 +588,32 @@ bool builtin_gcdump(VM* vm) {
     return true;
 }
 
+// pushes inline cache hit/miss counts, resetting them if given true
+bool builtin_icstats(VM* vm) {
+    bool reset = false;
+    if (vm->stack->next > vm->base && GET_TYPE(vm->stack->values[vm->stack->next-1]) == TYPE_ODDBALL) {
+        if (!fpExtract(vm, "b", &reset)) return false;
+    }
+    Context* ctx = fpContextCreate(NULL);
+    fpContextBind(ctx, fpIntern("hits"), fpFromDouble(vm->icHits));
+    fpContextBind(ctx, fpIntern("misses"), fpFromDouble(vm->icMisses));
+    fpPush(vm, fpFromContext(ctx));
+    if (reset) vm->icHits = vm->icMisses = 0;
+    return true;
+}
+
+// starts timing every call, discarding any trace already in progress
+bool builtin_profile_start(VM* vm) {
+    Profiler_traceStart(vm);
+    return true;
+}
+
+// pushes the calls traced since profile_start (see Profiler_traceStop)
+bool builtin_profile_stop(VM* vm) {
+    Profiler_traceStop(vm);
+    return true;
+}
+
 bool builtin_throw(VM* vm) {
     Symbol sym;
     const char* msg;
@@ -572,15 +634,7 @@ bool builtin_exit(VM* vm) {
 }
 
 bool builtin_list(VM* vm) {
-    Stack* list = GC_MALLOC(sizeof(Stack));
-    *list = (Stack) {
-        .values = vm->stack->values,
-        .next = vm->stack->next,
-        .capacity = vm->stack->capacity
-    };
-    vm->stack->values = NULL;
-    vm->stack->next = 0;
-    vm->stack->capacity = 0;
+    Stack* list = Stack_split(vm->stack, vm->base);
     fpPush(vm, FROM_LIST(list));
     return true;
 }
@@ -597,7 +651,7 @@ bool builtin_lstopen(VM* vm) {
 
 bool builtin_lstpush(VM* vm) {
     // this function is called often so we avoid fpExtract
-    if (vm->stack->next < 2) {
+    if (vm->stack->next - vm->base < 2) {
         fpRaiseUnderflow(vm, 2);
         return false;
     }
@@ -662,14 +716,7 @@ bool builtin_lstchange(VM* vm) {
     Stack* list;
     if (!fpExtract(vm, "l", &list)) return false;
     GC_FREE(list->values);
-    *list = (Stack) {
-        .values = vm->stack->values,
-        .next = vm->stack->next,
-        .capacity = vm->stack->capacity
-    };
-    vm->stack->values = NULL;
-    vm->stack->next = 0;
-    vm->stack->capacity = 0;
+    *list = *Stack_split(vm->stack, vm->base);
     return true;
 }
 
@@ -693,46 +740,596 @@ bool builtin_lstsub(VM* vm) {
     return true;
 }
 
-bool builtin_rand(VM* vm) {
-    fpPush(vm, fpFromDouble(rand()));
+// creates a dict from the key value pairs in the current group
+bool builtin_dict(VM* vm) {
+    int n = vm->stack->next - vm->base;
+    if (n % 2) {
+        fpRaiseInvalid(vm, "expected key value pairs");
+        return false;
+    }
+    // keep the pairs on the stack while _hash or _eq may be called
+    Dict* dict = Dict_create(NATIVE_DICT, n / 2);
+    for (int i = 0; i < n; i += 2) {
+        Value* pair = &vm->stack->values[vm->base + i];
+        if (!Dict_set(vm, dict, pair[0], pair[1])) return false;
+    }
+    vm->stack->next = vm->base;
+    fpPush(vm, FROM_NATIVE(dict));
     return true;
 }
 
-// todo: remove global variables by avoiding qsort
-static VM* sort_vm;
-static int compare_values(const void* p1, const void* p2) {
-    if (!sort_vm) return 0;
-    int a = *(int*) p1, b = *(int*) p2;
-    int result = 0;
-    Value* stk = sort_vm->stack->values;
-    if (!fpValueCompare(sort_vm, stk[a], stk[b], &result)) {
-        sort_vm = NULL;
-        return 0;
+extern void raiseUnboundKey(VM* vm, AstNode* node, Value key, const char* in);
+
+bool builtin_dictget(VM* vm) {
+    Dict* dict;
+    Value key, * pv;
+    if (!fpExtract(vm, "Dv", &dict, &key)) return false;
+    if (!Dict_get(vm, dict, key, &pv)) return false;
+    if (!pv) {
+        raiseUnboundKey(vm, NULL, key, "dict");
+        return false;
     }
-    return result;
+    fpPush(vm, *pv);
+    return true;
 }
 
-bool builtin_sort(VM* vm) {
-    int size = vm->stack->next;
-    int* indices = GC_MALLOC_ATOMIC(sizeof(int) * size);
-    for (int i = 0; i < size; i++) indices[i] = i;
-    sort_vm = vm;
-    qsort(indices, size, sizeof(int), compare_values);
-    if (!sort_vm) return false;
-    Value* newValues = GC_MALLOC_IGNORE_OFF_PAGE(vm->stack->capacity * sizeof(Value));
-    for (int i = 0; i < size; i++) {
-        newValues[i] = vm->stack->values[indices[i]];
+bool builtin_dicthas(VM* vm) {
+    Dict* dict;
+    Value key, * pv;
+    if (!fpExtract(vm, "Dv", &dict, &key)) return false;
+    if (!Dict_get(vm, dict, key, &pv)) return false;
+    fpPush(vm, FROM_BOOL(pv != NULL));
+    return true;
+}
+
+bool builtin_dictset(VM* vm) {
+    Dict* dict;
+    Value key, value;
+    if (!fpExtract(vm, "Dvv", &dict, &key, &value)) return false;
+    return Dict_set(vm, dict, key, value);
+}
+
+// pushes the value of a key, setting it to the value given if not present
+bool builtin_dicttouch(VM* vm) {
+    Dict* dict;
+    Value key, value, result;
+    if (!fpExtract(vm, "Dvv", &dict, &key, &value)) return false;
+    if (!Dict_touch(vm, dict, key, value, &result)) return false;
+    fpPush(vm, result);
+    return true;
+}
+
+// pushes whether the key was present
+bool builtin_dictdel(VM* vm) {
+    Dict* dict;
+    Value key;
+    bool found;
+    if (!fpExtract(vm, "Dv", &dict, &key)) return false;
+    if (!Dict_delete(vm, dict, key, &found)) return false;
+    fpPush(vm, FROM_BOOL(found));
+    return true;
+}
+
+bool builtin_dictlen(VM* vm) {
+    Dict* dict;
+    if (!fpExtract(vm, "D", &dict)) return false;
+    fpPush(vm, fpFromDouble(dict->count));
+    return true;
+}
+
+// pushes keys, values or both (alternating) of a dict in insertion order
+static bool dictOpen(VM* vm, bool keys, bool values) {
+    Dict* dict;
+    if (!fpExtract(vm, "D", &dict)) return false;
+    Stack_reserve(vm->stack, dict->count * (keys + values));
+    for (int i = 0; i < dict->used; i++) {
+        DictEntry* entry = &dict->entries[i];
+        if (IS_UNBOUND(entry->key)) continue;
+        if (keys) Stack_push(vm->stack, entry->key);
+        if (values) Stack_push(vm->stack, entry->value);
     }
-    GC_FREE(indices);
-    GC_FREE(vm->stack->values);
-    vm->stack->values = newValues;
     return true;
 }
 
-bool builtin_math1(VM* vm) {
-    double x;
-    int op;
-    if (!fpExtract(vm, "di", &x, &op)) return false;
+bool builtin_dictopen(VM* vm) {
+    return dictOpen(vm, true, true);
+}
+
+bool builtin_dictkeys(VM* vm) {
+    return dictOpen(vm, true, false);
+}
+
+bool builtin_dictvals(VM* vm) {
+    return dictOpen(vm, false, true);
+}
+
+extern bool valueHash(VM* vm, AstNode* node, Value v, u32* hash);
+
+// pushes the hash of a value as used by dicts, e.g. for a _hash metamethod
+// hashing fields which its _eq compares
+bool builtin_hash(VM* vm) {
+    Value v;
+    if (!fpExtract(vm, "v", &v)) return false;
+    u32 hash;
+    if (!valueHash(vm, NULL, v, &hash)) return false;
+    fpPush(vm, fpFromDouble(hash));
+    return true;
+}
+
+// creates a set of the values in the current group
+bool builtin_set(VM* vm) {
+    int n = vm->stack->next - vm->base;
+    Dict* set = Dict_create(NATIVE_SET, n);
+    for (int i = 0; i < n; i++) {
+        if (!Dict_set(vm, set, vm->stack->values[vm->base + i], VAL_NIL)) return false;
+    }
+    vm->stack->next = vm->base;
+    fpPush(vm, FROM_NATIVE(set));
+    return true;
+}
+
+bool builtin_sethas(VM* vm) {
+    Dict* set;
+    Value v, * pv;
+    if (!fpExtract(vm, "Sv", &set, &v)) return false;
+    if (!Dict_get(vm, set, v, &pv)) return false;
+    fpPush(vm, FROM_BOOL(pv != NULL));
+    return true;
+}
+
+// adds the values in the current group to a set
+bool builtin_setadd(VM* vm) {
+    Dict* set;
+    if (!fpExtract(vm, "S", &set)) return false;
+    for (int i = vm->base; i < vm->stack->next; i++) {
+        if (!Dict_set(vm, set, vm->stack->values[i], VAL_NIL)) return false;
+    }
+    vm->stack->next = vm->base;
+    return true;
+}
+
+// pushes whether the value was present
+bool builtin_setdel(VM* vm) {
+    Dict* set;
+    Value v;
+    bool found;
+    if (!fpExtract(vm, "Sv", &set, &v)) return false;
+    if (!Dict_delete(vm, set, v, &found)) return false;
+    fpPush(vm, FROM_BOOL(found));
+    return true;
+}
+
+bool builtin_setlen(VM* vm) {
+    Dict* set;
+    if (!fpExtract(vm, "S", &set)) return false;
+    fpPush(vm, fpFromDouble(set->count));
+    return true;
+}
+
+bool builtin_setopen(VM* vm) {
+    Dict* set;
+    if (!fpExtract(vm, "S", &set)) return false;
+    Stack_reserve(vm->stack, set->count);
+    for (int i = 0; i < set->used; i++) {
+        if (!IS_UNBOUND(set->entries[i].key)) Stack_push(vm->stack, set->entries[i].key);
+    }
+    return true;
+}
+
+// pushes a new set of the values in a and/or b, by mode #union, #inter or #diff
+bool builtin_setop(VM* vm) {
+    Dict* a, * b;
+    Symbol mode;
+    if (!fpExtract(vm, "SSy", &a, &b, &mode)) return false;
+    const char* name = Symbol_name(mode);
+    Dict* result;
+    if (!strcmp(name, "union")) {
+        result = Dict_copy(a);
+        for (int i = 0; i < b->used; i++) {
+            Value v = b->entries[i].key;
+            if (IS_UNBOUND(v)) continue;
+            if (!Dict_set(vm, result, v, VAL_NIL)) return false;
+        }
+    } else if (!strcmp(name, "inter") || !strcmp(name, "diff")) {
+        bool keep = name[0] == 'i';
+        result = Dict_create(NATIVE_SET, 0);
+        for (int i = 0; i < a->used; i++) {
+            Value v = a->entries[i].key, * pv;
+            if (IS_UNBOUND(v)) continue;
+            if (!Dict_get(vm, b, v, &pv)) return false;
+            if ((pv != NULL) == keep && !Dict_set(vm, result, v, VAL_NIL)) return false;
+        }
+    } else {
+        fpRaiseInvalid(vm, "expected #union, #inter or #diff");
+        return false;
+    }
+    fpPush(vm, FROM_NATIVE(result));
+    return true;
+}
+
+// keeps the values in the current group which are in a set, or if given
+// false, those which are not
+bool builtin_setfilter(VM* vm) {
+    Dict* set;
+    bool keep;
+    if (!fpExtract(vm, "Sb", &set, &keep)) return false;
+    int next = vm->base;
+    for (int i = vm->base; i < vm->stack->next; i++) {
+        Value v = vm->stack->values[i], * pv;
+        if (!Dict_get(vm, set, v, &pv)) return false;
+        if ((pv != NULL) == keep) vm->stack->values[next++] = v;
+    }
+    vm->stack->next = next;
+    return true;
+}
+
+extern bool arrayOperand(VM* vm, AstNode* node, Value v, ArrayOperand* operand);
+
+static bool arrayType(VM* vm, Symbol sym, ArrayType* type) {
+    const char* name = Symbol_name(sym);
+    for (int i = 0; i < ARRAY_TYPE_COUNT; i++) {
+        if (!strcmp(name, arrayTypeNames[i])) {
+            *type = i;
+            return true;
+        }
+    }
+    fpRaiseInvalid(vm, "expected #u8, #i32 or #f64");
+    return false;
+}
+
+// creates an array of the numbers in the current group, of element type #f64,
+// or #i32 or #u8 if given last
+bool builtin_array(VM* vm) {
+    ArrayType type = ARRAY_F64;
+    int top = vm->stack->next - 1;
+    if (top >= vm->base && GET_TYPE(vm->stack->values[top]) == TYPE_SYMBOL) {
+        // (the group is dropped on failure, as fpExtract would)
+        vm->stack->next = vm->base;
+        if (!arrayType(vm, GET_SYMBOL(vm->stack->values[top]), &type)) return false;
+        vm->stack->next = top;
+    }
+    int n;
+    double* values;
+    if (!fpExtract(vm, "*d", &n, &values)) return false;
+    Array* array = Array_create(type, n);
+    for (int i = 0; i < n; i++) Array_set(array, i, values[i]);
+    fpPush(vm, FROM_NATIVE(array));
+    return true;
+}
+
+bool builtin_arrayget(VM* vm) {
+    Array* array;
+    int index;
+    if (!fpExtract(vm, "Ai", &array, &index)) return false;
+    if (index < 0) index += array->length;
+    if (index < 0 || index >= array->length) {
+        fpRaiseInvalid(vm, "out of bounds");
+        return false;
+    }
+    fpPush(vm, FROM_NUMBER(Array_get(array, index)));
+    return true;
+}
+
+bool builtin_arraylen(VM* vm) {
+    Array* array;
+    if (!fpExtract(vm, "A", &array)) return false;
+    fpPush(vm, fpFromDouble(array->length));
+    return true;
+}
+
+bool builtin_arrayopen(VM* vm) {
+    Array* array;
+    if (!fpExtract(vm, "A", &array)) return false;
+    Stack_reserve(vm->stack, array->length);
+    for (int i = 0; i < array->length; i++) {
+        Stack_push(vm->stack, FROM_NUMBER(Array_get(array, i)));
+    }
+    return true;
+}
+
+bool builtin_arraytype(VM* vm) {
+    Array* array;
+    if (!fpExtract(vm, "A", &array)) return false;
+    fpPush(vm, FROM_SYMBOL(fpIntern(arrayTypeNames[array->type])));
+    return true;
+}
+
+bool builtin_arrayconv(VM* vm) {
+    Array* array;
+    Symbol sym;
+    ArrayType type;
+    if (!fpExtract(vm, "Ay", &array, &sym)) return false;
+    if (!arrayType(vm, sym, &type)) return false;
+    fpPush(vm, FROM_NATIVE(Array_convert(array, type)));
+    return true;
+}
+
+// pushes a blob of the bytes of an array, without copying them
+bool builtin_arrayblob(VM* vm) {
+    Array* array;
+    if (!fpExtract(vm, "A", &array)) return false;
+    Value blob = Value_makeBlob((size_t) array->length * arrayTypeSizes[array->type],
+        array->data);
+    // (the array, in case its data is not its own)
+    GET_BLOB(blob)->owner = array;
+    fpPush(vm, blob);
+    return true;
+}
+
+// pushes an array of the given element type viewing the bytes of a blob
+bool builtin_blobarray(VM* vm) {
+    Blob* blob;
+    Symbol sym;
+    ArrayType type;
+    if (!fpExtract(vm, "By", &blob, &sym)) return false;
+    if (!arrayType(vm, sym, &type)) return false;
+    int width = arrayTypeSizes[type];
+    if (blob->size % width) {
+        fpRaiseInvalid(vm, "blob size not a multiple of element size");
+        return false;
+    }
+    if (blob->size / width > INT_MAX) {
+        fpRaiseInvalid(vm, "blob too large for an array");
+        return false;
+    }
+    fpPush(vm, FROM_NATIVE(Array_wrap(type, blob->size / width, blob->data, blob)));
+    return true;
+}
+
+// pushes a * b + c, computed elementwise where any of them are arrays
+bool builtin_arrayfma(VM* vm) {
+    Value values[3];
+    ArrayOperand operands[3];
+    if (!fpExtract(vm, "vvv", &values[0], &values[1], &values[2])) return false;
+    for (int i = 0; i < 3; i++) {
+        if (!arrayOperand(vm, NULL, values[i], &operands[i])) return false;
+    }
+    if (!operands[0].array && !operands[1].array && !operands[2].array) {
+        fpPush(vm, FROM_NUMBER(operands[0].number * operands[1].number + operands[2].number));
+        return true;
+    }
+    Array* result = Array_fma(operands[0], operands[1], operands[2]);
+    if (!result) {
+        fpRaiseInvalid(vm, "array lengths differ");
+        return false;
+    }
+    fpPush(vm, FROM_NATIVE(result));
+    return true;
+}
+
+bool builtin_arraysum(VM* vm) {
+    Array* array;
+    if (!fpExtract(vm, "A", &array)) return false;
+    fpPush(vm, FROM_NUMBER(Array_sum(array)));
+    return true;
+}
+
+// pushes an iterator over a list, string, blob, array or context (see iter.h)
+bool builtin_iter(VM* vm) {
+    Value v;
+    if (!fpExtract(vm, "v", &v)) return false;
+    Iterator* it;
+    if (!Iterator_of(vm, NULL, v, &it)) return false;
+    fpPush(vm, FROM_NATIVE(it));
+    return true;
+}
+
+// pushes the next value of an iterator and true, or false once it is done
+bool builtin_iternext(VM* vm) {
+    Iterator* it;
+    if (!fpExtract(vm, "I", &it)) return false;
+    Value v;
+    bool done;
+    if (!Iterator_next(vm, NULL, it, &v, &done)) return false;
+    if (!done) fpPush(vm, v);
+    fpPush(vm, done ? VAL_FALSE : VAL_TRUE);
+    return true;
+}
+
+bool builtin_iteropen(VM* vm) {
+    Iterator* it;
+    if (!fpExtract(vm, "I", &it)) return false;
+    while (true) {
+        Value v;
+        bool done;
+        if (!Iterator_next(vm, NULL, it, &v, &done)) return false;
+        if (done) return true;
+        fpPush(vm, v);
+    }
+}
+
+// pushes an iterator over the numbers first to last would push
+bool builtin_rangeiter(VM* vm) {
+    double first, last;
+    if (!fpExtract(vm, "dd", &first, &last)) return false;
+    fpPush(vm, FROM_NATIVE(Iterator_range(first, last)));
+    return true;
+}
+
+// pushes a coroutine evaluating a closure, which starts once resumed
+bool builtin_cospawn(VM* vm) {
+    Value fn;
+    if (!fpExtract(vm, "v", &fn)) return false;
+    fpPush(vm, FROM_NATIVE(Coroutine_create(vm, fn)));
+    return true;
+}
+
+// resumes a coroutine, passing it the given number of values before it
+bool builtin_coresume(VM* vm) {
+    Coroutine* co;
+    int count;
+    if (!fpExtract(vm, "Ci", &co, &count)) return false;
+    if (count < 0) {
+        fpRaiseInvalid(vm, "value count must be non-negative");
+        return false;
+    } else if (vm->stack->next - vm->base < count) {
+        fpRaiseUnderflow(vm, count);
+        return false;
+    }
+    return Coroutine_resume(vm, NULL, co, count);
+}
+
+bool builtin_coyield(VM* vm) {
+    return Coroutine_yield(vm, NULL);
+}
+
+bool builtin_costatus(VM* vm) {
+    Coroutine* co;
+    if (!fpExtract(vm, "C", &co)) return false;
+    fpPush(vm, FROM_SYMBOL(fpIntern(coStatusNames[co->status])));
+    return true;
+}
+
+// pushes a task evaluating a closure on the pool, to be joined for its results
+bool builtin_taskspawn(VM* vm) {
+    Value fn;
+    if (!fpExtract(vm, "v", &fn)) return false;
+    fpPush(vm, FROM_NATIVE(Task_spawn(vm, fn)));
+    return true;
+}
+
+// replaces the group with a task already done, with the group as its results
+bool builtin_taskdone(VM* vm) {
+    int count = vm->stack->next - vm->base;
+    Task* task = Task_done(&vm->stack->values[vm->base], count);
+    vm->stack->next = vm->base;
+    fpPush(vm, FROM_NATIVE(task));
+    return true;
+}
+
+bool builtin_taskjoin(VM* vm) {
+    Task* task;
+    if (!fpExtract(vm, "T", &task)) return false;
+    return Task_join(vm, task);
+}
+
+extern void raiseNativeType(VM* vm, AstNode* node, NativeKind kind);
+
+// joins each task of a list in turn, pushing all of their results
+bool builtin_taskall(VM* vm) {
+    Stack* list;
+    if (!fpExtract(vm, "l", &list)) return false;
+    for (int i = 0; i < list->next; i++) {
+        Value v = list->values[i];
+        if (GET_TYPE(v) != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_TASK) {
+            raiseNativeType(vm, NULL, NATIVE_TASK);
+            return false;
+        }
+    }
+    for (int i = 0; i < list->next; i++) {
+        if (!Task_join(vm, (Task*) GET_NATIVE(list->values[i]))) return false;
+    }
+    return true;
+}
+
+bool builtin_taskstatus(VM* vm) {
+    Task* task;
+    if (!fpExtract(vm, "T", &task)) return false;
+    fpPush(vm, FROM_SYMBOL(fpIntern(taskStatusNames[atomic_load(&task->status)])));
+    return true;
+}
+
+// pushes an actor running a file, with copies of a list of values as its
+// arguments, and a mailbox of the given size
+bool builtin_actorspawn(VM* vm) {
+    const char* path;
+    Stack* args;
+    int capacity;
+    if (!fpExtract(vm, "sli", &path, &args, &capacity)) return false;
+    if (capacity < 1) {
+        fpRaiseInvalid(vm, "mailbox size must be positive");
+        return false;
+    }
+    Actor* actor = Actor_spawn(vm, path, args, capacity);
+    if (!actor) return false;
+    fpPush(vm, FROM_NATIVE(actor));
+    return true;
+}
+
+bool builtin_actorself(VM* vm) {
+    fpPush(vm, FROM_NATIVE(Actor_self(vm)));
+    return true;
+}
+
+// pushes a list of the arguments of the VM's actor, empty unless spawned
+bool builtin_actorargs(VM* vm) {
+    fpPush(vm, FROM_LIST(Actor_self(vm)->args));
+    return true;
+}
+
+bool builtin_actorsend(VM* vm) {
+    Value message;
+    Actor* actor;
+    if (!fpExtract(vm, "vR", &message, &actor)) return false;
+    return Actor_send(vm, actor, message);
+}
+
+bool builtin_actorreceive(VM* vm) {
+    Actor_receive(vm);
+    return true;
+}
+
+bool builtin_actorpoll(VM* vm) {
+    Actor_poll(vm);
+    return true;
+}
+
+bool builtin_actorwait(VM* vm) {
+    Actor* actor;
+    if (!fpExtract(vm, "R", &actor)) return false;
+    return Actor_wait(vm, actor);
+}
+
+bool builtin_actorstatus(VM* vm) {
+    Actor* actor;
+    if (!fpExtract(vm, "R", &actor)) return false;
+    fpPush(vm, FROM_SYMBOL(fpIntern(actorStatusNames[atomic_load(&actor->status)])));
+    return true;
+}
+
+// pushes an iterator over the lines of a file at a path, or of an open file
+// from where it is
+bool builtin_lines(VM* vm) {
+    Value v;
+    if (!fpExtract(vm, "v", &v)) return false;
+    bool isFile = GET_TYPE(v) == TYPE_NATIVE && GET_NATIVE(v)->kind == NATIVE_FILE;
+    if (!isFile && GET_TYPE(v) != TYPE_STRING) {
+        fpRaiseType(vm, TYPE_STRING);
+        return false;
+    }
+    Iterator* it = isFile ? Iterator_lines((File*) GET_NATIVE(v), NULL) :
+        Iterator_lines(NULL, GET_STRING(v));
+    if (!it) {
+        // todo: better type than #invalid (#io?)
+        fpRaiseInvalid(vm, "file not found");
+        return false;
+    }
+    fpPush(vm, FROM_NATIVE(it));
+    return true;
+}
+
+bool builtin_rand(VM* vm) {
+    fpPush(vm, fpFromDouble(rand()));
+    return true;
+}
+
+bool builtin_sort(VM* vm) {
+    return Sort_values(vm, NULL, vm->stack, vm->base, vm->stack->next - vm->base);
+}
+
+bool builtin_sortby(VM* vm) {
+    Value keys, descending;
+    if (!fpExtract(vm, "vv", &keys, &descending)) return false;
+    return Sort_by(vm, NULL, keys, descending);
+}
+
+bool builtin_sortwith(VM* vm) {
+    Value fn;
+    if (!fpExtract(vm, "v", &fn)) return false;
+    return Sort_with(vm, NULL, fn);
+}
+
+static bool math1(int op, double x, double* presult) {
     double result;
     switch (op) {
         case 0: result = sin(x * (M_PI / 180)); break;
@@ -762,10 +1359,49 @@ bool builtin_math1(VM* vm) {
                 case FP_SUBNORMAL: result = 3; break;
                 case FP_NORMAL: result = 4; break;
             } break;
+        case 20: result = fabs(x); break;
         default:
-            fpRaiseInvalid(vm, "invalid operation");
             return false;
     }
+    *presult = result;
+    return true;
+}
+
+// applies the math function op to a number, or to each element of an array
+bool builtin_math1(VM* vm) {
+    Value x;
+    int op;
+    if (!fpExtract(vm, "vi", &x, &op)) return false;
+    double result;
+    if (GET_TYPE(x) == TYPE_NATIVE && GET_NATIVE(x)->kind == NATIVE_ARRAY) {
+        Array* array = (Array*) GET_NATIVE(x);
+        switch (op) {
+            case 11: array = Array_unary(ARRAY_SQRT, array); break;
+            case 13: array = Array_unary(ARRAY_FLOOR, array); break;
+            case 20: array = Array_unary(ARRAY_ABS, array); break;
+            default: {
+                if (!math1(op, 0, &result)) {
+                    fpRaiseInvalid(vm, "invalid operation");
+                    return false;
+                }
+                Array* src = Array_convert(array, ARRAY_F64);
+                array = Array_create(ARRAY_F64, src->length);
+                const double* in = src->data;
+                double* out = Array_data(array);
+                for (int i = 0; i < src->length; i++) math1(op, in[i], &out[i]);
+            }
+        }
+        fpPush(vm, FROM_NATIVE(array));
+        return true;
+    }
+    if (GET_TYPE(x) != TYPE_NUMBER) {
+        fpRaiseType(vm, TYPE_NUMBER);
+        return false;
+    }
+    if (!math1(op, GET_NUMBER(x), &result)) {
+        fpRaiseInvalid(vm, "invalid operation");
+        return false;
+    }
     fpPush(vm, FROM_NUMBER(result));
     return true;
 }
@@ -860,16 +1496,24 @@ bool builtin_sysctl(VM* vm) {
 bool builtin_strblob(VM* vm) {
     const char* str;
     if (!fpExtract(vm, "s", &str)) return false;
-    int len = strlen(str);
+    size_t len = strlen(str);
     fpPush(vm, Value_makeBlob(len, (const u8*) str));
     return true;
 }
 
+// the bytes of a blob as a string, up to the first 0 byte if any
+bool builtin_blobstr(VM* vm) {
+    Blob* blob;
+    if (!fpExtract(vm, "B", &blob)) return false;
+    fpPush(vm, fpFromString(GC_strndup((const char*) blob->data, blob->size)));
+    return true;
+}
+
 bool builtin_blobcat(VM* vm) {
     Blob* b1, *b2;
     if (!fpExtract(vm, "BB", &b1, &b2)) return false;
-    int newLen = b1->size + b2->size;
-    u8* newData = GC_MALLOC(newLen);
+    size_t newLen = b1->size + b2->size;
+    u8* newData = GC_MALLOC_ATOMIC(newLen);
     memcpy(newData, b1->data, b1->size);
     memcpy(newData + b1->size, b2->data, b2->size);
     fpPush(vm, Value_makeBlob(newLen, newData));
@@ -879,7 +1523,7 @@ bool builtin_blobcat(VM* vm) {
 bool builtin_blobopen(VM* vm) {
     Blob* b;
     if (!fpExtract(vm, "B", &b)) return false;
-    for (int i = 0; i < b->size; i++) {
+    for (size_t i = 0; i < b->size; i++) {
         fpPush(vm, FROM_NUMBER(b->data[i]));
     }
     return true;
@@ -897,25 +1541,31 @@ bool builtin_blobmk(VM* vm) {
     return true;
 }
 
+// pushes a blob viewing part of another, without copying it, so that windows
+// of a mapped file are not read into the heap
 bool builtin_blobsub(VM* vm) {
     Blob* blob;
     bool hasBegin, hasEnd;
-    int begin, end;
-    if (!fpExtract(vm, "B?i?i",
-        &blob, &hasBegin, &begin, &hasEnd, &end)) return false;
-    int len = blob->size;
-    if (!hasBegin) begin = 0;
+    double b, e;
+    // as doubles, since blobs may be longer than ints reach
+    if (!fpExtract(vm, "B?d?d",
+        &blob, &hasBegin, &b, &hasEnd, &e)) return false;
+    if ((hasBegin && b != (long long) b) || (hasEnd && e != (long long) e)) {
+        fpRaiseInvalid(vm, "expected integer");
+        return false;
+    }
+    long long len = blob->size;
+    long long begin = hasBegin ? b : 0, end = hasEnd ? e : len;
     if (begin < 0) begin += len;
-    if (!hasEnd) end = len;
     if (end < 0) end += len;
     if (begin < 0 || end < 0 || end < begin || begin > len || end > len) {
         fpRaiseInvalid(vm, "out of bounds");
         return false;
     }
-    int newLen = end - begin;
-    u8* newData = GC_MALLOC(newLen);
-    memcpy(newData, blob->data + begin, newLen);
-    fpPush(vm, Value_makeBlob(newLen, newData));
+    Value sub = Value_makeBlob(end - begin, blob->data + begin);
+    // (whatever the blob's data is kept alive by, else the blob itself)
+    GET_BLOB(sub)->owner = blob->owner ? blob->owner : blob;
+    fpPush(vm, sub);
     return true;
 }
 
@@ -979,7 +1629,7 @@ bool builtin_blobenc(VM* vm) {
     int offs = 0;
     int size = 0;
     if (!blobFmtCalc(vm, fmt, &offs, &size)) return false;
-    if (vm->stack->next < offs) {
+    if (vm->stack->next - vm->base < offs) {
         fpRaiseUnderflow(vm, offs);
         return false;
     }
@@ -1092,12 +1742,12 @@ bool builtin_blobdec(VM* vm) {
     const char* fmt;
     if (!fpExtract(vm, "Bs", &blob, &fmt)) return false;
 
-    int len = blob->size;
+    size_t len = blob->size;
     const u8* data = blob->data;
     int offs = 0;
     int size = 0;
     blobFmtCalc(vm, fmt, &offs, &size);
-    if (size != len) {
+    if ((size_t) size != len) {
         fpRaiseInvalid(vm, "blob size does not match format");
         return false;
     }
@@ -1170,8 +1820,7 @@ bool builtin_blobdec(VM* vm) {
                 } break;
                 case 'd': {
                     for (int i = 0; i < mod; i++) {
-                        // todo: if nan tagging is ever used,
-                        // need to change this here to check for nans
+                        // note: fpFromDouble canonicalizes NaNs if NaN-boxed
                         double d = ((double*)&data[head])[i];
                         fpPush(vm, fpFromDouble(d));
                     } head += mod * 4;
@@ -1192,11 +1841,17 @@ bool builtin_read(VM* vm) {
         fpRaiseInvalid(vm, "file not found");
         return false;
     }
-    fseek(f, 0, SEEK_END);
-    int size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    char* buffer = GC_MALLOC(size);
-    if (fread(buffer, size, 1, f) != 1) {
+    struct stat st;
+    if (fstat(fileno(f), &st) != 0 || (u64) st.st_size > SIZE_MAX) {
+        fclose(f);
+        // todo: better type than #invalid (#io?)
+        fpRaiseInvalid(vm, "error reading file");
+        return false;
+    }
+    size_t size = st.st_size;
+    // (bytes only, so not scanned for pointers)
+    char* buffer = GC_MALLOC_ATOMIC(size);
+    if (size && fread(buffer, size, 1, f) != 1) {
         fclose(f);
         // todo: better type than #invalid (#io?)
         fpRaiseInvalid(vm, "error reading file");
@@ -1207,6 +1862,51 @@ bool builtin_read(VM* vm) {
     return true;
 }
 
+static void unmapBlob(void* obj, void* data) {
+    (void) data;
+    Blob* blob = obj;
+    munmap((void*) blob->data, blob->size);
+}
+
+// pushes a blob of a file mapped read only, rather than read into the heap,
+// unmapped once the blob (and any array viewing it) is collected
+bool builtin_mmap(VM* vm) {
+    const char* path;
+    if (!fpExtract(vm, "s", &path)) return false;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        // todo: better type than #invalid (#io?)
+        fpRaiseInvalid(vm, "file not found");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (u64) st.st_size > SIZE_MAX) {
+        close(fd);
+        fpRaiseInvalid(vm, "error reading file");
+        return false;
+    }
+    size_t size = st.st_size;
+    // empty files cannot be mapped
+    if (!size) {
+        close(fd);
+        fpPush(vm, Value_makeBlob(0, (const u8*) ""));
+        return true;
+    }
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping outlives the descriptor
+    close(fd);
+    if (data == MAP_FAILED) {
+        fpRaiseInvalid(vm, "could not map file");
+        return false;
+    }
+    // mostly read through once, as by iterators and scans
+    madvise(data, size, MADV_SEQUENTIAL);
+    Value blob = Value_makeBlob(size, data);
+    GC_register_finalizer(GET_BLOB(blob), unmapBlob, NULL, NULL, NULL);
+    fpPush(vm, blob);
+    return true;
+}
+
 bool builtin_write(VM* vm) {
     const char* path;
     Blob* blob;
@@ -1247,6 +1947,116 @@ bool builtin_append(VM* vm) {
     return true;
 }
 
+// pushes a file opened with an fopen mode, to be read and written in pieces
+bool builtin_fileopen(VM* vm) {
+    const char* path, * mode;
+    if (!fpExtract(vm, "ss", &path, &mode)) return false;
+    File* file = File_open(path, mode);
+    if (!file) {
+        // todo: better type than #invalid (#io?)
+        fpRaiseInvalid(vm, errno == ENOENT ? "file not found" : "could not open file");
+        return false;
+    }
+    fpPush(vm, FROM_NATIVE(file));
+    return true;
+}
+
+// pushes a new temporary file, opened for reading and writing
+bool builtin_filetemp(VM* vm) {
+    File* file = File_temp();
+    if (!file) {
+        fpRaiseInvalid(vm, "could not create file");
+        return false;
+    }
+    fpPush(vm, FROM_NATIVE(file));
+    return true;
+}
+
+// pushes a file for stdin, stdout or stderr (0, 1 or 2)
+bool builtin_filestd(VM* vm) {
+    int n;
+    if (!fpExtract(vm, "i", &n)) return false;
+    if (n < 0 || n > 2) {
+        fpRaiseInvalid(vm, "expected 0, 1 or 2");
+        return false;
+    }
+    fpPush(vm, FROM_NATIVE(File_std(n)));
+    return true;
+}
+
+// pushes the next line of a file, without its newline, or nil at the end
+bool builtin_filereadline(VM* vm) {
+    File* file;
+    if (!fpExtract(vm, "F", &file)) return false;
+    Value line;
+    bool done = false;
+    if (!File_readLine(vm, file, &line, &done)) return false;
+    fpPush(vm, done ? VAL_NIL : line);
+    return true;
+}
+
+// pushes a blob of up to a number of bytes read from a file, empty at the end
+bool builtin_fileread(VM* vm) {
+    double size;
+    File* file;
+    if (!fpExtract(vm, "dF", &size, &file)) return false;
+    if (size < 0 || size != (long long) size) {
+        fpRaiseInvalid(vm, "expected a size");
+        return false;
+    }
+    Value blob;
+    if (!File_read(vm, file, size, &blob)) return false;
+    fpPush(vm, blob);
+    return true;
+}
+
+// writes a string or blob to a file
+bool builtin_filewrite(VM* vm) {
+    Value v;
+    File* file;
+    if (!fpExtract(vm, "vF", &v, &file)) return false;
+    if (GET_TYPE(v) == TYPE_STRING) {
+        const char* str = GET_STRING(v);
+        return File_write(vm, file, str, strlen(str));
+    } else if (GET_TYPE(v) == TYPE_BLOB) {
+        return File_write(vm, file, GET_BLOB_DATA(v), GET_BLOB_SIZE(v));
+    }
+    fpRaiseType(vm, TYPE_BLOB);
+    return false;
+}
+
+bool builtin_fileflush(VM* vm) {
+    File* file;
+    if (!fpExtract(vm, "F", &file)) return false;
+    return File_flush(vm, file);
+}
+
+// seeks to a position in a file, from the end if negative or to it if nil
+bool builtin_fileseek(VM* vm) {
+    bool hasPos;
+    double pos;
+    File* file;
+    if (!fpExtract(vm, "?dF", &hasPos, &pos, &file)) return false;
+    return File_seek(vm, file, hasPos, pos);
+}
+
+bool builtin_filetell(VM* vm) {
+    File* file;
+    if (!fpExtract(vm, "F", &file)) return false;
+    double pos;
+    if (!File_tell(vm, file, &pos)) return false;
+    fpPush(vm, fpFromDouble(pos));
+    return true;
+}
+
+// closes a file, if not already closed (standard streams are only flushed)
+bool builtin_fileclose(VM* vm) {
+    File* file;
+    if (!fpExtract(vm, "F", &file)) return false;
+    File_close(file);
+    return true;
+}
+
 #include <dirent.h>
 bool builtin_dir(VM* vm) {
     const char* path;
@@ -1332,15 +2142,16 @@ static const char* astKindStr[] = {
     "then_else", "until_do",
     "special", "primitive", "import", "this", "sigbind"
 };
-static Symbol astSpcSym[14];
+static Symbol astSpcSym[15];
 static const char* astSpcStr[] = {
     "map", "fold", "filter", "zip",
     "is", "as", "to", "dot",
     "join", "repeat", "with", "catch",
-    "and", "or"
+    "and", "or", "pmap"
 };
 
-static Symbol symKind, symSub, symValue, symHead, symTail;
+static Symbol symKind, symSub, symValue, symHead, symTail, symBytecode;
+static Symbol opCodeSym[OP_COUNT];
 
 static void pushDisasm(VM* vm, AstNode* node) {
     if (!node) return;
@@ -1400,7 +2211,7 @@ static void pushDisasm(VM* vm, AstNode* node) {
             hasSub = true;
             fpBeginList(vm);
             pushDisasm(vm, node->as_node);
-            if (vm->stack->next == 0) hasVal = false;
+            if (vm->stack->next == vm->base) hasVal = false;
             fpEndList(vm);
             v = fpPop(vm); break;
         case AST_CLOSURE:
@@ -1416,7 +2227,7 @@ static void pushDisasm(VM* vm, AstNode* node) {
     if (hasSub) {
         fpBeginList(vm);
         pushDisasm(vm, node->sub);
-        if (vm->stack->next == 0 && ssub != symSub) {
+        if (vm->stack->next == vm->base && ssub != symSub) {
             hasSub = false;
         }
         fpEndList(vm);
@@ -1438,31 +2249,93 @@ static void pushDisasm(VM* vm, AstNode* node) {
     pushDisasm(vm, node->next);
 }
 
-bool builtin_disasm(VM* vm) {
-    // todo: move lookup elsewhere
-    static bool resolvedSyms = false;
-    if (!resolvedSyms) {
-        for (int i = 0; i < 26; i++) {
-            astKindSym[i] = fpIntern(astKindStr[i]);
+static Value chainToList(VM* vm, AstChainElem* curr) {
+    fpBeginList(vm);
+    while (curr) {
+        if (curr->symbol != (Symbol) -1) {
+            fpPush(vm, fpFromSymbol(curr->symbol));
+        } else {
+            fpPush(vm, fpDefault);
         }
-        for (int i = 0; i < 14; i++) {
-            astSpcSym[i] = fpIntern(astSpcStr[i]);
+        curr = curr->next;
+    }
+    fpEndList(vm);
+    return fpPop(vm);
+}
+
+static void pushDisasmCode(VM* vm, Code* code) {
+    for (int i = 0; i < code->count; i++) {
+        Instr* instr = &code->instrs[i];
+        Context* ctx = Context_create(NULL);
+        Context_bind(ctx, symKind, FROM_SYMBOL(opCodeSym[instr->op]));
+        switch (instr->op) {
+            case OP_CONST:
+                Context_bind(ctx, symValue, code->consts[instr->arg]); break;
+            case OP_BRANCH: case OP_LOOP_EXIT: case OP_JUMP:
+            case OP_AND: case OP_OR: case OP_DOTS:
+                Context_bind(ctx, symValue, FROM_NUMBER(instr->arg)); break;
+            case OP_OPERATOR:
+                Context_bind(ctx, symValue, FROM_SYMBOL(vm->symOps[instr->arg])); break;
+            case OP_SPECIAL:
+                Context_bind(ctx, symValue, FROM_SYMBOL(astSpcSym[instr->arg])); break;
+            case OP_SIGBIND:
+                Context_bind(ctx, symValue, FROM_SYMBOL(instr->node->as_symbol)); break;
+            case OP_CALLV: case OP_GETV: case OP_SETV: case OP_BINDV:
+            case OP_HASV: case OP_REFV: case OP_IMPORT:
+            case OP_PREBIND: case OP_PREBIND_BEGIN: case OP_PREBIND_END:
+            case OP_PRECALL_BEGIN: case OP_PRECALL_END:
+            case OP_RESOLVE: case OP_CALL_RESOLVED:
+                Context_bind(ctx, symValue, chainToList(vm, instr->node->as_chain)); break;
+            default: break;
         }
-        symKind = fpIntern("kind");
-        symSub = fpIntern("sub");
-        symValue = fpIntern("value");
-        symHead = fpIntern("head");
-        symTail = fpIntern("tail");
-        resolvedSyms = true;
+        fpPush(vm, FROM_CONTEXT(ctx));
+    }
+}
+
+// todo: move lookup elsewhere
+static pthread_once_t disasmOnce = PTHREAD_ONCE_INIT;
+
+static void resolveDisasmSyms(void) {
+    for (int i = 0; i < 26; i++) {
+        astKindSym[i] = fpIntern(astKindStr[i]);
+    }
+    for (int i = 0; i < 15; i++) {
+        astSpcSym[i] = fpIntern(astSpcStr[i]);
     }
+    symKind = fpIntern("kind");
+    symSub = fpIntern("sub");
+    symValue = fpIntern("value");
+    symHead = fpIntern("head");
+    symTail = fpIntern("tail");
+    symBytecode = fpIntern("bytecode");
+    for (int i = 0; i < OP_COUNT; i++) {
+        opCodeSym[i] = fpIntern(fpOpNames[i]);
+    }
+}
 
+bool builtin_disasm(VM* vm) {
+    pthread_once(&disasmOnce, resolveDisasmSyms);
+
+    // f #bytecode disasm lists compiled instructions instead of the AST
+    Symbol mode = 0;
+    if (vm->stack->next > vm->base && GET_TYPE(vm->stack->values[vm->stack->next-1]) == TYPE_SYMBOL) {
+        if (!fpExtract(vm, "y", &mode)) return false;
+        if (mode != symBytecode) {
+            fpRaiseInvalid(vm, "unknown disasm mode");
+            return false;
+        }
+    }
     Closure* f;
     if (!fpExtract(vm, "f", &f)) return false;
     if (!f->binding) {
         fpRaiseInvalid(vm, "cannot disasm native closure");
         return false;
     }
-    pushDisasm(vm, f->node);
+    if (mode) {
+        if (f->node) pushDisasmCode(vm, fpCodeOf(f->node));
+    } else {
+        pushDisasm(vm, f->node);
+    }
     return true;
 }
 
@@ -1533,8 +2406,12 @@ bool register_builtin(VM* vm, ModuleInfo* module) {
     REGISTER(strunesc);
     REGISTER(strtrim);
     REGISTER(clock);
+    REGISTER(now);
     REGISTER(gccollect);
     REGISTER(gcdump);
+    REGISTER(icstats);
+    REGISTER(profile_start);
+    REGISTER(profile_stop);
     REGISTER(throw);
     REGISTER(exit);
     REGISTER(list);
@@ -1546,14 +2423,68 @@ bool register_builtin(VM* vm, ModuleInfo* module) {
     REGISTER(lstsize);
     REGISTER(lstchange);
     REGISTER(lstsub);
+    REGISTER(dict);
+    REGISTER(dictget);
+    REGISTER(dicthas);
+    REGISTER(dictset);
+    REGISTER(dicttouch);
+    REGISTER(dictdel);
+    REGISTER(dictlen);
+    REGISTER(dictopen);
+    REGISTER(dictkeys);
+    REGISTER(dictvals);
+    REGISTER(hash);
+    REGISTER(set);
+    REGISTER(sethas);
+    REGISTER(setadd);
+    REGISTER(setdel);
+    REGISTER(setlen);
+    REGISTER(setopen);
+    REGISTER(setop);
+    REGISTER(setfilter);
+    REGISTER(array);
+    REGISTER(arrayget);
+    REGISTER(arraylen);
+    REGISTER(arrayopen);
+    REGISTER(arraytype);
+    REGISTER(arrayconv);
+    REGISTER(arrayblob);
+    REGISTER(blobarray);
+    REGISTER(arrayfma);
+    REGISTER(arraysum);
+    REGISTER(iter);
+    REGISTER(iternext);
+    REGISTER(iteropen);
+    REGISTER(rangeiter);
+    REGISTER(lines);
+    REGISTER(cospawn);
+    REGISTER(coresume);
+    REGISTER(coyield);
+    REGISTER(costatus);
+    REGISTER(taskspawn);
+    REGISTER(taskdone);
+    REGISTER(taskjoin);
+    REGISTER(taskall);
+    REGISTER(taskstatus);
+    REGISTER(actorspawn);
+    REGISTER(actorself);
+    REGISTER(actorargs);
+    REGISTER(actorsend);
+    REGISTER(actorreceive);
+    REGISTER(actorpoll);
+    REGISTER(actorwait);
+    REGISTER(actorstatus);
     REGISTER(rand);
     REGISTER(sort);
+    REGISTER(sortby);
+    REGISTER(sortwith);
     REGISTER(math1);
     REGISTER(math2);
     REGISTER(parse);
     REGISTER(evalin);
     REGISTER(sysctl);
     REGISTER(strblob);
+    REGISTER(blobstr);
     REGISTER(blobcat);
     REGISTER(blobopen);
     REGISTER(blobmk);
@@ -1562,8 +2493,19 @@ bool register_builtin(VM* vm, ModuleInfo* module) {
     REGISTER(blobenc);
     REGISTER(blobdec);
     REGISTER(read);
+    REGISTER(mmap);
     REGISTER(write);
     REGISTER(append);
+    REGISTER(fileopen);
+    REGISTER(filetemp);
+    REGISTER(filestd);
+    REGISTER(filereadline);
+    REGISTER(fileread);
+    REGISTER(filewrite);
+    REGISTER(fileflush);
+    REGISTER(fileseek);
+    REGISTER(filetell);
+    REGISTER(fileclose);
     REGISTER(dir);
     REGISTER(mkdir);
     REGISTER(stat);
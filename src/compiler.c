@@ -0,0 +1,502 @@
+#include "compiler.h"
+#include "value.h"
+#include <pthread.h>
+
+typedef struct sCompiler {
+    Instr* instrs;
+    int count, capacity;
+    Value* consts;
+    int constCount, constCapacity;
+    int cacheCount;
+} Compiler;
+
+const char* fpOpNames[OP_COUNT] = {
+    "const", "closure",
+    "object_begin", "object_end",
+    "callv", "getv", "setv", "bindv",
+    "hasv", "refv",
+    "prebind", "prebind_begin", "prebind_end",
+    "precall_begin", "precall_end",
+    "resolve", "call_resolved",
+    "group_begin", "group_end",
+    "stash", "operator", "argument", "dots",
+    "then_else", "until_do",
+    "branch", "loop_exit", "jump", "apply",
+    "and", "or",
+    "special", "range", "import", "this", "sigbind",
+    "return",
+    "getv_slot",
+    "add_num", "sub_num", "mul_num", "div_num", "pow_num", "mod_num",
+    "eq_num", "neq_num", "lt_num", "gt_num", "lteq_num", "gteq_num",
+    "eq_num_branch", "neq_num_branch", "lt_num_branch", "gt_num_branch",
+    "lteq_num_branch", "gteq_num_branch",
+    "num_local", "num_const"
+};
+
+static void compileBody(Compiler* c, AstNode* node);
+
+static int emit(Compiler* c, OpCode op, int arg, AstNode* node) {
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 16;
+        c->instrs = GC_REALLOC(c->instrs, c->capacity * sizeof(Instr));
+    }
+    c->instrs[c->count] = (Instr) { op, 0, arg, node };
+    return c->count++;
+}
+
+static void emitConst(Compiler* c, Value v, AstNode* node) {
+    if (c->constCount == c->constCapacity) {
+        c->constCapacity = c->constCapacity ? c->constCapacity * 2 : 8;
+        c->consts = GC_REALLOC(c->consts, c->constCapacity * sizeof(Value));
+    }
+    c->consts[c->constCount] = v;
+    emit(c, OP_CONST, c->constCount++, node);
+}
+
+// Emit an instruction resolving node's chain, with a cache per element.
+static int emitChain(Compiler* c, OpCode op, AstNode* node) {
+    int first = c->cacheCount;
+    for (AstChainElem* elem = node->as_chain; elem; elem = elem->next) {
+        c->cacheCount++;
+    }
+    return emit(c, op, first, node);
+}
+
+static void patch(Compiler* c, int instr) {
+    c->instrs[instr].arg = c->count;
+}
+
+// Whether evaluating a closure body may bind into its own context (or
+// otherwise observe it). Bodies that don't can be inlined into the caller
+// instead of being called with a fresh context.
+static bool needsScope(AstNode* node) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+            case AST_BINDV: case AST_PREBIND: case AST_REFV: {
+                if (!node->as_chain->next) return true;
+            } break;
+            case AST_SIGBIND: case AST_THIS: case AST_IMPORT: {
+                return true;
+            }
+            case AST_CLOSURE: case AST_OBJECT: {
+                continue; // evaluated within their own context
+            }
+            case AST_THEN_ELSE: case AST_UNTIL_DO: {
+                if (needsScope(node->as_node)) return true;
+            } break;
+            default: break;
+        }
+        if (needsScope(node->sub)) return true;
+    }
+    return false;
+}
+
+// Whether a then/else/until/do/and/or operand can be compiled in place
+// rather than evaluated ahead of time and passed to the generic form.
+static bool isPureArm(AstNode* node) {
+    if (!node) return true;
+    switch (node->kind) {
+        case AST_NUMBER: case AST_SYMBOL: case AST_STRING:
+        case AST_ODDBALL: case AST_CLOSURE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the closure arms of a then/else, until/do or and/or node may be
+// compiled in place (each is then inlined if it doesn't need a scope).
+static bool armsInline(AstNode* node) {
+    AstNode* a = node->sub, * b = NULL;
+    if (node->kind == AST_SPECIAL) {
+        return isPureArm(a) && a->kind == AST_CLOSURE;
+    }
+    b = node->as_node;
+    return isPureArm(a) && isPureArm(b) &&
+        (!a || a->kind == AST_CLOSURE) && (!b || b->kind == AST_CLOSURE);
+}
+
+// Whether the numbers of a to node can be passed lazily to the map, filter or
+// fold directly consuming them, which is the case when its function is found
+// without running any code which could look at the stack.
+static bool streamsRange(AstNode* node) {
+    AstNode* next = node->next;
+    if (!next || next->kind != AST_SPECIAL) return false;
+    int special = next->as_int;
+    if (special != SPC_MAP && special != SPC_FILTER && special != SPC_FOLD) return false;
+    AstNode* fn = next->sub;
+    return fn && !fn->next && (isPureArm(fn) || fn->kind == AST_GETV);
+}
+
+static bool inlinesArm(AstNode* arm, bool canInline) {
+    return canInline && arm->kind == AST_CLOSURE && !needsScope(arm->sub);
+}
+
+// Compile a pure arm, either inlining a closure body or applying its value.
+// Closures are only inlined where the trace for their parent node would be
+// omitted anyway (see traceNode in vm.c), so traces remain unchanged.
+static void compileArm(Compiler* c, AstNode* arm, AstNode* parent, bool canInline) {
+    if (inlinesArm(arm, canInline)) {
+        compileBody(c, arm->sub);
+    } else {
+        compileBody(c, arm);
+        emit(c, OP_APPLY, 0, parent);
+    }
+}
+
+static void compileThenElse(Compiler* c, AstNode* node) {
+    AstNode* caseTrue = node->sub, * caseFalse = node->as_node;
+    if (!isPureArm(caseTrue) || !isPureArm(caseFalse)) {
+        emit(c, OP_STASH, 0, node);
+        if (caseTrue) {
+            compileBody(c, caseTrue);
+            emit(c, OP_STASH, 0, caseTrue);
+        }
+        if (caseFalse) {
+            compileBody(c, caseFalse);
+            emit(c, OP_STASH, 0, caseFalse);
+        }
+        emit(c, OP_THEN_ELSE, 0, node);
+        return;
+    }
+    bool canInline = armsInline(node);
+    int branch = emit(c, OP_BRANCH, -1, node);
+    if (caseTrue) compileArm(c, caseTrue, node, canInline);
+    if (caseFalse) {
+        int jump = emit(c, OP_JUMP, -1, node);
+        patch(c, branch);
+        compileArm(c, caseFalse, node, canInline);
+        patch(c, jump);
+    } else {
+        patch(c, branch);
+    }
+}
+
+static void compileUntilDo(Compiler* c, AstNode* node) {
+    AstNode* caseUntil = node->sub, * caseDo = node->as_node;
+    if (!isPureArm(caseUntil) || !isPureArm(caseDo)) {
+        if (caseUntil) {
+            compileBody(c, caseUntil);
+            emit(c, OP_STASH, 0, caseUntil);
+        }
+        if (caseDo) {
+            compileBody(c, caseDo);
+            emit(c, OP_STASH, 0, caseDo);
+        }
+        emit(c, OP_UNTIL_DO, 0, node);
+        return;
+    }
+    bool canInline = armsInline(node);
+    int top = c->count;
+    int exit = -1;
+    if (caseUntil) {
+        compileArm(c, caseUntil, node, canInline);
+        exit = emit(c, OP_LOOP_EXIT, -1, node);
+    }
+    if (caseDo) compileArm(c, caseDo, node, canInline);
+    emit(c, OP_JUMP, top, node);
+    if (exit != -1) patch(c, exit);
+}
+
+static void compileNode(Compiler* c, AstNode* node) {
+    switch (node->kind) {
+        case AST_NUMBER: {
+            emitConst(c, FROM_NUMBER(node->as_number), node);
+        } break;
+        case AST_SYMBOL: {
+            emitConst(c, FROM_SYMBOL(node->as_symbol), node);
+        } break;
+        case AST_STRING: {
+            emitConst(c, FROM_STRING(node->as_string), node);
+        } break;
+        case AST_ODDBALL: {
+            emitConst(c, FROM_ODDBALL(node->as_int), node);
+        } break;
+        case AST_CLOSURE: {
+            emit(c, OP_CLOSURE, 0, node);
+        } break;
+        case AST_OBJECT: {
+            int begin = emit(c, OP_OBJECT_BEGIN, 0, node);
+            compileBody(c, node->sub);
+            emit(c, OP_OBJECT_END, begin, node);
+        } break;
+        case AST_CALLV: emitChain(c, OP_CALLV, node); break;
+        case AST_GETV: emitChain(c, OP_GETV, node); break;
+        case AST_SETV: emitChain(c, OP_SETV, node); break;
+        case AST_BINDV: emitChain(c, OP_BINDV, node); break;
+        case AST_HASV: emitChain(c, OP_HASV, node); break;
+        case AST_REFV: emitChain(c, OP_REFV, node); break;
+        case AST_PREBIND: {
+            if (node->as_chain->next) {
+                emitChain(c, OP_PREBIND_BEGIN, node);
+                compileBody(c, node->sub);
+                emit(c, OP_PREBIND_END, 0, node);
+            } else {
+                compileBody(c, node->sub);
+                emit(c, OP_PREBIND, node->depth == 0 ? node->slot : -1, node);
+            }
+        } break;
+        case AST_PRECALL: {
+            emitChain(c, OP_PRECALL_BEGIN, node);
+            compileBody(c, node->sub);
+            emit(c, OP_PRECALL_END, 0, node);
+        } break;
+        case AST_PRECALL_BARE: {
+            emitChain(c, OP_RESOLVE, node);
+            compileBody(c, node->sub);
+            emit(c, OP_CALL_RESOLVED, 0, node);
+        } break;
+        case AST_OPERATOR: {
+            emit(c, OP_STASH, 0, node);
+            compileBody(c, node->sub);
+            emit(c, OP_OPERATOR, node->as_int, node);
+        } break;
+        case AST_ARGUMENT: {
+            compileBody(c, node->sub);
+            emit(c, OP_ARGUMENT, 0, node);
+        } break;
+        case AST_GROUP: {
+            if (!node->sub) break;
+            emit(c, OP_GROUP_BEGIN, 0, node);
+            compileBody(c, node->sub);
+            emit(c, OP_GROUP_END, 0, node);
+        } break;
+        case AST_DOTS: {
+            emit(c, OP_DOTS, node->as_int, node);
+        } break;
+        case AST_THEN_ELSE: {
+            compileThenElse(c, node);
+        } break;
+        case AST_UNTIL_DO: {
+            compileUntilDo(c, node);
+        } break;
+        case AST_SPECIAL: {
+            int special = node->as_int;
+            if ((special == SPC_AND || special == SPC_OR) && isPureArm(node->sub)) {
+                int skip = emit(c, special == SPC_AND ? OP_AND : OP_OR, -1, node);
+                compileArm(c, node->sub, node, armsInline(node));
+                patch(c, skip);
+            } else if (special == SPC_TO && streamsRange(node)) {
+                compileBody(c, node->sub);
+                emit(c, OP_RANGE, 0, node);
+            } else {
+                compileBody(c, node->sub);
+                emit(c, OP_SPECIAL, special, node);
+            }
+        } break;
+        case AST_IMPORT: emit(c, OP_IMPORT, 0, node); break;
+        case AST_THIS: emit(c, OP_THIS, 0, node); break;
+        case AST_SIGBIND: emit(c, OP_SIGBIND, node->slot, node); break;
+        default: {
+            assert(0 && "not impl");
+        }
+    }
+}
+
+static void compileBody(Compiler* c, AstNode* node) {
+    for (; node; node = node->next) compileNode(c, node);
+}
+
+static int findLocal(AstScope* scope, Symbol key) {
+    for (int i = 0; i < scope->count; i++) {
+        if (scope->locals[i] == key) return i;
+    }
+    return -1;
+}
+
+static void addLocal(AstScope* scope, Symbol key) {
+    if (findLocal(scope, key) >= 0) return;
+    if (scope->count == scope->capacity) {
+        scope->capacity *= 2;
+        scope->locals = GC_REALLOC(scope->locals, sizeof(Symbol) * scope->capacity);
+    }
+    scope->locals[scope->count++] = key;
+}
+
+// Add each variable a body binds in its own frame (mirrors needsScope).
+static void collectLocals(AstScope* scope, AstNode* node) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+            case AST_SIGBIND: {
+                addLocal(scope, node->as_symbol);
+            } break;
+            case AST_BINDV: case AST_PREBIND: {
+                AstChainElem* chain = node->as_chain;
+                if (!chain->next) addLocal(scope, chain->symbol);
+            } break;
+            case AST_IMPORT: {
+                AstChainElem* chain = node->sub ? node->sub->as_chain : node->as_chain;
+                while (chain->next) chain = chain->next;
+                addLocal(scope, chain->symbol);
+            } break;
+            case AST_CLOSURE: case AST_OBJECT: {
+                continue; // bind within their own context
+            }
+            case AST_THEN_ELSE: case AST_UNTIL_DO: {
+                collectLocals(scope, node->as_node);
+            } break;
+            default: break;
+        }
+        collectLocals(scope, node->sub);
+    }
+}
+
+static void resolveBody(AstScope* scope, AstNode* node);
+
+static void resolveNode(AstScope* scope, AstNode* node) {
+    node->scope = scope;
+    node->slot = -1;
+    switch (node->kind) {
+        case AST_CALLV: case AST_GETV: case AST_SETV: case AST_BINDV:
+        case AST_HASV: case AST_REFV: case AST_PREBIND:
+        case AST_PRECALL: case AST_PRECALL_BARE: {
+            Symbol key = node->as_chain->symbol;
+            if (key == (Symbol) -1) break;
+            int depth = 0;
+            for (AstScope* s = scope; s; s = s->parent, depth++) {
+                int slot = findLocal(s, key);
+                if (slot >= 0) {
+                    node->depth = depth;
+                    node->slot = slot;
+                    break;
+                }
+            }
+        } break;
+        case AST_SIGBIND: {
+            if (scope) node->slot = findLocal(scope, node->as_symbol);
+        } return;
+        case AST_CLOSURE: {
+            static Symbol symSelf = 0;
+            if (!symSelf) symSelf = Symbol_find("self", 4);
+            AstScope* inner = GC_MALLOC(sizeof(AstScope));
+            *inner = (AstScope) { .capacity = 4, .parent = scope };
+            inner->locals = GC_MALLOC(sizeof(Symbol) * inner->capacity);
+            addLocal(inner, symSelf);
+            collectLocals(inner, node->sub);
+            resolveBody(inner, node->sub);
+        } return;
+        case AST_OBJECT: {
+            resolveBody(NULL, node->sub);
+        } return;
+        case AST_THEN_ELSE: case AST_UNTIL_DO: case AST_SPECIAL: {
+            bool canInline = node->kind != AST_SPECIAL ||
+                node->as_int == SPC_AND || node->as_int == SPC_OR;
+            canInline = canInline && armsInline(node);
+            AstNode* arms[2] = { node->sub, node->kind == AST_SPECIAL ? NULL : node->as_node };
+            for (int i = 0; i < 2; i++) {
+                for (AstNode* arm = arms[i]; arm; arm = arm->next) {
+                    if (inlinesArm(arm, canInline)) {
+                        // compiled into this body, so in this scope
+                        arm->scope = scope;
+                        arm->slot = -1;
+                        resolveBody(scope, arm->sub);
+                    } else {
+                        resolveNode(scope, arm);
+                    }
+                }
+            }
+        } return;
+        default: break;
+    }
+    resolveBody(scope, node->sub);
+}
+
+static void resolveBody(AstScope* scope, AstNode* node) {
+    for (; node; node = node->next) resolveNode(scope, node);
+}
+
+void fpResolveScopes(AstNode* first) {
+    resolveBody(NULL, first);
+}
+
+static Shape* scopeLayout(AstScope* scope) {
+    if (!scope->layout) scope->layout = Context_layout(scope->locals, scope->count);
+    return scope->layout;
+}
+
+// Prime the cache of a chain's first element with its lexical address.
+static void seedCache(InlineCache* ic, AstNode* node) {
+    AstScope* scope = node->scope;
+    if (node->depth) ic->path = GC_MALLOC(sizeof(Shape*) * node->depth);
+    for (int i = 0; i < node->depth; i++) {
+        ic->path[i] = scopeLayout(scope);
+        scope = scope->parent;
+    }
+    ic->shape = scopeLayout(scope);
+    ic->shapeSlot = node->slot;
+    ic->depth = node->depth;
+}
+
+Code* fpCompile(AstNode* first) {
+    Compiler c = {};
+    compileBody(&c, first);
+    emit(&c, OP_RETURN, 0, NULL);
+    Code* code = GC_MALLOC(sizeof(Code));
+    *code = (Code) { c.instrs, c.count, c.consts, c.constCount };
+    if (c.cacheCount) {
+        code->caches = GC_MALLOC(sizeof(InlineCache) * c.cacheCount);
+        code->cacheCount = c.cacheCount;
+    }
+    for (int i = 0; i < c.count; i++) {
+        Instr* instr = &c.instrs[i];
+        switch (instr->op) {
+            case OP_CALLV: case OP_GETV: case OP_SETV: case OP_BINDV:
+            case OP_HASV: case OP_REFV: case OP_PREBIND_BEGIN:
+            case OP_PRECALL_BEGIN: case OP_RESOLVE: {
+                if (instr->node->slot >= 0) {
+                    seedCache(&code->caches[instr->arg], instr->node);
+                }
+            } break;
+            default: break;
+        }
+    }
+    // the first node of a closure body is in that body's scope
+    if (first && first->scope) code->frameShape = scopeLayout(first->scope);
+    return code;
+}
+
+// Bodies first called on several threads at once (see parallel.h) are
+// compiled by one of them, the others waiting for its code.
+static pthread_mutex_t compileLock = PTHREAD_MUTEX_INITIALIZER;
+
+Code* fpCodeOf(AstNode* first) {
+    Code* code = __atomic_load_n(&first->code, __ATOMIC_ACQUIRE);
+    if (code) return code;
+    pthread_mutex_lock(&compileLock);
+    code = first->code;
+    if (!code) {
+        code = fpCompile(first);
+        __atomic_store_n(&first->code, code, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&compileLock);
+    return code;
+}
+
+void fpDumpCode(Code* code) {
+    for (int i = 0; i < code->count; i++) {
+        Instr* instr = &code->instrs[i];
+        printf("%4d %-14s", i, fpOpNames[instr->op]);
+        switch (instr->op) {
+            case OP_CONST: {
+                printf(" %s", Value_repr(code->consts[instr->arg], 1));
+            } break;
+            case OP_BRANCH: case OP_LOOP_EXIT: case OP_JUMP:
+            case OP_AND: case OP_OR: {
+                printf(" -> %d", instr->arg);
+            } break;
+            case OP_OPERATOR: case OP_SPECIAL: case OP_DOTS: {
+                printf(" %d", instr->arg);
+            } break;
+            case OP_PREBIND: case OP_SIGBIND: {
+                if (instr->arg >= 0) printf(" slot %d", instr->arg);
+            } break;
+            default: {
+                // quickened operators keep their operator kind
+                if (instr->op >= OP_ADD_NUM && instr->op <= OP_GTEQ_NUM_BRANCH) {
+                    printf(" %d", instr->arg);
+                }
+            } break;
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include "common.h"
+#include "parser.h"
+#include "value.h"
+#include "context.h"
+
+typedef struct sInstr Instr;
+typedef struct sCode Code;
+typedef struct sCacheEntry CacheEntry;
+typedef struct sInlineCache InlineCache;
+
+// note: keep in sync with fpOpNames in compiler.c
+typedef enum OpCode {
+    OP_CONST, OP_CLOSURE,
+    OP_OBJECT_BEGIN, OP_OBJECT_END,
+    OP_CALLV, OP_GETV, OP_SETV, OP_BINDV,
+    OP_HASV, OP_REFV,
+    OP_PREBIND, OP_PREBIND_BEGIN, OP_PREBIND_END,
+    OP_PRECALL_BEGIN, OP_PRECALL_END,
+    OP_RESOLVE, OP_CALL_RESOLVED,
+    OP_GROUP_BEGIN, OP_GROUP_END,
+    OP_STASH, OP_OPERATOR, OP_ARGUMENT, OP_DOTS,
+    OP_THEN_ELSE, OP_UNTIL_DO,
+    OP_BRANCH, OP_LOOP_EXIT, OP_JUMP, OP_APPLY,
+    OP_AND, OP_OR,
+    OP_SPECIAL, OP_RANGE, OP_IMPORT, OP_THIS, OP_SIGBIND,
+    OP_RETURN,
+    // quickened forms, never emitted by the compiler (see quicken in vm.c)
+    OP_GETV_SLOT,
+    OP_ADD_NUM, OP_SUB_NUM, OP_MUL_NUM, OP_DIV_NUM, OP_POW_NUM, OP_MOD_NUM,
+    OP_EQ_NUM, OP_NEQ_NUM, OP_LT_NUM, OP_GT_NUM, OP_LTEQ_NUM, OP_GTEQ_NUM,
+    OP_EQ_NUM_BRANCH, OP_NEQ_NUM_BRANCH, OP_LT_NUM_BRANCH, OP_GT_NUM_BRANCH,
+    OP_LTEQ_NUM_BRANCH, OP_GTEQ_NUM_BRANCH,
+    OP_NUM_LOCAL, OP_NUM_CONST,
+    OP_COUNT
+} OpCode;
+
+struct sInstr {
+    u16 op;
+    u16 deopts; // times a quickened form of this instruction has failed its guard
+    int arg; // constant/cache index, jump target, operator/special kind, etc.
+    // note: object_begin's arg is a size hint, updated by its object_end
+    // note: prebind and sigbind's arg is the frame slot bound, or -1
+    AstNode* node; // source node, used for chains and traces
+};
+
+#define IC_POLY_SIZE 4
+
+// Where a lookup which missed in its initial context was found, keyed by
+// the context the search continued from (the initial context's parent)
+struct sCacheEntry {
+    Context* start;
+    Context* holder;
+    u32 slot;
+    u32 epoch; // Context_epoch of the key when cached
+};
+
+// Per chain element lookup cache. Hits are cached by the shape of the
+// holder, which is either the initial context or, for variables resolved to
+// an enclosing frame by fpResolveScopes, depth parents up through contexts of
+// the shapes in path. Other misses are cached monomorphically until a second
+// start context is seen, then polymorphically with round robin replacement.
+struct sInlineCache {
+    Shape* shape;
+    u32 shapeSlot;
+    u32 depth;
+    Shape** path;
+    CacheEntry mono;
+    CacheEntry* poly; // IC_POLY_SIZE entries, or NULL
+    u32 polyNext;
+};
+
+struct sCode {
+    Instr* instrs;
+    int count;
+    Value* consts;
+    int constCount;
+    InlineCache* caches; // indexed by arg of chain instructions
+    int cacheCount;
+    Shape* frameShape; // for closure bodies, the shape of their frames
+};
+
+extern const char* fpOpNames[OP_COUNT];
+
+// Assign the scope and lexical address of every node in a parsed body.
+void fpResolveScopes(AstNode* first);
+
+// Compile a sequence of nodes (following next) into bytecode.
+Code* fpCompile(AstNode* first);
+
+// Get the bytecode for a body, compiling it on first use.
+Code* fpCodeOf(AstNode* first);
+
+// Print the contents of compiled code for debug purposes.
+void fpDumpCode(Code* code);
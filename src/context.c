@@ -1,40 +1,202 @@
 #include "context.h"
+#include "parallel.h"
 #include "symbols.h"
 #include <assert.h>
 #include <gc/gc.h>
+#include <pthread.h>
 
 #define START_CAP 8
+#define START_SLOTS 4
+#define MAX_SHARED_KEYS 32
 #define HASH(k) ((k) ^ 0xF93A)
 
+typedef struct {
+    Shape* from;
+    Symbol key;
+    Shape* to;
+} Transition;
+
+static Symbol emptyKeys[START_CAP];
+static u32 emptySlots[START_CAP];
+static Shape emptyShape = { emptyKeys, emptySlots, START_CAP, 0, true };
+static Transition* transitions;
+static u32 transitionCount, transitionCapacity;
+
+static u32 globalEpoch;
+static u32* keyEpochs;
+static u32 keyEpochCapacity;
+
+// Guards transitions and keyEpochs while other threads are evaluating (see
+// parallel.h). Epochs are read without it, so keyEpochs is replaced rather
+// than reallocated, and its capacity set only once it is. Actors bind in
+// contexts of their own meanwhile, so the epochs themselves are atomic.
+static pthread_mutex_t sharedLock = PTHREAD_MUTEX_INITIALIZER;
+
+static Shape* Shape_create(int capacity, bool shared) {
+    Shape* shape = GC_MALLOC(sizeof(Shape));
+    *shape = (Shape) { .capacity = capacity, .shared = shared };
+    shape->keys = GC_MALLOC((sizeof(Symbol) + sizeof(u32)) * capacity);
+    shape->slots = (u32*) &shape->keys[capacity];
+    memset(shape->keys, 0, sizeof(Symbol) * capacity);
+    return shape;
+}
+
+static int Shape_find(Shape* shape, Symbol key) {
+    int index = HASH(key) & (shape->capacity - 1); // key % capacity
+    // note: infinite loop if count == capacity!
+    while (shape->keys[index]) {
+        if (shape->keys[index] == key) return index;
+        index = (index + 1) & (shape->capacity - 1);
+    }
+    return -1;
+}
+
+// Add a key not yet in shape, giving it the next slot.
+static void Shape_add(Shape* shape, Symbol key) {
+    // resize if needed
+    // todo: resize earlier (e.g. 75% full? profile to find sweet spot)
+    if (shape->count + 1 == shape->capacity) {
+        int oldCap = shape->capacity;
+        Symbol* oldKeys = shape->keys;
+        u32* oldSlots = shape->slots;
+        shape->capacity *= 2;
+        shape->keys = GC_MALLOC((sizeof(Symbol) + sizeof(u32)) * shape->capacity);
+        shape->slots = (u32*) &shape->keys[shape->capacity];
+        memset(shape->keys, 0, sizeof(Symbol) * shape->capacity);
+
+        // copy across old keys
+        for (int i = 0; i < oldCap; i++) {
+            if (!oldKeys[i]) continue;
+            int newIndex = HASH(oldKeys[i]) & (shape->capacity - 1);
+            while (shape->keys[newIndex]) {
+                newIndex = (newIndex + 1) & (shape->capacity - 1);
+            }
+            shape->keys[newIndex] = oldKeys[i];
+            shape->slots[newIndex] = oldSlots[i];
+        }
+    }
+
+    int index = HASH(key) & (shape->capacity - 1);
+    while (shape->keys[index]) {
+        index = (index + 1) & (shape->capacity - 1);
+    }
+    shape->keys[index] = key;
+    shape->slots[index] = shape->count++;
+}
+
+static Shape* Shape_copy(Shape* shape, bool shared) {
+    Shape* copy = Shape_create(shape->capacity, shared);
+    copy->count = shape->count;
+    memcpy(copy->keys, shape->keys, sizeof(Symbol) * shape->capacity);
+    memcpy(copy->slots, shape->slots, sizeof(u32) * shape->capacity);
+    return copy;
+}
+
+static u32 transitionHash(Shape* from, Symbol key) {
+    u64 h = ((uintptr_t) from >> 4) * 0x9E3779B97F4A7C15ull ^ key;
+    return (u32) (h ^ (h >> 32));
+}
+
+// Find or create the shared shape reached by adding key to from.
+static Shape* findTransition(Shape* from, Symbol key) {
+    if (transitionCount * 2 >= transitionCapacity) {
+        Transition* old = transitions;
+        u32 oldCap = transitionCapacity;
+        transitionCapacity = oldCap ? oldCap * 2 : 256;
+        transitions = GC_MALLOC(sizeof(Transition) * transitionCapacity);
+        memset(transitions, 0, sizeof(Transition) * transitionCapacity);
+        for (u32 i = 0; i < oldCap; i++) {
+            if (!old[i].from) continue;
+            u32 index = transitionHash(old[i].from, old[i].key) & (transitionCapacity - 1);
+            while (transitions[index].from) {
+                index = (index + 1) & (transitionCapacity - 1);
+            }
+            transitions[index] = old[i];
+        }
+    }
+    u32 index = transitionHash(from, key) & (transitionCapacity - 1);
+    while (transitions[index].from) {
+        Transition* t = &transitions[index];
+        if (t->from == from && t->key == key) return t->to;
+        index = (index + 1) & (transitionCapacity - 1);
+    }
+    Shape* to = Shape_copy(from, true);
+    Shape_add(to, key);
+    transitions[index] = (Transition) { from, key, to };
+    transitionCount++;
+    return to;
+}
+
+static Shape* Shape_transition(Shape* from, Symbol key) {
+    if (!Parallel_threaded()) return findTransition(from, key);
+    pthread_mutex_lock(&sharedLock);
+    Shape* to = findTransition(from, key);
+    pthread_mutex_unlock(&sharedLock);
+    return to;
+}
+
+static void bumpEpoch(Symbol key) {
+    if (key >= keyEpochCapacity) {
+        u32 newCap = keyEpochCapacity ? keyEpochCapacity : 256;
+        while (key >= newCap) newCap *= 2;
+        u32* epochs = GC_MALLOC_ATOMIC(sizeof(u32) * newCap);
+        memset(epochs, 0, sizeof(u32) * newCap);
+        if (keyEpochCapacity) memcpy(epochs, keyEpochs, sizeof(u32) * keyEpochCapacity);
+        __atomic_store_n(&keyEpochs, epochs, __ATOMIC_RELEASE);
+        __atomic_store_n(&keyEpochCapacity, newCap, __ATOMIC_RELEASE);
+    }
+    __atomic_fetch_add(&keyEpochs[key], 1, __ATOMIC_RELAXED);
+}
+
 Context* Context_create(Context* parent) {
-    Context* ctx = GC_MALLOC(sizeof(Context));
-    *ctx = (Context) { .parent = parent, .capacity = START_CAP };
-    ctx->keys = GC_MALLOC((sizeof(Symbol) + sizeof(Value)) * START_CAP);
-    ctx->values = (Value*) &ctx->keys[START_CAP];
-    memset(ctx->keys, 0, sizeof(Symbol) * START_CAP);
+    return Context_createSized(parent, START_SLOTS);
+}
+
+Context* Context_createSized(Context* parent, int size) {
+    if (size < 1) size = START_SLOTS;
+    Context* ctx = GC_MALLOC(sizeof(Context) + sizeof(Value) * size);
+    *ctx = (Context) { .shape = &emptyShape, .parent = parent, .capacity = size,
+        .escaped = true };
+    ctx->values = (Value*) &ctx[1];
     return ctx;
 }
 
-Value* Context_get(Context* ctx, Symbol key) {
-    int index = HASH(key) & (ctx->capacity - 1); // key % capacity
-    // note: infinite loop if count == capacity!
-    while (ctx->keys[index]) {
-        if (ctx->keys[index] == key) return &ctx->values[index];
-        index = (index + 1) & (ctx->capacity - 1);
+Context* Context_createFrame(Context* parent, Shape* layout) {
+    int size = layout->count;
+    Context* ctx = GC_MALLOC(sizeof(Context) + sizeof(Value) * size);
+    *ctx = (Context) { .shape = layout, .parent = parent, .capacity = size };
+    ctx->values = (Value*) &ctx[1];
+    for (int i = 0; i < size; i++) ctx->values[i] = VAL_UNBOUND;
+    return ctx;
+}
+
+Shape* Context_layout(Symbol* keys, int count) {
+    Shape* shape = &emptyShape;
+    for (int i = 0; i < count; i++) {
+        shape = Shape_transition(shape, keys[i]);
     }
+    return shape;
+}
+
+Value* Context_get(Context* ctx, Symbol key) {
+    Value* pv = Context_getLocal(ctx, key);
+    if (pv) return pv;
     return ctx->parent ? Context_get(ctx->parent, key) : NULL;
 }
 
+Value* Context_getLocal(Context* ctx, Symbol key) {
+    int index = Shape_find(ctx->shape, key);
+    if (index < 0) return NULL;
+    Value* pv = &ctx->values[ctx->shape->slots[index]];
+    return IS_UNBOUND(*pv) ? NULL : pv;
+}
+
 SetResult Context_set(Context* ctx, Symbol key, Value value) {
-    int index = HASH(key) & (ctx->capacity - 1); // key % capacity
-    // note: infinite loop if count == capacity!
-    while (ctx->keys[index]) {
-        if (ctx->keys[index] == key) {
-            if (ctx->lock) return SET_LOCKED;
-            ctx->values[index] = value;
-            return SET_OK;
-        }
-        index = (index + 1) & (ctx->capacity - 1);
+    Value* pv = Context_getLocal(ctx, key);
+    if (pv) {
+        if (ctx->lock) return SET_LOCKED;
+        *pv = value;
+        return SET_OK;
     }
     return ctx->parent ? Context_set(ctx->parent, key, value) : SET_UNBOUND;
 }
@@ -42,59 +204,84 @@ SetResult Context_set(Context* ctx, Symbol key, Value value) {
 void Context_bind(Context* ctx, Symbol key, Value value) {
     assert(!ctx->lock);
     // set key if already present
-    int index = HASH(key) & (ctx->capacity - 1); // key % capacity
-    // note: infinite loop if count == capacity!
-    while (ctx->keys[index]) {
-        if (ctx->keys[index] == key) {
-            ctx->values[index] = value;
-            return;
-        }
-        index = (index + 1) & (ctx->capacity - 1);
+    int index = Shape_find(ctx->shape, key);
+    Value* pv = index >= 0 ? &ctx->values[ctx->shape->slots[index]] : NULL;
+    if (pv && !IS_UNBOUND(*pv)) {
+        *pv = value;
+        return;
     }
 
-    // resize if needed
-    // todo: resize earlier (e.g. 75% full? profile to find sweet spot)
-    if (++ctx->count == ctx->capacity) {
-        int oldCap = ctx->capacity;
-        Symbol* oldKeys = ctx->keys;
-        Value* oldValues = ctx->values;
-        ctx->capacity *= 2;
-        // todo: can this be done with realloc instead?
-        ctx->keys = GC_MALLOC_IGNORE_OFF_PAGE((sizeof(Symbol) + sizeof(Value)) *
-            ctx->capacity);
-        ctx->values = (Value*) &ctx->keys[ctx->capacity];
-        memset(ctx->keys, 0, sizeof(Symbol) * ctx->capacity);
-
-        // copy across old values
-        for (int i = 0; i < oldCap; i++) {
-            if (!oldKeys[i]) continue;
-            int newIndex = HASH(oldKeys[i]) & (ctx->capacity - 1);
-            while (ctx->keys[newIndex]) {
-                newIndex = (newIndex + 1) & (ctx->capacity - 1);
-            }
-            ctx->keys[newIndex] = oldKeys[i];
-            ctx->values[newIndex] = oldValues[i];
+    // a new key may shadow one found through this context
+    if (ctx->cached) {
+        if (Parallel_threaded()) {
+            pthread_mutex_lock(&sharedLock);
+            bumpEpoch(key);
+            pthread_mutex_unlock(&sharedLock);
+        } else {
+            bumpEpoch(key);
         }
+    }
+    if (pv) {
+        *pv = value;
+        return;
+    }
 
-        // find new index for insertion
-        index = HASH(key) & (ctx->capacity - 1);
-        while (ctx->keys[index]) {
-            index = (index + 1) & (ctx->capacity - 1);
-        }
+    // move to the shape with key added, going private once there are many
+    if (!ctx->shape->shared) {
+        Shape_add(ctx->shape, key);
+    } else if (ctx->shape->count < MAX_SHARED_KEYS) {
+        ctx->shape = Shape_transition(ctx->shape, key);
+    } else {
+        ctx->shape = Shape_copy(ctx->shape, false);
+        Shape_add(ctx->shape, key);
+    }
+
+    int slot = ctx->shape->count - 1;
+    if (slot == ctx->capacity) {
+        Value* oldValues = ctx->values;
+        ctx->capacity = slot < START_SLOTS ? START_SLOTS : slot * 2;
+        ctx->values = GC_MALLOC_IGNORE_OFF_PAGE(sizeof(Value) * ctx->capacity);
+        memcpy(ctx->values, oldValues, sizeof(Value) * slot);
     }
+    ctx->values[slot] = value;
+}
 
-    // insert key
-    ctx->keys[index] = key;
-    ctx->values[index] = value;
+void Context_setParent(Context* ctx, Context* parent) {
+    if (ctx->cached) __atomic_fetch_add(&globalEpoch, 1, __ATOMIC_RELAXED);
+    ctx->parent = parent;
+}
+
+u32 Context_epoch(Symbol key) {
+    // both parts only increase, so the sum changes if either does
+    u32 capacity = __atomic_load_n(&keyEpochCapacity, __ATOMIC_ACQUIRE);
+    u32* epochs = __atomic_load_n(&keyEpochs, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED) +
+        (key < capacity ? __atomic_load_n(&epochs[key], __ATOMIC_RELAXED) : 0);
+}
+
+Symbol Context_keyAt(Context* ctx, int index) {
+    Symbol key = ctx->shape->keys[index];
+    if (!key || IS_UNBOUND(ctx->values[ctx->shape->slots[index]])) return 0;
+    return key;
+}
+
+int Context_count(Context* ctx) {
+    int count = 0;
+    for (int i = 0; i < ctx->shape->count; i++) {
+        if (!IS_UNBOUND(ctx->values[i])) count++;
+    }
+    return count;
 }
 
 void Context_dump(Context* ctx) {
-    printf("Context(count: %d, capacity: %d)\n",
-        ctx->count, ctx->capacity);
-    for (int i = 0; i < ctx->capacity; i++) {
-        if (ctx->keys[i])
-            printf("  entry[%d] = %s -> %s\n", i,
-                Symbol_repr(ctx->keys[i]), Value_repr(ctx->values[i], 1));
+    Shape* shape = ctx->shape;
+    printf("Context(count: %d, capacity: %d, shape: %p%s)\n",
+        shape->count, ctx->capacity, shape, shape->shared ? "" : " (private)");
+    for (int i = 0; i < shape->capacity; i++) {
+        if (shape->keys[i])
+            printf("  entry[%d] = %s -> [%u] %s\n", i, Symbol_repr(shape->keys[i]),
+                shape->slots[i], Context_keyAt(ctx, i) ?
+                Value_repr(ctx->values[shape->slots[i]], 1) : "<unbound>");
         else
             printf("  entry[%d] = <empty>\n", i);
     }
@@ -2,15 +2,33 @@
 #include "common.h"
 #include "value.h"
 
+typedef struct sShape Shape;
 typedef struct sContext Context;
 
+// Maps keys to slots in a context's values. Shapes reached by binding the
+// same keys in the same order from an empty context are shared; contexts
+// with many keys get a private shape instead, which is extended in place.
+struct sShape {
+    Symbol* keys; // open-addressed table, 0 for empty entries
+    u32* slots; // slot of the key at the same index in keys
+    int capacity; // power of two (nonzero)
+    int count; // strictly < capacity, slots are 0 to count - 1
+    bool shared;
+};
+
+// Closure frames are created with the shape of every variable their body
+// may bind, with VAL_UNBOUND in the slots not bound yet. Such slots behave as
+// if their key was absent, for all functions below.
 struct sContext {
-    Symbol* keys;
-    Value* values;
+    Shape* shape;
+    Value* values; // dense, indexed by slot
     Context* parent;
-    int capacity; // power of two (nonzero)
-    int count:31; // strictly < capacity
+    int capacity:29; // of values
     bool lock:1;
+    bool cached:1; // searched through by an inline cache (see vm.c)
+    // may be referred to other than as the current context, so not reused
+    // once its call returns (see releaseFrame in vm.c), always set but for frames
+    bool escaped:1;
 };
 
 typedef enum {
@@ -20,7 +38,27 @@ typedef enum {
 } SetResult;
 
 Context* Context_create(Context* parent);
+// Create a context with room for size values before needing to grow.
+Context* Context_createSized(Context* parent, int size);
+// Create a context with the given shape, all slots unbound, not escaped.
+Context* Context_createFrame(Context* parent, Shape* layout);
+// Note that ctx may be referred to once its frame's call returns.
+static inline void Context_escape(Context* ctx) {
+    // (only frames are not escaped yet, and only their own thread sees them)
+    if (!ctx->escaped) ctx->escaped = true;
+}
+// Get the shared shape with keys in slot order.
+Shape* Context_layout(Symbol* keys, int count);
 Value* Context_get(Context* ctx, Symbol key);
+Value* Context_getLocal(Context* ctx, Symbol key); // ignores parents
 SetResult Context_set(Context* ctx, Symbol key, Value value);
 void Context_bind(Context* ctx, Symbol key, Value value);
+void Context_setParent(Context* ctx, Context* parent);
+// Key at index of ctx's shape table, 0 if that entry is empty or unbound.
+Symbol Context_keyAt(Context* ctx, int index);
+// Number of bound keys.
+int Context_count(Context* ctx);
+// Changes whenever a lookup of key through cached contexts could resolve
+// differently, i.e. key is newly bound in one or one is reparented.
+u32 Context_epoch(Symbol key);
 void Context_dump(Context* ctx);
@@ -0,0 +1,334 @@
+#include "coroutine.h"
+#include "context.h"
+#include "parallel.h"
+#include "stack.h"
+#include "vm.h"
+#include <gc/gc.h>
+#include <gc/gc_mark.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// The x86-64 switch below saves only what the ABI has callees preserve, so
+// costs a few nanoseconds. Elsewhere swapcontext is used, which also saves
+// the signal mask (a system call).
+#if defined(__x86_64__) && defined(__ELF__)
+#define NATIVE_SWITCH
+#else
+#include <ucontext.h>
+#endif
+
+extern bool evalCall(VM* vm, AstNode* caller, Value v, Value* self);
+extern void raiseInvalid(VM* vm, AstNode* node, const char* msg);
+
+#define STACK_SIZE (1024 * 1024)
+#define STACK_POOL 64 // stacks of dead coroutines kept for reuse, per thread
+
+const char* coStatusNames[CO_STATUS_COUNT] = {
+    "suspended", "running", "normal", "dead"
+};
+
+// A thread's own stack, which its VM runs on outside of coroutines, and is
+// suspended while one runs. These are never freed, like VMs.
+struct sCoThread {
+    void* sp; // while suspended
+    bool suspended;
+    void* gcHandle;
+    struct GC_stack_base bottom;
+    void* machine;
+    CoThread* next;
+};
+
+static CoThread* threads;
+static pthread_mutex_t threadsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+static GC_push_other_roots_proc chainedPushRoots;
+static int coroutineKind;
+static _Thread_local VM* entering; // VM whose coroutine is being started
+static _Thread_local char* stackPool[STACK_POOL];
+static _Thread_local int pooled;
+static _Thread_local bool holdingSuspend;
+
+#ifdef NATIVE_SWITCH
+// Push the callee-saved registers, store the stack pointer in *from, then
+// switch to the stack at to and pop its registers, returning to whatever
+// called fpCoSwitch there (or to the entry function pushed by startStack).
+void fpCoSwitch(void** from, void* to);
+__asm__(
+    ".text\n"
+    ".globl fpCoSwitch\n"
+    ".type fpCoSwitch, @function\n"
+    "fpCoSwitch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size fpCoSwitch, .-fpCoSwitch\n"
+);
+#endif
+
+// Conservatively mark what the words from lo to hi point to.
+static struct GC_ms_entry* markRange(void* lo, void* hi,
+    struct GC_ms_entry* msp, struct GC_ms_entry* limit) {
+    for (GC_word* p = lo; (char*) (p + 1) <= (char*) hi; p++) {
+        void* obj = (void*) *p;
+        msp = GC_MARK_AND_PUSH(obj, msp, limit, (void**) p);
+    }
+    return msp;
+}
+
+// Coroutines are marked along with the part of their C stack in use, so
+// that what only a suspended coroutine refers to lives as long as it does.
+// The stack of a running one is scanned by the collector as the current one.
+static struct GC_ms_entry* markCoroutine(GC_word* addr,
+    struct GC_ms_entry* msp, struct GC_ms_entry* limit, GC_word env) {
+    (void) env;
+    Coroutine* co = (Coroutine*) addr;
+    msp = markRange(co, co + 1, msp, limit);
+    if (co->cstack && co->status != CO_RUNNING) {
+        msp = markRange(co->sp, co->cstack + STACK_SIZE, msp, limit);
+    }
+    return msp;
+}
+
+// Thread stacks suspended while one of their coroutines runs are not the
+// collector's current stack for that thread, so are pushed as extra roots.
+static void GC_CALLBACK pushThreads(void) {
+    if (chainedPushRoots) chainedPushRoots();
+    for (CoThread* t = threads; t; t = t->next) {
+        if (t->suspended) GC_push_all(t->sp, t->bottom.mem_base);
+    }
+}
+
+static void initialize(void) {
+    coroutineKind = GC_new_kind(GC_new_free_list(),
+        GC_MAKE_PROC(GC_new_proc(markCoroutine), 0), 0, 1);
+    chainedPushRoots = GC_get_push_other_roots();
+    GC_set_push_other_roots(pushThreads);
+}
+
+static CoThread* threadOf(VM* vm) {
+    if (vm->coThread) return vm->coThread;
+    // uncollectable, as registers saved by swapcontext must be scanned
+    CoThread* t = GC_MALLOC_UNCOLLECTABLE(sizeof(CoThread));
+    t->gcHandle = GC_get_my_stackbottom(&t->bottom);
+#ifndef NATIVE_SWITCH
+    t->machine = GC_MALLOC_UNCOLLECTABLE(sizeof(ucontext_t));
+#endif
+    pthread_mutex_lock(&threadsLock);
+    t->next = threads;
+    threads = t;
+    pthread_mutex_unlock(&threadsLock);
+    vm->coThread = t;
+    return t;
+}
+
+Coroutine* Coroutine_create(VM* vm, Value fn) {
+    pthread_once(&initOnce, initialize);
+    Coroutine* co = GC_generic_malloc(sizeof(Coroutine), coroutineKind);
+    co->header.kind = NATIVE_COROUTINE;
+    co->status = CO_SUSPENDED;
+    co->fn = fn;
+    co->stack = GC_MALLOC(sizeof(Stack));
+    co->aux = GC_MALLOC(sizeof(Stack));
+    co->scopes = GC_MALLOC(sizeof(Stack));
+    co->context = vm->context;
+    if (co->context) Context_escape(co->context);
+    return co;
+}
+
+static void releaseStack(Coroutine* co) {
+    if (!co->cstack) return;
+    if (pooled < STACK_POOL) stackPool[pooled++] = co->cstack;
+    else munmap(co->cstack, STACK_SIZE);
+    co->cstack = NULL;
+}
+
+// Suspended coroutines which become unreachable are never resumed again.
+static void finalizeCoroutine(void* obj, void* data) {
+    (void) data;
+    releaseStack(obj);
+}
+
+static void entry(void);
+
+// Allocate a C stack for co, set up to start in entry when switched to.
+static bool startStack(Coroutine* co) {
+    char* mem;
+    if (pooled) {
+        mem = stackPool[--pooled];
+    } else {
+        mem = mmap(NULL, STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mem == MAP_FAILED) return false;
+        // guard page, so that overflowing the stack faults
+        mprotect(mem, getpagesize(), PROT_NONE);
+    }
+    co->cstack = mem;
+    GC_register_finalizer_no_order(co, finalizeCoroutine, NULL, NULL, NULL);
+#ifdef NATIVE_SWITCH
+    void** sp = (void**) (mem + STACK_SIZE);
+    *--sp = NULL; // return address of entry, which never returns
+    *--sp = (void*) entry;
+    for (int i = 0; i < 6; i++) *--sp = NULL; // registers popped by fpCoSwitch
+    co->sp = sp;
+#else
+    ucontext_t* uc = GC_MALLOC(sizeof(ucontext_t));
+    getcontext(uc);
+    uc->uc_stack.ss_sp = mem;
+    uc->uc_stack.ss_size = STACK_SIZE;
+    uc->uc_link = NULL;
+    makecontext(uc, entry, 0);
+    co->machine = uc;
+    co->sp = mem + STACK_SIZE;
+#endif
+    return true;
+}
+
+typedef struct sBottom {
+    void* gcHandle;
+    struct GC_stack_base base;
+} Bottom;
+
+static void* GC_CALLBACK setBottom(void* data) {
+    Bottom* bottom = data;
+    GC_set_stackbottom(bottom->gcHandle, &bottom->base);
+    return NULL;
+}
+
+// A collection started by another thread suspends this one with a signal,
+// then scans its stack up to the bottom set by switchStacks, which is only
+// right once on that stack. So while other threads are running the signal is
+// held off from setting the bottom until the switch is done.
+static void holdSuspend(bool hold) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, GC_get_suspend_signal());
+    pthread_sigmask(hold ? SIG_BLOCK : SIG_UNBLOCK, &set, NULL);
+}
+
+// Called first thing on the stack switched to.
+static void switched(void) {
+    if (!holdingSuspend) return;
+    holdingSuspend = false;
+    holdSuspend(false);
+}
+
+// Continue on the C stack of to, or of the thread if NULL, suspending that of
+// from likewise. Returns once switched back to from.
+static void switchStacks(VM* vm, Coroutine* from, Coroutine* to) {
+    CoThread* t = vm->coThread;
+    void** fromSp = from ? &from->sp : &t->sp;
+    Bottom bottom = { t->gcHandle, t->bottom };
+    if (to) bottom.base.mem_base = to->cstack + STACK_SIZE;
+    holdingSuspend = Parallel_threaded();
+    if (holdingSuspend) holdSuspend(true);
+    GC_call_with_alloc_lock(setBottom, &bottom);
+    t->suspended = to != NULL;
+    entering = vm;
+#ifdef NATIVE_SWITCH
+    fpCoSwitch(fromSp, to ? to->sp : t->sp);
+#else
+    // registers are saved in machine, the stack in use is only below this
+    int marker;
+    *fromSp = &marker;
+    swapcontext(from ? from->machine : t->machine, to ? to->machine : t->machine);
+#endif
+    switched();
+}
+
+// Exchange the VM's state with that kept by co.
+static void swapState(VM* vm, Coroutine* co) {
+    #define SWAP(type, field) { \
+        type tmp = vm->field; vm->field = co->field; co->field = tmp; }
+    SWAP(Stack*, stack);
+    SWAP(Stack*, aux);
+    SWAP(Stack*, scopes);
+    SWAP(int, base);
+    SWAP(Context*, context);
+    SWAP(AstNode**, callSites);
+    SWAP(int, callCapacity);
+    SWAP(int, callDepth);
+    #undef SWAP
+}
+
+// Move the last count values of from to the end of to.
+static void moveValues(Stack* from, Stack* to, int count) {
+    Stack_reserve(to, count);
+    from->next -= count;
+    memcpy(&to->values[to->next], &from->values[from->next], sizeof(Value) * count);
+    to->next += count;
+}
+
+static void entry(void) {
+    switched();
+    VM* vm = entering;
+    Coroutine* co = vm->coroutine;
+    // started with the arguments of its first resume as its group
+    co->failed = !evalCall(vm, NULL, co->fn, NULL);
+    co->status = CO_DEAD;
+    int count = co->failed ? 0 : vm->stack->next - vm->base;
+    swapState(vm, co);
+    moveValues(co->stack, vm->stack, count);
+    switchStacks(vm, co, co->resumer);
+    assert(0 && "dead coroutine resumed");
+}
+
+bool Coroutine_resume(VM* vm, AstNode* node, Coroutine* co, int argCount) {
+    if (co->status != CO_SUSPENDED) {
+        raiseInvalid(vm, node, co->status == CO_DEAD ?
+            "cannot resume dead coroutine" : "cannot resume running coroutine");
+        return false;
+    }
+    threadOf(vm);
+    if (!co->cstack && !startStack(co)) {
+        raiseInvalid(vm, node, "could not allocate coroutine stack");
+        return false;
+    }
+    Coroutine* from = vm->coroutine;
+    swapState(vm, co);
+    moveValues(co->stack, vm->stack, argCount);
+    // not before, as moving values can collect, which scans the C stacks of
+    // coroutines only while they are not running
+    if (from) from->status = CO_NORMAL;
+    co->status = CO_RUNNING;
+    co->resumer = from;
+    vm->coroutine = co;
+    switchStacks(vm, from, co);
+    // the coroutine has swapped back to our state, moving its values over
+    vm->coroutine = from;
+    if (from) from->status = CO_RUNNING;
+    co->resumer = NULL;
+    if (co->status == CO_DEAD) {
+        releaseStack(co);
+        return !co->failed;
+    }
+    return true;
+}
+
+bool Coroutine_yield(VM* vm, AstNode* node) {
+    Coroutine* co = vm->coroutine;
+    if (!co) {
+        raiseInvalid(vm, node, "cannot yield outside of a coroutine");
+        return false;
+    }
+    int count = vm->stack->next - vm->base;
+    co->status = CO_SUSPENDED;
+    swapState(vm, co);
+    moveValues(co->stack, vm->stack, count);
+    switchStacks(vm, co, co->resumer);
+    // resumed, with the arguments moved to our stack already
+    return true;
+}
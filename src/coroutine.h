@@ -0,0 +1,55 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+
+typedef struct sVM VM;
+typedef struct sAstNode AstNode;
+typedef struct sStack Stack;
+typedef struct sContext Context;
+typedef struct sCoroutine Coroutine;
+typedef struct sCoThread CoThread;
+
+// note: keep in sync with coStatusNames in coroutine.c
+typedef enum {
+    CO_SUSPENDED, // not started yet, or yielded
+    CO_RUNNING,
+    CO_NORMAL, // resumed another coroutine, which has not yielded yet
+    CO_DEAD, // returned or raised an exception
+    CO_STATUS_COUNT
+} CoStatus;
+
+// A closure evaluated on a C stack of its own, so that it can be suspended
+// part way through. Coroutines also have their own value stacks, call sites
+// and current context, which are swapped with those of the VM while running.
+// Stacks are reserved with mmap and only take memory once touched, so tens of
+// thousands of coroutines can be suspended at once.
+struct sCoroutine {
+    Native header;
+    CoStatus status;
+    bool failed; // dead from an exception
+    Value fn;
+    Coroutine* resumer; // while running, NULL if resumed from the thread's stack
+    // VM state of the coroutine, or of its resumer while it runs
+    Stack* stack, * aux, * scopes;
+    int base;
+    Context* context;
+    AstNode** callSites;
+    int callDepth, callCapacity;
+    // C stack, allocated when first resumed and released once dead
+    char* cstack;
+    void* sp; // stack pointer while suspended (or normal)
+    void* machine; // saved registers, on platforms without a native switch
+};
+
+extern const char* coStatusNames[CO_STATUS_COUNT];
+
+Coroutine* Coroutine_create(VM* vm, Value fn);
+// Resume a suspended coroutine, passing it the last argCount values of the
+// current group: as the group its closure starts with, or in place of the
+// values it yielded. These are replaced with the values it yields next, or
+// the group it finishes with. Raises the exception the coroutine raised, if
+// it does.
+bool Coroutine_resume(VM* vm, AstNode* node, Coroutine* co, int argCount);
+// Suspend the running coroutine, passing the current group to its resumer,
+// and replacing it with the values it is resumed with.
+bool Coroutine_yield(VM* vm, AstNode* node);
@@ -0,0 +1,190 @@
+#include "dict.h"
+#include "context.h"
+#include "vm.h"
+#include <gc/gc.h>
+
+extern bool valueEquality(VM* vm, AstNode* node, Value lhs, Value rhs, bool* result);
+extern bool valueHash(VM* vm, AstNode* node, Value v, u32* hash);
+
+Dict* Dict_create(NativeKind kind, int capacity) {
+    Dict* dict = GC_MALLOC(sizeof(Dict));
+    *dict = (Dict) { { kind } };
+    if (capacity > 0) {
+        dict->entries = GC_MALLOC(sizeof(DictEntry) * capacity);
+        dict->entryCapacity = capacity;
+    }
+    return dict;
+}
+
+Dict* Dict_copy(Dict* dict) {
+    Dict* copy = GC_MALLOC(sizeof(Dict));
+    *copy = *dict;
+    copy->version = 0;
+    if (dict->entryCapacity) {
+        copy->entries = GC_MALLOC(sizeof(DictEntry) * dict->entryCapacity);
+        memcpy(copy->entries, dict->entries, sizeof(DictEntry) * dict->used);
+    }
+    if (dict->indexCapacity) {
+        copy->index = GC_MALLOC_ATOMIC(sizeof(int) * dict->indexCapacity);
+        memcpy(copy->index, dict->index, sizeof(int) * dict->indexCapacity);
+    }
+    return copy;
+}
+
+// Key equality matching valueHash: contexts without _hash, closures and
+// natives are only equal to themselves.
+static bool keyEquals(VM* vm, Value a, Value b, bool* result) {
+    Type t = GET_TYPE(a);
+    if (GET_TYPE(b) != t) {
+        *result = false;
+        return true;
+    }
+    switch (t) {
+        case TYPE_CONTEXT: {
+            Context* ctx = GET_CONTEXT(a);
+            if (ctx == GET_CONTEXT(b)) *result = true;
+            else if (!Context_get(ctx, vm->symUHash)) *result = false;
+            else return valueEquality(vm, NULL, a, b, result);
+        } break;
+        case TYPE_CLOSURE: {
+            *result = GET_CLOSURE(a) == GET_CLOSURE(b);
+        } break;
+        case TYPE_NATIVE: {
+            *result = GET_NATIVE(a) == GET_NATIVE(b);
+        } break;
+        case TYPE_BLOB: {
+            Blob* x = GET_BLOB(a), * y = GET_BLOB(b);
+            *result = x->size == y->size && !memcmp(x->data, y->data, x->size);
+        } break;
+        case TYPE_LIST: {
+            Stack* x = GET_LIST(a), * y = GET_LIST(b);
+            *result = x->next == y->next;
+            for (int i = 0; *result && i < x->next; i++) {
+                if (!keyEquals(vm, x->values[i], y->values[i], result)) return false;
+            }
+        } break;
+        default: {
+            return valueEquality(vm, NULL, a, b, result);
+        }
+    }
+    return true;
+}
+
+// Find the entry position of key, or -1. Comparing keys may run _eq, which
+// could change the dict, in which case the search starts over.
+static bool findEntry(VM* vm, Dict* dict, Value key, u32 hash, int* pos) {
+    *pos = -1;
+    if (!dict->indexCapacity) return true;
+    retry:;
+    u32 version = dict->version;
+    u32 mask = dict->indexCapacity - 1;
+    for (u32 i = hash & mask;; i = (i + 1) & mask) {
+        int k = dict->index[i];
+        if (k == 0) return true;
+        if (k < 0) continue;
+        DictEntry* entry = &dict->entries[k - 1];
+        if (entry->hash != hash) continue;
+        bool equal;
+        if (!keyEquals(vm, entry->key, key, &equal)) return false;
+        if (dict->version != version) goto retry;
+        if (equal) {
+            *pos = k - 1;
+            return true;
+        }
+    }
+}
+
+// Drop deleted entries and rebuild the index with room for n more entries.
+static void rehash(Dict* dict, int n) {
+    int count = 0;
+    for (int i = 0; i < dict->used; i++) {
+        if (IS_UNBOUND(dict->entries[i].key)) continue;
+        dict->entries[count++] = dict->entries[i];
+    }
+    if (dict->used > count) {
+        memset(&dict->entries[count], 0, sizeof(DictEntry) * (dict->used - count));
+        dict->used = count;
+    }
+    int capacity = 8;
+    while (capacity < (count + n) * 2) capacity *= 2;
+    if (capacity != dict->indexCapacity) {
+        dict->index = GC_MALLOC_ATOMIC(sizeof(int) * capacity);
+        dict->indexCapacity = capacity;
+    }
+    memset(dict->index, 0, sizeof(int) * capacity);
+    u32 mask = capacity - 1;
+    for (int k = 0; k < count; k++) {
+        u32 i = dict->entries[k].hash & mask;
+        while (dict->index[i]) i = (i + 1) & mask;
+        dict->index[i] = k + 1;
+    }
+}
+
+// Append an entry for a key known not to be present.
+static Value* insert(Dict* dict, Value key, u32 hash, Value value) {
+    // deleted entries keep their index slot, so count those too
+    if ((dict->used + 1) * 2 > dict->indexCapacity) rehash(dict, dict->count + 1);
+    if (dict->used == dict->entryCapacity) {
+        int capacity = dict->entryCapacity ? dict->entryCapacity * 2 : 8;
+        dict->entries = GC_REALLOC(dict->entries, sizeof(DictEntry) * capacity);
+        dict->entryCapacity = capacity;
+    }
+    int pos = dict->used++;
+    dict->entries[pos] = (DictEntry) { key, value, hash };
+    u32 mask = dict->indexCapacity - 1;
+    u32 i = hash & mask;
+    while (dict->index[i] > 0) i = (i + 1) & mask;
+    dict->index[i] = pos + 1;
+    dict->count++;
+    dict->version++;
+    return &dict->entries[pos].value;
+}
+
+bool Dict_get(VM* vm, Dict* dict, Value key, Value** result) {
+    u32 hash;
+    int pos;
+    if (!valueHash(vm, NULL, key, &hash)) return false;
+    if (!findEntry(vm, dict, key, hash, &pos)) return false;
+    *result = pos < 0 ? NULL : &dict->entries[pos].value;
+    return true;
+}
+
+bool Dict_set(VM* vm, Dict* dict, Value key, Value value) {
+    u32 hash;
+    int pos;
+    if (!valueHash(vm, NULL, key, &hash)) return false;
+    if (!findEntry(vm, dict, key, hash, &pos)) return false;
+    if (pos < 0) insert(dict, key, hash, value);
+    else dict->entries[pos].value = value;
+    return true;
+}
+
+bool Dict_touch(VM* vm, Dict* dict, Value key, Value value, Value* result) {
+    u32 hash;
+    int pos;
+    if (!valueHash(vm, NULL, key, &hash)) return false;
+    if (!findEntry(vm, dict, key, hash, &pos)) return false;
+    *result = pos < 0 ? *insert(dict, key, hash, value) : dict->entries[pos].value;
+    return true;
+}
+
+bool Dict_delete(VM* vm, Dict* dict, Value key, bool* found) {
+    u32 hash;
+    int pos;
+    if (!valueHash(vm, NULL, key, &hash)) return false;
+    if (!findEntry(vm, dict, key, hash, &pos)) return false;
+    *found = pos >= 0;
+    if (pos < 0) return true;
+    u32 mask = dict->indexCapacity - 1;
+    u32 i = hash & mask;
+    while (dict->index[i] != pos + 1) i = (i + 1) & mask;
+    dict->index[i] = -1;
+    dict->entries[pos] = (DictEntry) { VAL_UNBOUND, VAL_NIL, 0 };
+    dict->count--;
+    dict->version++;
+    if (dict->count == 0) {
+        dict->used = 0;
+        memset(dict->index, 0, sizeof(int) * dict->indexCapacity);
+    }
+    return true;
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+
+typedef struct sVM VM;
+typedef struct sDict Dict;
+typedef struct sDictEntry DictEntry;
+
+struct sDictEntry {
+    Value key; // VAL_UNBOUND once deleted
+    Value value;
+    u32 hash;
+};
+
+// Hash map keyed by value, iterating in insertion order. Entries are kept
+// densely in insertion order, and found through an open-addressed index of
+// entry positions. Keys are hashed and compared by value for numbers,
+// strings, symbols, blobs and lists, by _hash and _eq for contexts defining
+// _hash, and by identity otherwise. Contexts defining _eq but not _hash
+// cannot be keys, as they would hash apart from contexts equal to them. Sets are dicts of kind NATIVE_SET, with
+// nil for every value.
+struct sDict {
+    Native header;
+    DictEntry* entries;
+    int used; // entries in use, including deleted ones
+    int count; // entries not deleted
+    int entryCapacity;
+    int* index; // entry position + 1, 0 if empty, -1 if deleted
+    int indexCapacity; // power of two (or 0)
+    u32 version; // changes on every insertion or deletion
+};
+
+Dict* Dict_create(NativeKind kind, int capacity);
+Dict* Dict_copy(Dict* dict);
+
+// The functions below may call _hash and _eq metamethods, so can fail with
+// an exception raised on vm, in which case they return false.
+
+// Find the value of key, *result is NULL if it is not present.
+bool Dict_get(VM* vm, Dict* dict, Value key, Value** result);
+bool Dict_set(VM* vm, Dict* dict, Value key, Value value);
+// Get the value of key, inserting value for it first if it is not present.
+bool Dict_touch(VM* vm, Dict* dict, Value key, Value value, Value* result);
+bool Dict_delete(VM* vm, Dict* dict, Value key, bool* found);
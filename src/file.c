@@ -0,0 +1,173 @@
+#include "file.h"
+#include "vm.h"
+#include <gc/gc.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+extern void raiseInvalid(VM* vm, AstNode* node, const char* msg);
+extern const char* gc_sprintf(const char* fmt, ...);
+
+static void finalizeFile(void* obj, void* data) {
+    (void) data;
+    File_close(obj);
+}
+
+// standard streams are shared, so only their line buffer is freed
+static void finalizeStd(void* obj, void* data) {
+    (void) data;
+    free(((File*) obj)->line);
+}
+
+File* File_open(const char* path, const char* mode) {
+    FILE* stream = fopen(path, mode);
+    if (!stream) return NULL;
+    File* file = GC_MALLOC(sizeof(File));
+    *file = (File) { { NATIVE_FILE }, GC_strdup(path), stream };
+    // files dropped without being closed are closed here
+    GC_register_finalizer(file, finalizeFile, NULL, NULL, NULL);
+    return file;
+}
+
+File* File_temp(void) {
+    FILE* stream = tmpfile();
+    if (!stream) return NULL;
+    File* file = GC_MALLOC(sizeof(File));
+    *file = (File) { { NATIVE_FILE }, "<temp>", stream };
+    GC_register_finalizer(file, finalizeFile, NULL, NULL, NULL);
+    return file;
+}
+
+File* File_std(int n) {
+    static const char* paths[] = { "<stdin>", "<stdout>", "<stderr>" };
+    FILE* streams[] = { stdin, stdout, stderr };
+    File* file = GC_MALLOC(sizeof(File));
+    *file = (File) { { NATIVE_FILE }, paths[n], streams[n], .std = true };
+    GC_register_finalizer(file, finalizeStd, NULL, NULL, NULL);
+    return file;
+}
+
+void File_close(File* file) {
+    if (!file->stream) return;
+    if (file->std) {
+        // closing them would leave print and the like writing to freed streams
+        fflush(file->stream);
+        return;
+    }
+    fclose(file->stream);
+    free(file->line);
+    file->stream = NULL;
+    file->line = NULL;
+    file->lineCapacity = 0;
+}
+
+static bool checkOpen(VM* vm, File* file) {
+    if (file->stream) return true;
+    // todo: better type than #invalid (#io?)
+    raiseInvalid(vm, NULL, "file is closed");
+    return false;
+}
+
+static bool checkError(VM* vm, File* file, const char* msg) {
+    if (!ferror(file->stream)) return true;
+    clearerr(file->stream);
+    raiseInvalid(vm, NULL, msg);
+    return false;
+}
+
+bool File_readLine(VM* vm, File* file, Value* result, bool* done) {
+    if (!checkOpen(vm, file)) return false;
+    // the line buffer is shared, so locked with the stream
+    flockfile(file->stream);
+    ssize_t length = getline(&file->line, &file->lineCapacity, file->stream);
+    if (length >= 0) {
+        if (length && file->line[length - 1] == '\n') length--;
+        *result = FROM_STRING(GC_strndup(file->line, length));
+    }
+    funlockfile(file->stream);
+    if (length < 0) {
+        if (!checkError(vm, file, "error reading file")) return false;
+        *done = true;
+    }
+    return true;
+}
+
+// reads of other than regular files grow their buffer by up to this much at
+// a time, so that a large size is not allocated before there is data for it
+#define READ_CHUNK 65536
+
+bool File_read(VM* vm, File* file, size_t size, Value* result) {
+    if (!checkOpen(vm, file)) return false;
+    size_t capacity = size < READ_CHUNK ? size : READ_CHUNK;
+    struct stat st;
+    off_t at;
+    if (fstat(fileno(file->stream), &st) == 0 && S_ISREG(st.st_mode) &&
+        (at = ftello(file->stream)) >= 0) {
+        // (no more than the rest of the file, though it may have grown since)
+        size_t left = st.st_size > at ? st.st_size - at : 0;
+        if (left < size) size = left;
+        capacity = size;
+    }
+    // (bytes only, so not scanned for pointers)
+    u8* data = GC_MALLOC_ATOMIC(capacity);
+    size_t read = 0;
+    while (data) {
+        size_t want = capacity - read;
+        size_t got = fread(data + read, 1, want, file->stream);
+        read += got;
+        if (got < want || read == size) break;
+        capacity = capacity * 2 < size ? capacity * 2 : size;
+        data = GC_REALLOC(data, capacity);
+    }
+    if (!data) {
+        raiseInvalid(vm, NULL, "could not allocate buffer");
+        return false;
+    }
+    if (read < size && !checkError(vm, file, "error reading file")) return false;
+    *result = Value_makeBlob(read, data);
+    return true;
+}
+
+bool File_write(VM* vm, File* file, const void* data, size_t size) {
+    if (!checkOpen(vm, file)) return false;
+    if (size && fwrite(data, size, 1, file->stream) != 1) {
+        clearerr(file->stream);
+        raiseInvalid(vm, NULL, "error writing file");
+        return false;
+    }
+    return true;
+}
+
+bool File_flush(VM* vm, File* file) {
+    if (!checkOpen(vm, file)) return false;
+    if (fflush(file->stream) != 0) {
+        clearerr(file->stream);
+        raiseInvalid(vm, NULL, "error writing file");
+        return false;
+    }
+    return true;
+}
+
+bool File_seek(VM* vm, File* file, bool hasPos, double pos) {
+    if (!checkOpen(vm, file)) return false;
+    if (hasPos && pos != (off_t) pos) {
+        raiseInvalid(vm, NULL, "expected integer");
+        return false;
+    }
+    int whence = !hasPos || pos < 0 ? SEEK_END : SEEK_SET;
+    if (fseeko(file->stream, hasPos ? (off_t) pos : 0, whence) != 0) {
+        raiseInvalid(vm, NULL, gc_sprintf("could not seek: %s", strerror(errno)));
+        return false;
+    }
+    return true;
+}
+
+bool File_tell(VM* vm, File* file, double* pos) {
+    if (!checkOpen(vm, file)) return false;
+    off_t at = ftello(file->stream);
+    if (at < 0) {
+        raiseInvalid(vm, NULL, gc_sprintf("could not tell: %s", strerror(errno)));
+        return false;
+    }
+    *pos = at;
+    return true;
+}
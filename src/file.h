@@ -0,0 +1,44 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+#include <stdio.h>
+
+typedef struct sVM VM;
+typedef struct sFile File;
+
+// An open file, read and written through a stdio buffer rather than whole,
+// so that files of any size are processed in constant memory. Reads and
+// writes may be mixed as fopen allows, with a seek or flush in between.
+// Files are closed once closed explicitly, once read to the end by a lines
+// iterator which opened them (see iter.h), or once collected.
+struct sFile {
+    Native header;
+    const char* path;
+    FILE* stream; // NULL once closed
+    char* line; // buffer for getline, malloced
+    size_t lineCapacity;
+    bool std; // stdin, stdout or stderr, only flushed when closed
+};
+
+// Open the file at path with an fopen mode. Returns NULL if it could not be
+// opened, with errno set.
+File* File_open(const char* path, const char* mode);
+// A new file opened for reading and writing, without a name, so removed once
+// closed. Returns NULL if it could not be created, with errno set.
+File* File_temp(void);
+// A file for stdin, stdout or stderr (n of 0, 1 or 2), left open once closed
+// or collected.
+File* File_std(int n);
+void File_close(File* file);
+// Set *result to the next line, without its newline, or set *done if at the
+// end of the file.
+bool File_readLine(VM* vm, File* file, Value* result, bool* done);
+// Set *result to a blob of the next size bytes, fewer if at the end. Only as
+// much is allocated as there is to read.
+bool File_read(VM* vm, File* file, size_t size, Value* result);
+bool File_write(VM* vm, File* file, const void* data, size_t size);
+bool File_flush(VM* vm, File* file);
+// Seek to pos bytes from the start, or from the end if negative, or to the
+// end if not hasPos.
+bool File_seek(VM* vm, File* file, bool hasPos, double pos);
+bool File_tell(VM* vm, File* file, double* pos);
@@ -12,12 +12,16 @@ typedef struct sClosure Closure;
 typedef struct sContext Context;
 typedef struct sModuleInfo ModuleInfo;
 typedef bool(*NativeFn)(VM* vm);
-typedef u16 Symbol;
+typedef u32 Symbol;
 
 #ifndef FP_HAS_VALUE
 typedef struct sValue_DUMMY Value;
+#ifdef FP_NAN_BOXING
+struct sValue_DUMMY { void* a; };
+#else
 struct sValue_DUMMY { void* a, * b; };
 #endif
+#endif
 
 // Garbage collected allocation
 void* fpAlloc(u32 size);
@@ -39,6 +43,14 @@ void* fpAllocData(u32 size);
 // f -> closure (Function)
 // l -> List
 // B -> Blob
+// D -> Dict
+// S -> Set (a Dict of kind NATIVE_SET)
+// A -> Array
+// I -> Iterator
+// C -> Coroutine
+// T -> Task
+// R -> actoR
+// F -> File
 // v -> any type
 // ?X -> type X or nil (additional bool field for if set)
 // *X -> 0 or more repeats of X (where X is another type)
@@ -0,0 +1,291 @@
+#include "iter.h"
+#include "array.h"
+#include "context.h"
+#include "coroutine.h"
+#include "file.h"
+#include "vm.h"
+#include <gc/gc.h>
+
+extern Context* getContext(VM* vm, Value v);
+extern bool evalCall(VM* vm, AstNode* caller, Value v, Value* self);
+extern bool isTruthy(Value v);
+extern Value charString(unsigned char c);
+extern void raiseUnbound2(VM* vm, AstNode* node, Symbol sym, Value value);
+extern void raiseUnderflow(VM* vm, AstNode* node, int n);
+extern void raiseInvalid(VM* vm, AstNode* node, const char* msg);
+extern const char* gc_sprintf(const char* fmt, ...);
+
+static Iterator* create(IterKind kind) {
+    Iterator* it = GC_MALLOC(sizeof(Iterator));
+    *it = (Iterator) { { NATIVE_ITERATOR }, kind };
+    return it;
+}
+
+bool Iterator_of(VM* vm, AstNode* node, Value v, Iterator** result) {
+    Iterator* it;
+    switch (GET_TYPE(v)) {
+        case TYPE_LIST: it = create(ITER_LIST); break;
+        case TYPE_STRING: it = create(ITER_STRING); break;
+        case TYPE_BLOB: it = create(ITER_BLOB); break;
+        case TYPE_CONTEXT: {
+            Context* ctx = GET_CONTEXT(v);
+            if (Context_get(ctx, vm->symUNext)) {
+                it = create(ITER_CUSTOM);
+            } else {
+                it = create(ITER_KEYS);
+                it->ctx = ctx;
+            }
+        } break;
+        case TYPE_NATIVE: {
+            NativeKind kind = GET_NATIVE(v)->kind;
+            if (kind == NATIVE_ITERATOR) {
+                *result = (Iterator*) GET_NATIVE(v);
+                return true;
+            } else if (kind == NATIVE_ARRAY) {
+                it = create(ITER_ARRAY);
+                break;
+            } else if (kind == NATIVE_COROUTINE) {
+                it = create(ITER_COROUTINE);
+                break;
+            } else if (kind == NATIVE_FILE) {
+                *result = Iterator_lines((File*) GET_NATIVE(v), NULL);
+                return true;
+            }
+        } // fallthrough
+        default: {
+            raiseInvalid(vm, node, gc_sprintf("cannot iterate over %s",
+                Value_repr(v, 1)));
+            return false;
+        }
+    }
+    it->source = v;
+    *result = it;
+    return true;
+}
+
+Iterator* Iterator_range(double first, double last) {
+    Iterator* it = create(ITER_RANGE);
+    it->at = first;
+    it->last = last;
+    it->step = first < last ? 1 : -1;
+    return it;
+}
+
+Iterator* Iterator_lines(File* file, const char* path) {
+    bool owns = !file;
+    if (owns && !(file = File_open(path, "rb"))) return NULL;
+    Iterator* it = create(ITER_LINES);
+    it->source = FROM_NATIVE(file);
+    it->file = file;
+    it->ownsFile = owns;
+    return it;
+}
+
+Iterator* Iterator_transform(IterKind kind, Iterator** sources, int count, Value fn) {
+    Iterator* it = create(kind);
+    it->sources = GC_MALLOC(sizeof(Iterator*) * count);
+    memcpy(it->sources, sources, sizeof(Iterator*) * count);
+    it->sourceCount = count;
+    it->fn = fn;
+    // (reused for each step, as the values are copied onto the stack for fn)
+    if (kind == ITER_ZIP) it->zipped = GC_MALLOC(sizeof(Value) * count);
+    return it;
+}
+
+// Call fn (as a method of self if not NULL) on count values, in a group of its
+// own so that it sees only those. Its results are left on the stack from
+// *first on, for the caller to pop.
+static bool callIsolated(VM* vm, AstNode* node, Value fn, Value* self,
+    Value* values, int count, int* first) {
+    int oldBase = vm->base;
+    Stack_push(vm->scopes, FROM_NUMBER(oldBase));
+    vm->base = vm->stack->next;
+    *first = vm->base;
+    Stack_reserve(vm->stack, count);
+    for (int i = 0; i < count; i++) Stack_push(vm->stack, values[i]);
+    bool result = evalCall(vm, node, fn, self);
+    vm->scopes->next--;
+    vm->base = oldBase;
+    if (!result) vm->stack->next = *first;
+    return result;
+}
+
+// Check for and skip keys bound in a context closer than the one being
+// iterated over, which lsv would have listed already.
+static bool isShadowed(Iterator* it, Symbol key) {
+    for (Context* c = GET_CONTEXT(it->source); c != it->ctx; c = c->parent) {
+        if (Context_getLocal(c, key)) return true;
+    }
+    return false;
+}
+
+static bool nextCustom(VM* vm, AstNode* node, Iterator* it, Value* result, bool* done) {
+    Value* pfn = Context_get(getContext(vm, it->source), vm->symUNext);
+    if (!pfn) {
+        raiseUnbound2(vm, node, vm->symUNext, it->source);
+        return false;
+    }
+    int first;
+    if (!callIsolated(vm, node, *pfn, &it->source, NULL, 0, &first)) return false;
+    int count = vm->stack->next - first;
+    Value flag = count ? vm->stack->values[vm->stack->next - 1] : VAL_NIL;
+    bool isBool = GET_TYPE(flag) == TYPE_ODDBALL && GET_ODDBALL(flag) <= 1;
+    bool valid = isBool && count == (isTruthy(flag) ? 2 : 1);
+    if (valid && isTruthy(flag)) *result = vm->stack->values[first];
+    else if (valid) *done = true;
+    vm->stack->next = first;
+    if (!valid) raiseInvalid(vm, node, "_next must push a value and true, or false");
+    return valid;
+}
+
+// Move the values on the stack from first on to it->pending.
+static void setPending(VM* vm, Iterator* it, int first) {
+    Stack* pending = &it->pending;
+    int count = vm->stack->next - first;
+    pending->next = 0;
+    Stack_reserve(pending, count);
+    memcpy(pending->values, &vm->stack->values[first], sizeof(Value) * count);
+    pending->next = count;
+    it->pendingPos = 0;
+    vm->stack->next = first;
+}
+
+static bool nextMap(VM* vm, AstNode* node, Iterator* it, Value* result, bool* done) {
+    while (it->pendingPos == it->pending.next) {
+        Value v;
+        if (!Iterator_next(vm, node, it->sources[0], &v, done)) return false;
+        if (*done) return true;
+        int first;
+        if (!callIsolated(vm, node, it->fn, NULL, &v, 1, &first)) return false;
+        setPending(vm, it, first);
+    }
+    *result = it->pending.values[it->pendingPos++];
+    return true;
+}
+
+// The values a coroutine returns with are not produced, only those yielded.
+static bool nextCoroutine(VM* vm, AstNode* node, Iterator* it, Value* result, bool* done) {
+    Coroutine* co = (Coroutine*) GET_NATIVE(it->source);
+    while (it->pendingPos == it->pending.next) {
+        if (co->status == CO_DEAD) {
+            *done = true;
+            return true;
+        }
+        int first = vm->stack->next;
+        if (!Coroutine_resume(vm, node, co, 0)) return false;
+        if (co->status == CO_DEAD) vm->stack->next = first;
+        setPending(vm, it, first);
+    }
+    *result = it->pending.values[it->pendingPos++];
+    return true;
+}
+
+static bool nextFilter(VM* vm, AstNode* node, Iterator* it, Value* result, bool* done) {
+    while (true) {
+        Value v;
+        if (!Iterator_next(vm, node, it->sources[0], &v, done)) return false;
+        if (*done) return true;
+        int first;
+        if (!callIsolated(vm, node, it->fn, NULL, &v, 1, &first)) return false;
+        if (vm->stack->next == first) {
+            raiseUnderflow(vm, node, 1);
+            return false;
+        }
+        bool keep = isTruthy(vm->stack->values[vm->stack->next - 1]);
+        vm->stack->next = first;
+        if (keep) {
+            *result = v;
+            return true;
+        }
+    }
+}
+
+static bool nextZip(VM* vm, AstNode* node, Iterator* it, Value* result, bool* done) {
+    while (it->pendingPos == it->pending.next) {
+        for (int i = 0; i < it->sourceCount; i++) {
+            if (!Iterator_next(vm, node, it->sources[i], &it->zipped[i], done)) return false;
+            if (*done) return true;
+        }
+        int first;
+        if (!callIsolated(vm, node, it->fn, NULL, it->zipped, it->sourceCount, &first)) {
+            return false;
+        }
+        setPending(vm, it, first);
+    }
+    *result = it->pending.values[it->pendingPos++];
+    return true;
+}
+
+bool Iterator_next(VM* vm, AstNode* node, Iterator* it, Value* result, bool* done) {
+    *done = it->done;
+    if (*done) return true;
+    switch (it->kind) {
+        case ITER_LIST: {
+            Stack* list = GET_LIST(it->source);
+            if (it->pos < list->next) *result = list->values[it->pos++];
+            else *done = true;
+        } break;
+        case ITER_STRING: {
+            unsigned char c = GET_STRING(it->source)[it->pos];
+            if (c) {
+                *result = charString(c);
+                it->pos++;
+            } else *done = true;
+        } break;
+        case ITER_BLOB: {
+            Blob* blob = GET_BLOB(it->source);
+            if (it->pos < blob->size) *result = FROM_NUMBER(blob->data[it->pos++]);
+            else *done = true;
+        } break;
+        case ITER_ARRAY: {
+            Array* array = (Array*) GET_NATIVE(it->source);
+            if (it->pos < array->length) *result = FROM_NUMBER(Array_get(array, it->pos++));
+            else *done = true;
+        } break;
+        case ITER_KEYS: {
+            while (it->ctx) {
+                while (it->pos < it->ctx->shape->capacity) {
+                    Symbol key = Context_keyAt(it->ctx, it->pos++);
+                    if (key && !isShadowed(it, key)) {
+                        *result = FROM_SYMBOL(key);
+                        return true;
+                    }
+                }
+                it->ctx = it->ctx->parent;
+                it->pos = 0;
+            }
+            *done = true;
+        } break;
+        case ITER_RANGE: {
+            // the same numbers as pushRange in vm.c
+            if (it->step > 0 ? it->at < it->last : it->at > it->last) {
+                *result = FROM_NUMBER(it->at);
+                it->at += it->step;
+            } else {
+                *result = FROM_NUMBER(it->last);
+                it->done = true;
+            }
+        } break;
+        case ITER_LINES: {
+            if (!File_readLine(vm, it->file, result, done)) return false;
+            if (*done && it->ownsFile) File_close(it->file);
+        } break;
+        case ITER_CUSTOM: {
+            if (!nextCustom(vm, node, it, result, done)) return false;
+        } break;
+        case ITER_COROUTINE: {
+            if (!nextCoroutine(vm, node, it, result, done)) return false;
+        } break;
+        case ITER_MAP: {
+            if (!nextMap(vm, node, it, result, done)) return false;
+        } break;
+        case ITER_FILTER: {
+            if (!nextFilter(vm, node, it, result, done)) return false;
+        } break;
+        case ITER_ZIP: {
+            if (!nextZip(vm, node, it, result, done)) return false;
+        } break;
+    }
+    if (*done) it->done = true;
+    return true;
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+#include "stack.h"
+
+typedef struct sVM VM;
+typedef struct sAstNode AstNode;
+typedef struct sIterator Iterator;
+typedef struct sFile File;
+
+typedef enum {
+    ITER_LIST, // values of a list
+    ITER_STRING, // characters of a string
+    ITER_BLOB, // bytes of a blob
+    ITER_ARRAY, // numbers of an array
+    ITER_KEYS, // keys of a context and its parents, as listed by lsv
+    ITER_RANGE, // numbers of first to last
+    ITER_LINES, // lines of a file, without their newlines
+    ITER_CUSTOM, // a context with a _next method
+    ITER_COROUTINE, // values yielded by a coroutine, until it returns
+    ITER_MAP, // results of fn on each value of sources[0]
+    ITER_FILTER, // values of sources[0] for which fn is truthy
+    ITER_ZIP // results of fn on the next value of each of sources
+} IterKind;
+
+// Iterators produce values one at a time, on demand. They are consumed as
+// they go, so are not restartable. Iterators over lists and contexts see
+// changes made to them during iteration.
+struct sIterator {
+    Native header;
+    IterKind kind;
+    bool done;
+    Value source; // list, string, blob, array, context, file or custom iterator
+    size_t pos; // in source, or in the parent chain for ITER_KEYS
+    Context* ctx; // ITER_KEYS: context whose keys are at pos
+    double at, last, step; // ITER_RANGE
+    File* file; // ITER_LINES
+    bool ownsFile; // ITER_LINES: opened by Iterator_lines, so closed once done
+    Iterator** sources; // ITER_MAP, ITER_FILTER and ITER_ZIP
+    int sourceCount;
+    Value fn;
+    Value* zipped; // ITER_ZIP: the next value of each source
+    Stack pending; // ITER_MAP, ITER_ZIP, ITER_COROUTINE: produced from pendingPos on
+    int pendingPos;
+};
+
+// Get an iterator over v: an iterator itself, a list, string, blob, array,
+// coroutine, file (over its lines), or context, for which the iterator is a custom one if it has
+// _next, or otherwise over its keys. Raises a type exception for anything else.
+bool Iterator_of(VM* vm, AstNode* node, Value v, Iterator** result);
+Iterator* Iterator_range(double first, double last);
+// Iterate over the lines of an open file, from where it is, or of the file
+// at path if file is NULL, opened and then closed once read to the end.
+// Returns NULL if the file could not be opened.
+Iterator* Iterator_lines(File* file, const char* path);
+Iterator* Iterator_transform(IterKind kind, Iterator** sources, int count, Value fn);
+
+// Get the next value of an iterator, or set *done if there are none left.
+// Iterators calling fruity code can fail, raising an exception on vm.
+bool Iterator_next(VM* vm, AstNode* node, Iterator* it, Value* result, bool* done);
@@ -1,6 +1,8 @@
 #include "common.h"
+#include "parallel.h"
 #include "parser.h"
 #include "vm.h"
+#include "profiler.h"
 #include <gc/gc.h>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -14,6 +16,12 @@ static const char* runKindLabels[] = {
 
 static void runFallbackRepl(VM* vm);
 
+// -G, read by the benchmark driver (src/bench/bench.c)
+static void printGcStats(void) {
+    fprintf(stderr, "gc heap %lu free %lu\n",
+        (unsigned long) GC_get_heap_size(), (unsigned long) GC_get_free_bytes());
+}
+
 char** fpArgv;
 int fpArgc;
 
@@ -24,11 +32,14 @@ int main(int argc, char** argv) {
     bool isFreestanding = false;
     bool fullTrace = false;
     bool noLocking = false;
+    const char* profilePath = NULL;
+    bool traceCalls = false;
+    bool gcStats = false;
 
     Module_initPaths();
 
     int option;
-    while ((option = getopt(argc, argv, "e:m:M:fFhtl")) != -1) {
+    while ((option = getopt(argc, argv, "e:m:M:p:j:PGfFhtl")) != -1) {
         switch (option) {
             // e -- Evaluate
             case 'e': {
@@ -66,6 +77,22 @@ int main(int argc, char** argv) {
             case 'l': {
                 noLocking = true;
             } break;
+            // p -- sampling Profile
+            case 'p': {
+                profilePath = GC_strdup(optarg);
+            } break;
+            // P -- tracing Profile
+            case 'P': {
+                traceCalls = true;
+            } break;
+            // j -- number of Jobs (threads) for pmap and tasks
+            case 'j': {
+                Parallel_setThreads(atoi(optarg));
+            } break;
+            // G -- print GC heap statistics
+            case 'G': {
+                gcStats = true;
+            } break;
             // h -- show help
             case 'h': {
                 printf("usage: %s [options] [file] [--] [args...]\n", argv[0]);
@@ -76,6 +103,10 @@ int main(int argc, char** argv) {
                 printf("    -F         Freestanding (dont import dragon)\n");
                 printf("    -t         don't hide internal Traces\n");
                 printf("    -l         disable context Locking\n");
+                printf("    -p file    write a sampling Profile to file (folded stacks)\n");
+                printf("    -P         time every call, reporting per function at exit\n");
+                printf("    -j n       run pmap and tasks on n threads (default: one per core)\n");
+                printf("    -G         print GC heap statistics to stderr at exit\n");
                 printf("    -h         show this help message\n");
                 exit(0);
             } break;
@@ -113,8 +144,13 @@ int main(int argc, char** argv) {
     rl_bind_key('\t', rl_insert);
     
     GC_INIT();
-    VM vm = { .fullTrace = fullTrace, .noLock = noLocking };
+    // static as the profiler samples it until exit
+    static VM vm;
+    vm = (VM) { .fullTrace = fullTrace, .noLock = noLocking };
     VM_startup(&vm);
+    if (profilePath) Profiler_start(&vm, profilePath);
+    if (traceCalls) Profiler_traceAtExit(&vm);
+    if (gcStats) atexit(printGcStats);
 
     for (int i = optind + 1; i < argc; i++) {
         Stack_push(vm.stack, FROM_STRING(argv[i]));
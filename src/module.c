@@ -7,6 +7,7 @@
 #include "sys/stat.h"
 #include "dlfcn.h"
 #include <errno.h>
+#include <pthread.h>
 
 // todo: expose properly
 extern void raiseInternal(VM* vm, const char* msg);
@@ -14,22 +15,26 @@ extern void raiseInternal(VM* vm, const char* msg);
 static bool loadFruityModule(VM* vm, ModuleInfo* info, const char* path);
 static bool loadNativeModule(VM* vm, ModuleInfo* info, const char* path);
 
+// modules may be imported from any thread, while paths may be added
 static const char* modPaths[16] = {
     "/usr/local/lib/fruity"
 };
 static int nextModPath = 1;
+static pthread_mutex_t pathLock = PTHREAD_MUTEX_INITIALIZER;
 
 void Module_initPaths(void) {
     const char* home = getenv("HOME");
     if (home) {
-        modPaths[nextModPath++] = fpSprintf("%s/.local/lib/fruity", home);
+        Module_addPath(fpSprintf("%s/.local/lib/fruity", home));
     }
 }
 
 void Module_addPath(const char* path) {
+    pthread_mutex_lock(&pathLock);
     // todo: allow any amount of mod paths
     assert(nextModPath < 16);
     modPaths[nextModPath++] = path;
+    pthread_mutex_unlock(&pathLock);
 }
 
 static bool importCommon(VM* vm, const char* name,
@@ -54,14 +59,19 @@ bool Module_import(VM* vm, const char* name, bool main) {
         native = true;
         snprintf(path, 1024, "/__BUILTIN__");
     }
-    for (int i = 0; i < nextModPath && !found; i++) {
-        snprintf(path, 1024, "%s/%s.fj", modPaths[i], name);
+    const char* paths[16];
+    pthread_mutex_lock(&pathLock);
+    int pathCount = nextModPath;
+    memcpy(paths, modPaths, sizeof(const char*) * pathCount);
+    pthread_mutex_unlock(&pathLock);
+    for (int i = 0; i < pathCount && !found; i++) {
+        snprintf(path, 1024, "%s/%s.fj", paths[i], name);
         struct stat s;
         if (stat(path, &s) == 0) {
             found = true;
             break;
         }
-        snprintf(path, 1024, "%s/mod%s.so", modPaths[i], name);
+        snprintf(path, 1024, "%s/mod%s.so", paths[i], name);
         if (stat(path, &s) == 0) {
             found = true;
             native = true;
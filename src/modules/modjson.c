@@ -4,21 +4,34 @@
 #include "../value.h"
 #include "../symbols.h"
 #include "../context.h"
+#include "../dict.h"
 #include "../stack.h"
 #include "../fruity.h"
 
-static Value json_to_fruity(VM* vm, JSON_Value* j) {
+// Objects become contexts keyed by symbols, or if dicts, dicts keyed by
+// strings. Symbols are never freed, so dicts suit data with arbitrary keys.
+static Value json_to_fruity(VM* vm, JSON_Value* j, bool dicts) {
     switch (json_value_get_type(j)) {
         case JSONNull: return fpNil;
         case JSONString: return fpFromString(GC_strdup(json_value_get_string(j)));
         case JSONNumber: return fpFromDouble(json_value_get_number(j));
         case JSONObject: {
-            Context* c = fpContextCreate(NULL);
             JSON_Object* o = json_value_get_object(j);
             int nkeys = json_object_get_count(o);
+            if (dicts) {
+                Dict* d = Dict_create(NATIVE_DICT, nkeys);
+                for (int i = 0; i < nkeys; i++) {
+                    Value key = fpFromString(GC_strdup(json_object_get_name(o, i)));
+                    Value v = json_to_fruity(vm, json_object_get_value_at(o, i), dicts);
+                    // (string keys call no metamethods, so cannot fail)
+                    Dict_set(vm, d, key, v);
+                }
+                return FROM_NATIVE(d);
+            }
+            Context* c = fpContextCreate(NULL);
             for (int i = 0; i < nkeys; i++) {
                 Symbol key = fpIntern(json_object_get_name(o, i));
-                Value v = json_to_fruity(vm, json_object_get_value_at(o, i));
+                Value v = json_to_fruity(vm, json_object_get_value_at(o, i), dicts);
                 fpContextBind(c, key, v);
             }
             return fpFromContext(c);
@@ -29,7 +42,7 @@ static Value json_to_fruity(VM* vm, JSON_Value* j) {
             // todo: api for lists that doesnt require vm?
             fpBeginList(vm);
             for (int i = 0; i < nvals; i++) {
-                fpPush(vm, json_to_fruity(vm, json_array_get_value(a, i)));
+                fpPush(vm, json_to_fruity(vm, json_array_get_value(a, i), dicts));
             }
             fpEndList(vm);
             return fpPop(vm);
@@ -57,10 +70,11 @@ static JSON_Value* fruity_to_json(Value value) {
             Context* ctx = fpToContext(value);
             JSON_Value* result = json_value_init_object();
             JSON_Object* o = json_value_get_object(result);
-            for (int i = 0; i < ctx->capacity; i++) {
-                if (!ctx->keys[i]) continue;
-                const char* name = Symbol_name(ctx->keys[i]);
-                JSON_Value* jv = fruity_to_json(ctx->values[i]);
+            for (int i = 0; i < ctx->shape->capacity; i++) {
+                Symbol key = Context_keyAt(ctx, i);
+                if (!key) continue;
+                const char* name = Symbol_name(key);
+                JSON_Value* jv = fruity_to_json(ctx->values[ctx->shape->slots[i]]);
                 json_object_set_value(o, name, jv);
             }
             return result;
@@ -87,11 +101,28 @@ static JSON_Value* fruity_to_json(Value value) {
             }
             return result;
         }
+        case TYPE_NATIVE: {
+            Dict* d = (Dict*) GET_NATIVE(value);
+            if (d->header.kind != NATIVE_DICT) break;
+            JSON_Value* result = json_value_init_object();
+            JSON_Object* o = json_value_get_object(result);
+            for (int i = 0; i < d->used; i++) {
+                DictEntry* e = &d->entries[i];
+                const char* name;
+                switch (GET_TYPE(e->key)) {
+                    case TYPE_STRING: name = fpToString(e->key); break;
+                    case TYPE_SYMBOL: name = Symbol_name(fpToSymbol(e->key)); break;
+                    default: continue; // (also skips deleted entries)
+                }
+                json_object_set_value(o, name, fruity_to_json(e->value));
+            }
+            return result;
+        }
     }
     return json_value_init_null();
 }
 
-bool modjson_decode(VM* vm) {
+static bool decode(VM* vm, bool dicts) {
     const char* json_source;
     if (!fpExtract(vm, "s", &json_source)) return false;
     JSON_Value* v = json_parse_string_with_comments(json_source);
@@ -99,11 +130,19 @@ bool modjson_decode(VM* vm) {
         fpRaiseInvalid(vm, "error parsing json string");
         return false;
     }
-    fpPush(vm, json_to_fruity(vm, v));
+    fpPush(vm, json_to_fruity(vm, v, dicts));
     json_value_free(v);
     return true;
 }
 
+bool modjson_decode(VM* vm) {
+    return decode(vm, false);
+}
+
+bool modjson_decode_dict(VM* vm) {
+    return decode(vm, true);
+}
+
 bool modjson_encode(VM* vm) {
     Value value;
     if (!fpExtract(vm, "v", &value)) return false;
@@ -144,6 +183,7 @@ bool register_module(VM* vm, ModuleInfo* module) {
     Context* ctx = fpContextCreate(NULL);
     fpModuleSetValue(module, fpFromContext(ctx));
     REGISTER(decode);
+    REGISTER(decode_dict);
     REGISTER(encode);
     REGISTER(encode_pretty);
     return true;
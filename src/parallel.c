@@ -0,0 +1,219 @@
+#include "parallel.h"
+#include "stack.h"
+#include "vm.h"
+#include <gc/gc.h>
+#include <pthread.h>
+#include <unistd.h>
+
+extern bool evalCall(VM* vm, AstNode* caller, Value v, Value* self);
+
+#define CHUNKS_PER_THREAD 4 // so that threads finishing early take up slack
+#define MAX_THREADS 256
+
+atomic_int parallelActive;
+atomic_int actorsActive;
+
+// A pmap in progress. Values are taken a chunk at a time, in order, by every
+// thread until none are left or a call raises.
+typedef struct sJob {
+    VM* parent;
+    AstNode* node;
+    Value fn;
+    Value* values; // from the first not mapped before the job started
+    int count, chunkSize, chunkCount;
+    Stack* results; // of each chunk
+    VM** raisedBy; // VM which raised in each chunk, if any
+    atomic_int nextChunk;
+    atomic_int firstRaised; // chunkCount if none raised
+} Job;
+
+typedef struct sWorker {
+    VM vm;
+    pthread_t thread;
+} Worker;
+
+static int threadCount; // 0 until first asked for, if not set
+static pthread_once_t defaultOnce = PTHREAD_ONCE_INIT;
+static int poolSize; // threads mapping, counting the one which started the job
+static Worker* workers; // poolSize - 1 of them
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+// guards the fields below, which start and finish jobs
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobStarted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobFinished = PTHREAD_COND_INITIALIZER;
+static Job* job;
+static u32 jobCount;
+static int busy; // workers yet to finish the current job
+
+void Parallel_setThreads(int count) {
+    threadCount = count < 1 ? 1 : count > MAX_THREADS ? MAX_THREADS : count;
+}
+
+static void setDefaultThreads(void) {
+    if (threadCount) return;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    Parallel_setThreads(cores > 0 ? cores : 1);
+}
+
+int Parallel_threads(void) {
+    pthread_once(&defaultOnce, setDefaultThreads);
+    return threadCount;
+}
+
+// Call fn on values begin to end of j, moving their results to results.
+static bool mapValues(VM* vm, Job* j, int begin, int end, Stack* results) {
+    for (int i = begin; i < end; i++) {
+        int oldBase = vm->base, oldScopes = vm->scopes->next;
+        Stack_push(vm->scopes, FROM_NUMBER(oldBase));
+        vm->base = vm->stack->next;
+        Stack_push(vm->stack, j->values[i]);
+        bool ok = evalCall(vm, j->node, j->fn, NULL);
+        if (ok) {
+            int n = vm->stack->next - vm->base;
+            Stack_reserve(results, n);
+            memcpy(&results->values[results->next], &vm->stack->values[vm->base],
+                sizeof(Value) * n);
+            results->next += n;
+        }
+        vm->stack->next = vm->base;
+        vm->scopes->next = oldScopes;
+        vm->base = oldBase;
+        if (!ok) return false;
+    }
+    return true;
+}
+
+static void runChunks(VM* vm, Job* j) {
+    while (true) {
+        int chunk = atomic_fetch_add(&j->nextChunk, 1);
+        // chunks after one which raised would be thrown away
+        if (chunk >= atomic_load(&j->firstRaised)) return;
+        int begin = chunk * j->chunkSize;
+        int end = begin + j->chunkSize < j->count ? begin + j->chunkSize : j->count;
+        if (mapValues(vm, j, begin, end, &j->results[chunk])) continue;
+        j->raisedBy[chunk] = vm;
+        int first = atomic_load(&j->firstRaised);
+        while (chunk < first &&
+            !atomic_compare_exchange_weak(&j->firstRaised, &first, chunk));
+        return;
+    }
+}
+
+void Parallel_share(VM* vm, VM* parent) {
+    vm->root = parent->root;
+    vm->context = parent->root;
+    vm->fullTrace = parent->fullTrace;
+    vm->noLock = parent->noLock;
+    memcpy(vm->typeProtos, parent->typeProtos, sizeof(vm->typeProtos));
+    memcpy(vm->nativeProtos, parent->nativeProtos, sizeof(vm->nativeProtos));
+    vm->refProto = parent->refProto;
+    vm->argProto = parent->argProto;
+    vm->exProto = parent->exProto;
+    // modules it imports are added to its own copy
+    vm->moduleCount = parent->moduleCount;
+    vm->modules = NULL;
+    if (vm->moduleCount) {
+        vm->modules = GC_MALLOC(sizeof(ModuleInfo*) * vm->moduleCount);
+        memcpy(vm->modules, parent->modules, sizeof(ModuleInfo*) * vm->moduleCount);
+    }
+}
+
+static void* runWorker(void* arg) {
+    Worker* w = arg;
+    u32 seen = 0;
+    pthread_mutex_lock(&poolLock);
+    while (true) {
+        while (jobCount == seen) pthread_cond_wait(&jobStarted, &poolLock);
+        seen = jobCount;
+        Job* j = job;
+        pthread_mutex_unlock(&poolLock);
+        Parallel_share(&w->vm, j->parent);
+        runChunks(&w->vm, j);
+        pthread_mutex_lock(&poolLock);
+        if (--busy == 0) pthread_cond_signal(&jobFinished);
+    }
+    return NULL;
+}
+
+static void startPool(void) {
+    poolSize = Parallel_threads();
+    // uncollectable, as nothing else refers to the workers' VMs
+    workers = GC_MALLOC_UNCOLLECTABLE(sizeof(Worker) * poolSize);
+    for (int i = 0; i < poolSize - 1; i++) {
+        Worker* w = &workers[i];
+        VM_startup(&w->vm);
+        if (pthread_create(&w->thread, NULL, runWorker, w) != 0) {
+            // make do with the threads started so far
+            poolSize = i + 1;
+            break;
+        }
+    }
+}
+
+bool Parallel_map(VM* vm, AstNode* node, Value fn) {
+    int count = vm->stack->next - vm->base;
+    if (!count) return true;
+    pthread_once(&poolOnce, startPool);
+    bool parallel = poolSize > 1 && count > 1 && !parallelActive;
+    int threads = parallel ? poolSize : 1;
+
+    Job j = { vm, node, fn };
+    j.count = count;
+    j.values = GC_MALLOC(sizeof(Value) * count);
+    memcpy(j.values, &vm->stack->values[vm->base], sizeof(Value) * count);
+    vm->stack->next = vm->base;
+    // the first value is mapped before other threads start, so that code
+    // first run for it is compiled, cached and quickened as usual
+    Stack first = {};
+    if (parallel) {
+        if (!mapValues(vm, &j, 0, 1, &first)) return false;
+        j.values++;
+        j.count--;
+    }
+    int chunks = threads * CHUNKS_PER_THREAD;
+    j.chunkSize = (j.count + chunks - 1) / chunks;
+    j.chunkCount = (j.count + j.chunkSize - 1) / j.chunkSize;
+    j.results = GC_MALLOC(sizeof(Stack) * j.chunkCount);
+    j.raisedBy = GC_MALLOC(sizeof(VM*) * j.chunkCount);
+    atomic_init(&j.nextChunk, 0);
+    atomic_init(&j.firstRaised, j.chunkCount);
+
+    if (parallel) {
+        parallelActive++;
+        pthread_mutex_lock(&poolLock);
+        job = &j;
+        jobCount++;
+        busy = poolSize - 1;
+        pthread_cond_broadcast(&jobStarted);
+        pthread_mutex_unlock(&poolLock);
+    }
+    runChunks(vm, &j);
+    if (parallel) {
+        pthread_mutex_lock(&poolLock);
+        while (busy) pthread_cond_wait(&jobFinished, &poolLock);
+        job = NULL;
+        pthread_mutex_unlock(&poolLock);
+        parallelActive--;
+    }
+
+    int raised = atomic_load(&j.firstRaised);
+    if (raised < j.chunkCount) {
+        VM* by = j.raisedBy[raised];
+        if (by != vm) {
+            vm->exSymbol = by->exSymbol;
+            vm->exMessage = by->exMessage;
+            vm->exTraceFirst = by->exTraceFirst;
+            vm->exTraceLast = by->exTraceLast;
+            vm->exSourceHasTrace = by->exSourceHasTrace;
+        }
+        return false;
+    }
+    for (int i = -1; i < j.chunkCount; i++) {
+        Stack* results = i < 0 ? &first : &j.results[i];
+        Stack_reserve(vm->stack, results->next);
+        memcpy(&vm->stack->values[vm->stack->next], results->values,
+            sizeof(Value) * results->next);
+        vm->stack->next += results->next;
+    }
+    return true;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+#include <stdatomic.h>
+
+typedef struct sVM VM;
+typedef struct sAstNode AstNode;
+
+// Nonzero while VMs are evaluating on more than one thread, or while tasks
+// spawned on a pool of more than one thread are unfinished (see task.h). They
+// share the root context, prototypes and compiled code of the VM which started
+// them, so meanwhile inline caches are only read, instructions are not
+// quickened (see vm.c), and the tables of symbols and shapes are locked.
+// note: only the thread which set it evaluates while it is zero
+extern atomic_int parallelActive;
+
+// Nonzero while actors (see actor.h) are running. Their VMs share no code or
+// contexts with any other, so go on caching and quickening, but the tables
+// of symbols and shapes are locked meanwhile all the same.
+extern atomic_int actorsActive;
+
+// If other threads may be evaluating, so that shared tables must be locked.
+static inline bool Parallel_threaded(void) {
+    return parallelActive || actorsActive;
+}
+
+// Set the number of threads pmap and tasks (see task.h) run on, counting the
+// one calling them. Before either first runs only, the default is the number
+// of cores.
+void Parallel_setThreads(int count);
+int Parallel_threads(void);
+
+// Give the VM of another thread what it shares with parent: its root,
+// prototypes and a copy of its list of modules.
+void Parallel_share(VM* vm, VM* parent);
+
+// pmap: call fn on each value of the current group in a group of its own, as
+// if by map, replacing the group with their results in order. The values are
+// split between a pool of threads, each with a VM of its own, so fn should
+// only touch its argument: the root is locked, but other shared contexts are
+// not. Raises the exception of the first value whose call does. Runs on the
+// calling thread alone if already running in parallel.
+bool Parallel_map(VM* vm, AstNode* node, Value fn);
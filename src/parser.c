@@ -1,5 +1,6 @@
 #include "common.h"
 #include "parser.h"
+#include "compiler.h"
 #include "fruity.h"
 
 // todo: expose via header
@@ -24,7 +25,7 @@ static const char* _TokenKind_labels[] = {
     "map", "fold", "filter", "zip",
     "is", "as", "to", "dot",
     "join", "repeat", "with", "catch",
-    "and", "or",
+    "and", "or", "pmap",
     "\\IDENT", "import", "this", "=>",
     "ERROR"
 };
@@ -231,6 +232,8 @@ void fpClassifyTokens(Parser* parser) {
             kind = TOK_AND_KEYWORD;
         } else if (length == 2 && strncmp(lexeme, "or", length) == 0) {
             kind = TOK_OR;
+        } else if (length == 4 && strncmp(lexeme, "pmap", length) == 0) {
+            kind = TOK_PMAP;
         } else if (length == 6 && strncmp(lexeme, "import", length) == 0) {
             kind = TOK_IMPORT;
         } else if (length == 4 && strncmp(lexeme, "this", length) == 0) {
@@ -357,15 +360,7 @@ bool fpIsValidChain(const char* str, int length) {
     return true;
 }
 
-typedef struct sRangeInfo {
-    int startLine, endLine;
-    int startColumn, endColumn;
-    const char* firstLine;
-    int firstLineLength;
-} RangeInfo;
-
-static void findRangeInfo(
-    const char* source, SourceRange range, RangeInfo* info) {
+void findRangeInfo(const char* source, SourceRange range, RangeInfo* info) {
     
     // todo: utf8 aware
     int line = 1, column = 1, lineStart = 0;
@@ -460,7 +455,7 @@ void dumpError(VM* vm) {
     // todo: exSourceHasTrace is probably redundant
     if (vm->exSourceHasTrace && trace && trace->module->native) {
         struct winsize ws;
-        ioctl(0, TIOCGWINSZ, &ws);
+        if (ioctl(0, TIOCGWINSZ, &ws)) ws.ws_col = 80;
         char label[256];
         RangeInfo info;
         const char* errSym = Symbol_repr(vm->exSymbol);
@@ -555,6 +550,8 @@ AstChainElem* fpParseChain(Parser* parser, const char* start, int length);
 
 Block* fpParse(ModuleInfo* moduleInfo) {
     Parser parser = { .moduleInfo = moduleInfo };
+    // symbols only referenced by a failed parse can be reclaimed
+    Symbol symMark = Symbol_mark();
     fpTokenize(&parser);
     fpClassifyTokens(&parser);
     // todo: `./fp -e '\\'` somehow still runs despite parse error
@@ -582,9 +579,11 @@ Block* fpParse(ModuleInfo* moduleInfo) {
     }
     if (parser.firstError) {
         dumpParseErrors(&parser);
+        Symbol_release(symMark);
         return NULL;
     }
     
+    fpResolveScopes(root);
     Block* block = GC_MALLOC(sizeof(Block));
     *block = (Block) { root, moduleInfo };
     return block;
@@ -605,7 +604,8 @@ AstNode* fpParseBody(Parser* parser, bool single) {
     AstNode* node = GC_MALLOC(sizeof(AstNode));
     *node = (AstNode) {
         .pos = token,
-        .module = parser->moduleInfo
+        .module = parser->moduleInfo,
+        .slot = -1
     };
 
     switch (tkind) {
@@ -668,7 +668,8 @@ AstNode* fpParseBody(Parser* parser, bool single) {
                             .as_symbol = bindSym,
                             .pos = bind,
                             .module = parser->moduleInfo,
-                            .next = node->sub
+                            .next = node->sub,
+                            .slot = -1
                         };
                         node->sub = bindNode;
                     }
@@ -779,7 +780,7 @@ AstNode* fpParseBody(Parser* parser, bool single) {
         case TOK_MAP: case TOK_FOLD: case TOK_FILTER: case TOK_ZIP:
         case TOK_IS: case TOK_AS: case TOK_TO: case TOK_DOT:
         case TOK_JOIN: case TOK_REPEAT: case TOK_WITH: case TOK_CATCH:
-        case TOK_AND_KEYWORD: case TOK_OR: {
+        case TOK_AND_KEYWORD: case TOK_OR: case TOK_PMAP: {
             node->kind = AST_SPECIAL;
             node->as_int = tkind - TOK_MAP;
             node->sub = fpParseBody(parser, true);
@@ -4,11 +4,15 @@
 #include "module.h"
 
 typedef struct sSourceRange SourceRange;
+typedef struct sRangeInfo RangeInfo;
 typedef struct sBlock Block;
 typedef struct sParserError ParserError;
 typedef struct sParser Parser;
 typedef struct sAstChainElem AstChainElem;
 typedef struct sAstNode AstNode;
+typedef struct sCode Code;
+typedef struct sAstScope AstScope;
+typedef struct sShape Shape;
 
 // todo: fully remove AST_PRIMITIVE and related code
 typedef enum AstKind {
@@ -43,7 +47,7 @@ typedef enum TokenKind {
     TOK_MAP, TOK_FOLD, TOK_FILTER, TOK_ZIP,
     TOK_IS, TOK_AS, TOK_TO, TOK_DOT,
     TOK_JOIN, TOK_REPEAT, TOK_WITH, TOK_CATCH,
-    TOK_AND_KEYWORD, TOK_OR,
+    TOK_AND_KEYWORD, TOK_OR, TOK_PMAP,
     TOK_BACKSLASH_IDENT, TOK_IMPORT, TOK_THIS, TOK_EQ_GT,
     TOK_ERROR
 } TokenKind;
@@ -52,7 +56,7 @@ typedef enum SpecialKind {
     SPC_MAP, SPC_FOLD, SPC_FILTER, SPC_ZIP,
     SPC_IS, SPC_AS, SPC_TO, SPC_DOT,
     SPC_JOIN, SPC_REPEAT, SPC_WITH, SPC_CATCH,
-    SPC_AND, SPC_OR
+    SPC_AND, SPC_OR, SPC_PMAP
 } SpecialKind;
 
 typedef enum OperatorKind {
@@ -67,6 +71,14 @@ struct sSourceRange {
     u32 begin, end;
 };
 
+// Line and column (both 1-based) of a source range
+struct sRangeInfo {
+    int startLine, endLine;
+    int startColumn, endColumn;
+    const char* firstLine;
+    int firstLineLength;
+};
+
 struct sParserError {
     const char* message;
     SourceRange range;
@@ -90,9 +102,6 @@ struct sParser {
 };
 
 struct sBlock {
-    // u32* instrs;
-    // u32* data;
-    // SourceRange* mapping;
     AstNode* first;
     ModuleInfo* info;
 };
@@ -116,11 +125,25 @@ struct sAstNode {
     };
     SourceRange pos;
     ModuleInfo* module;
+    Code* code; // bytecode for the body starting at this node, compiled lazily
+    AstScope* scope; // closure body this node is in, NULL at module level
+    // lexical address of the variable bound by or first in the chain of this
+    // node, relative to scope (slot is -1 if not resolved)
+    int depth, slot;
 };
 
-// What if instead we have two-layer parse?
-// First produces AST, second produces bytecode
-// Both are kept - AST used for disasm, bytecode used for eval
+// Variables bound in the frame of a closure body, in slot order (slot 0 is
+// always self). Assigned after parsing, see fpResolveScopes in compiler.h.
+struct sAstScope {
+    Symbol* locals;
+    int count, capacity;
+    AstScope* parent; // enclosing closure body, NULL at module level or in objects
+    Shape* layout; // frame shape, created when the body is first compiled
+};
+
+// Parsing is two-layer: the parser produces an AST, which is compiled to
+// bytecode (see compiler.h) the first time it is evaluated.
+// Both are kept - AST used for disasm and traces, bytecode used for eval
 
 // Parse string into list of tokens.
 void fpTokenize(Parser* parser);
@@ -136,3 +159,6 @@ void fpDumpBlock(Block* block);
 
 // Print the contents of a node for debug purposes.
 void fpDumpAst(AstNode* node, int depth);
+
+// Find the lines and columns a range spans in source.
+void findRangeInfo(const char* source, SourceRange range, RangeInfo* info);
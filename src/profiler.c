@@ -0,0 +1,323 @@
+#include "profiler.h"
+#include "parser.h"
+#include "module.h"
+#include "vm.h"
+#include "fruity.h"
+#include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define SAMPLE_INTERVAL_US 1000
+#define MAX_SAMPLE_DEPTH 256 // deeper stacks keep their innermost frames
+#define STACK_TABLE_SIZE (1 << 14) // power of 2
+#define FRAME_POOL_SIZE (1 << 18)
+
+// A distinct stack of call sites, and the number of samples it was seen in
+typedef struct sSampledStack {
+    u64 hash;
+    u32 count; // 0 if the entry is empty
+    u32 depth;
+    u32 offset; // of the call sites in framePool
+} SampledStack;
+
+typedef struct sFrameName {
+    AstNode* node;
+    const char* name;
+} FrameName;
+
+static VM* profiledVm;
+static const char* outputPath;
+static SampledStack* stacks;
+static AstNode** framePool;
+static u32 framePoolNext, stackCount, dropped;
+
+// Called on SIGPROF, so must not allocate: samples go into preallocated
+// tables, and are dropped once those fill up.
+static void onSample(int signo) {
+    (void) signo;
+    VM* vm = profiledVm;
+    int depth = vm->callDepth;
+    AstNode** sites = vm->callSites;
+    int first = depth > MAX_SAMPLE_DEPTH ? depth - MAX_SAMPLE_DEPTH : 0;
+    u32 n = depth - first;
+    u64 h = 14695981039346656037ull;
+    for (int i = first; i < depth; i++) {
+        h = (h ^ (uintptr_t) sites[i]) * 1099511628211ull;
+    }
+    u32 mask = STACK_TABLE_SIZE - 1;
+    for (u32 i = h & mask;; i = (i + 1) & mask) {
+        SampledStack* s = &stacks[i];
+        if (!s->count) {
+            if (stackCount * 2 >= STACK_TABLE_SIZE ||
+                framePoolNext + n > FRAME_POOL_SIZE) {
+                dropped++;
+                return;
+            }
+            memcpy(&framePool[framePoolNext], &sites[first], sizeof(AstNode*) * n);
+            *s = (SampledStack) { h, 1, n, framePoolNext };
+            framePoolNext += n;
+            stackCount++;
+            return;
+        }
+        if (s->hash == h && s->depth == n && !memcmp(&framePool[s->offset],
+            &sites[first], sizeof(AstNode*) * n)) {
+            s->count++;
+            return;
+        }
+    }
+}
+
+static const char* moduleName(ModuleInfo* module) {
+    return module->filename ? module->filename : module->name_;
+}
+
+static const char* sourceName(AstNode* node) {
+    RangeInfo info;
+    findRangeInfo(node->module->source, node->pos, &info);
+    char buf[256];
+    snprintf(buf, 256, "%s:%d:%d", moduleName(node->module),
+        info.startLine, info.startColumn);
+    return GC_strdup(buf);
+}
+
+// Get the file:line:col of a call site, resolving each node once.
+static const char* frameName(FrameName* names, u32 mask, AstNode* node) {
+    u32 i = ((uintptr_t) node >> 4) & mask;
+    while (names[i].node && names[i].node != node) i = (i + 1) & mask;
+    if (!names[i].node) names[i] = (FrameName) { node, sourceName(node) };
+    return names[i].name;
+}
+
+static void writeProfile(void) {
+    struct itimerval off = {};
+    setitimer(ITIMER_PROF, &off, NULL);
+
+    FILE* f = fopen(outputPath, "w");
+    if (!f) {
+        fprintf(stderr, "profiler: could not open %s\n", outputPath);
+        return;
+    }
+    u32 nameCapacity = 16;
+    while (nameCapacity < framePoolNext * 2) nameCapacity *= 2;
+    FrameName* names = GC_MALLOC(sizeof(FrameName) * nameCapacity);
+    for (int i = 0; i < STACK_TABLE_SIZE; i++) {
+        SampledStack* s = &stacks[i];
+        if (!s->count) continue;
+        if (!s->depth) fputs("(top level)", f);
+        for (u32 j = 0; j < s->depth; j++) {
+            if (j) fputc(';', f);
+            fputs(frameName(names, nameCapacity - 1, framePool[s->offset + j]), f);
+        }
+        fprintf(f, " %u\n", s->count);
+    }
+    fclose(f);
+    if (dropped) {
+        fprintf(stderr, "profiler: %u samples dropped (too many stacks)\n", dropped);
+    }
+}
+
+void Profiler_start(VM* vm, const char* path) {
+    profiledVm = vm;
+    outputPath = path;
+    stacks = GC_MALLOC_ATOMIC(sizeof(SampledStack) * STACK_TABLE_SIZE);
+    memset(stacks, 0, sizeof(SampledStack) * STACK_TABLE_SIZE);
+    // keeps the sampled nodes alive until they are written out
+    framePool = GC_MALLOC(sizeof(AstNode*) * FRAME_POOL_SIZE);
+    atexit(writeProfile);
+
+    struct sigaction action = {};
+    action.sa_handler = onSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+    struct itimerval timer = {
+        { 0, SAMPLE_INTERVAL_US }, { 0, SAMPLE_INTERVAL_US }
+    };
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Calls of one closure body or native function
+typedef struct sTraceEntry {
+    const void* key; // body node or native function, NULL if the entry is empty
+    Closure* callee; // the first seen with this key
+    u64 calls;
+    u64 active; // calls in progress, only the outermost counts to inclusiveNs
+    u64 inclusiveNs, selfNs;
+} TraceEntry;
+
+typedef struct sTraceFrame {
+    TraceEntry* entry;
+    u64 start;
+    u64 childNs; // time spent in calls made by this one
+} TraceFrame;
+
+struct sCallTracer {
+    TraceEntry* entries;
+    u32 capacity, count; // capacity is a power of 2
+    TraceFrame* frames;
+    int depth, frameCapacity;
+};
+
+static CallTracer* exitTracer;
+
+static u64 nowNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// empty closures have no body node, and are all counted together
+static const char emptyBody[] = "{}";
+
+static const void* traceKey(Closure* callee) {
+    if (!callee->binding) return ((NativeClosure*) callee)->nativeFn;
+    return callee->node ? (const void*) callee->node : emptyBody;
+}
+
+static TraceEntry* traceEntry(CallTracer* tracer, Closure* callee) {
+    const void* key = traceKey(callee);
+    if (tracer->count * 2 >= tracer->capacity) {
+        TraceEntry* old = tracer->entries;
+        u32 oldCapacity = tracer->capacity;
+        tracer->capacity = oldCapacity ? oldCapacity * 2 : 64;
+        tracer->entries = GC_MALLOC(sizeof(TraceEntry) * tracer->capacity);
+        memset(tracer->entries, 0, sizeof(TraceEntry) * tracer->capacity);
+        u32 mask = tracer->capacity - 1;
+        for (u32 i = 0; i < oldCapacity; i++) {
+            if (!old[i].key) continue;
+            u32 j = ((uintptr_t) old[i].key >> 4) & mask;
+            while (tracer->entries[j].key) j = (j + 1) & mask;
+            tracer->entries[j] = old[i];
+        }
+        // frames of calls in progress point into the old entries
+        for (int i = 0; i < tracer->depth; i++) {
+            TraceFrame* frame = &tracer->frames[i];
+            u32 j = ((uintptr_t) frame->entry->key >> 4) & mask;
+            while (tracer->entries[j].key != frame->entry->key) j = (j + 1) & mask;
+            frame->entry = &tracer->entries[j];
+        }
+    }
+    u32 mask = tracer->capacity - 1;
+    u32 i = ((uintptr_t) key >> 4) & mask;
+    while (tracer->entries[i].key && tracer->entries[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    TraceEntry* entry = &tracer->entries[i];
+    if (!entry->key) {
+        *entry = (TraceEntry) { .key = key, .callee = callee };
+        tracer->count++;
+    }
+    return entry;
+}
+
+void Profiler_traceEnter(CallTracer* tracer, Closure* callee) {
+    if (tracer->depth == tracer->frameCapacity) {
+        int capacity = tracer->frameCapacity ? tracer->frameCapacity * 2 : 64;
+        TraceFrame* frames = GC_MALLOC(sizeof(TraceFrame) * capacity);
+        if (tracer->depth) {
+            memcpy(frames, tracer->frames, sizeof(TraceFrame) * tracer->depth);
+        }
+        tracer->frames = frames;
+        tracer->frameCapacity = capacity;
+    }
+    TraceEntry* entry = traceEntry(tracer, callee);
+    entry->calls++;
+    entry->active++;
+    tracer->frames[tracer->depth++] = (TraceFrame) { entry, nowNs(), 0 };
+}
+
+static void leaveAt(CallTracer* tracer, u64 now) {
+    TraceFrame* frame = &tracer->frames[--tracer->depth];
+    u64 elapsed = now - frame->start;
+    TraceEntry* entry = frame->entry;
+    entry->selfNs += elapsed - frame->childNs;
+    if (--entry->active == 0) entry->inclusiveNs += elapsed;
+    if (tracer->depth) tracer->frames[tracer->depth - 1].childNs += elapsed;
+}
+
+void Profiler_traceLeave(CallTracer* tracer) {
+    // calls begun before tracing stopped have already been accounted
+    if (tracer->depth) leaveAt(tracer, nowNs());
+}
+
+void Profiler_traceStart(VM* vm) {
+    CallTracer* tracer = GC_MALLOC(sizeof(CallTracer));
+    *tracer = (CallTracer) {};
+    vm->tracer = tracer;
+}
+
+static CallTracer* stopTracing(VM* vm) {
+    CallTracer* tracer = vm->tracer;
+    vm->tracer = NULL;
+    if (!tracer) return NULL;
+    u64 now = nowNs();
+    while (tracer->depth) leaveAt(tracer, now);
+    return tracer;
+}
+
+static int compareSelf(const void* a, const void* b) {
+    const TraceEntry* x = *(TraceEntry**) a, * y = *(TraceEntry**) b;
+    if (x->selfNs != y->selfNs) return x->selfNs < y->selfNs ? 1 : -1;
+    return 0;
+}
+
+// The entries of a tracer, most self time first
+static TraceEntry** sortedEntries(CallTracer* tracer) {
+    TraceEntry** sorted = GC_MALLOC(sizeof(TraceEntry*) * (tracer->count + 1));
+    u32 n = 0;
+    for (u32 i = 0; i < tracer->capacity; i++) {
+        if (tracer->entries[i].key) sorted[n++] = &tracer->entries[i];
+    }
+    qsort(sorted, n, sizeof(TraceEntry*), compareSelf);
+    return sorted;
+}
+
+static const char* calleeName(Closure* callee) {
+    if (!callee->binding) return ((NativeClosure*) callee)->symbolName;
+    return callee->node ? sourceName(callee->node) : emptyBody;
+}
+
+static const char* calleeModule(Closure* callee) {
+    if (!callee->binding) return moduleName(((NativeClosure*) callee)->module);
+    return callee->node ? moduleName(callee->node->module) : "";
+}
+
+void Profiler_traceStop(VM* vm) {
+    CallTracer* tracer = stopTracing(vm);
+    fpBeginList(vm);
+    if (tracer) {
+        TraceEntry** sorted = sortedEntries(tracer);
+        for (u32 i = 0; i < tracer->count; i++) {
+            TraceEntry* entry = sorted[i];
+            Context* ctx = fpContextCreate(NULL);
+            fpContextBind(ctx, fpIntern("name"), fpFromString(calleeName(entry->callee)));
+            fpContextBind(ctx, fpIntern("module"), fpFromString(calleeModule(entry->callee)));
+            fpContextBind(ctx, fpIntern("calls"), fpFromDouble(entry->calls));
+            fpContextBind(ctx, fpIntern("total"), fpFromDouble(entry->inclusiveNs / 1e9));
+            fpContextBind(ctx, fpIntern("self"), fpFromDouble(entry->selfNs / 1e9));
+            fpPush(vm, fpFromContext(ctx));
+        }
+    }
+    fpEndList(vm);
+}
+
+static void writeTrace(void) {
+    CallTracer* tracer = exitTracer;
+    u64 now = nowNs();
+    while (tracer->depth) leaveAt(tracer, now);
+    TraceEntry** sorted = sortedEntries(tracer);
+    fprintf(stderr, "%12s %12s %12s  %s\n", "calls", "total (s)", "self (s)", "name");
+    for (u32 i = 0; i < tracer->count; i++) {
+        TraceEntry* entry = sorted[i];
+        fprintf(stderr, "%12llu %12.6f %12.6f  %s\n",
+            (unsigned long long) entry->calls,
+            entry->inclusiveNs / 1e9, entry->selfNs / 1e9,
+            calleeName(entry->callee));
+    }
+}
+
+void Profiler_traceAtExit(VM* vm) {
+    Profiler_traceStart(vm);
+    exitTracer = vm->tracer;
+    atexit(writeTrace);
+}
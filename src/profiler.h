@@ -0,0 +1,29 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+
+typedef struct sVM VM;
+
+// Sampling profiler: a SIGPROF timer records the call sites being evaluated
+// (vm->callSites) every interval of CPU time. At exit, the samples are written
+// to path as folded stacks ("frame;frame;frame count" lines, outermost frame
+// first, as read by flamegraph.pl), with frames given as file:line:col.
+void Profiler_start(VM* vm, const char* path);
+
+// Tracing profiler: while started, every call made through evalCall is
+// timed and counted against its callee, a closure (by the source range of
+// its body) or a native function. Calls in tail position are not eliminated
+// while tracing, so that each call is seen.
+void Profiler_traceStart(VM* vm);
+// Stop tracing, and push its report onto the stack: a list of contexts with
+// name, module, calls, total (inclusive seconds) and self (seconds), most
+// self time first. Calls still in progress are counted up to now.
+void Profiler_traceStop(VM* vm);
+// Trace the whole run, writing the report to stderr at exit.
+void Profiler_traceAtExit(VM* vm);
+
+// note: these two are only called by evalCall, with the tracer current when
+// the call began, which stays valid (but inert) once tracing is stopped
+typedef struct sCallTracer CallTracer;
+void Profiler_traceEnter(CallTracer* tracer, Closure* callee);
+void Profiler_traceLeave(CallTracer* tracer);
@@ -0,0 +1,553 @@
+#include "sort.h"
+#include "parallel.h"
+#include "stack.h"
+#include "vm.h"
+#include <gc/gc.h>
+#include <math.h>
+#include <pthread.h>
+
+extern bool evalCall(VM* vm, AstNode* caller, Value v, Value* self);
+extern bool valueCompare(VM* vm, AstNode* node, Value lhs, Value rhs, int* result);
+extern bool isTruthy(Value v);
+extern void raiseUnbound(VM* vm, AstNode* node, Symbol sym);
+extern void raiseType(VM* vm, AstNode* node, Type type);
+extern void raiseInvalid(VM* vm, AstNode* node, const char* msg);
+
+#define INSERTION_MAX 24 // runs no longer than this are sorted by insertion
+#define RADIX_MIN 256 // fewer numbers than this are merge sorted
+#define PARALLEL_MIN (1 << 16) // values per thread, at least, to sort in parallel
+#define MAX_THREADS 256 // as for pmap
+
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_MASK (RADIX_SIZE - 1)
+#define RADIX_PASSES 6 // enough for 64 bits
+
+#define INLINE static inline __attribute__((always_inline))
+
+// How values are compared, from the fastest
+typedef enum {
+    ORDER_NUMBERS,
+    ORDER_STRINGS,
+    ORDER_SYMBOLS,
+    ORDER_SCALARS, // of mixed types, but neither contexts nor lists
+    ORDER_ANY, // through valueCompare, which may call _cmp metamethods
+    ORDER_CALL, // by calling the closure sortwith was given
+    ORDER_KEYS, // by each key of a record in turn, in the order of each
+} Order;
+
+// What is sorted is records of width values, the keys first: values alone
+// for sort and sortwith, or a value after the keys it was given by sortby.
+typedef struct sSorter {
+    VM* vm;
+    AstNode* node;
+    int width, keys;
+    Order* orders; // of each key, for ORDER_KEYS
+    bool* descending; // of each key, for ORDER_KEYS
+    bool reverse; // if the single key of other orders is descending
+    Value fn; // for ORDER_CALL
+    bool failed; // a call raised, so the order no longer matters
+} Sorter;
+
+// The order of count keys, every stride values.
+static Order orderOf(Value* keys, int count, int stride) {
+    Type first = GET_TYPE(keys[0]);
+    bool mixed = false;
+    for (int i = 0; i < count; i++) {
+        Type t = GET_TYPE(keys[i * stride]);
+        if (t == TYPE_CONTEXT || t == TYPE_LIST) return ORDER_ANY;
+        mixed |= t != first;
+    }
+    if (mixed) return ORDER_SCALARS;
+    switch (first) {
+        case TYPE_NUMBER: return ORDER_NUMBERS;
+        case TYPE_STRING: return ORDER_STRINGS;
+        case TYPE_SYMBOL: return ORDER_SYMBOLS;
+        default: return ORDER_SCALARS;
+    }
+}
+
+static int callCompare(Sorter* s, Value a, Value b) {
+    VM* vm = s->vm;
+    int oldStk = vm->stack->next;
+    Stack_push(vm->stack, a);
+    Stack_push(vm->stack, b);
+    if (!evalCall(vm, s->node, s->fn, NULL)) {
+        s->failed = true;
+        return 0;
+    }
+    if (vm->stack->next != oldStk + 1) {
+        raiseInvalid(vm, s->node, "sortwith comparison returned incorrect amount of values");
+        s->failed = true;
+        return 0;
+    }
+    Value cm = Stack_pop(vm->stack);
+    if (GET_TYPE(cm) != TYPE_NUMBER) {
+        raiseInvalid(vm, s->node, "sortwith comparison returned incorrect type");
+        s->failed = true;
+        return 0;
+    }
+    return (GET_NUMBER(cm) > 0) - (GET_NUMBER(cm) < 0);
+}
+
+// Negative, zero or positive as a orders before, with or after b. Called with
+// a constant order where it can be, so that each loop compares one way only.
+INLINE int compare(Sorter* s, Order order, Value a, Value b) {
+    switch (order) {
+        case ORDER_NUMBERS: {
+            double x = GET_NUMBER(a), y = GET_NUMBER(b);
+            return (x > y) - (x < y);
+        }
+        case ORDER_STRINGS: return strcmp(GET_STRING(a), GET_STRING(b));
+        case ORDER_SYMBOLS: {
+            Symbol x = GET_SYMBOL(a), y = GET_SYMBOL(b);
+            return x == y ? 0 : strcmp(Symbol_name(x), Symbol_name(y));
+        }
+        case ORDER_CALL: return s->failed ? 0 : callCompare(s, a, b);
+        default: {
+            int result = 0;
+            if (s->failed) return 0;
+            if (!valueCompare(s->vm, s->node, a, b, &result)) s->failed = true;
+            return result;
+        }
+    }
+}
+
+INLINE int compareRecords(Sorter* s, Order order, const Value* a, const Value* b) {
+    if (order != ORDER_KEYS) {
+        int result = compare(s, order, a[0], b[0]);
+        return s->reverse ? -result : result;
+    }
+    for (int i = 0; i < s->keys; i++) {
+        int result = compare(s, s->orders[i], a[i], b[i]);
+        if (result) return s->descending[i] ? -result : result;
+    }
+    return 0;
+}
+
+INLINE void moveRecords(Value* to, const Value* from, int width, int count) {
+    if (width == 1 && count == 1) *to = *from;
+    else memmove(to, from, sizeof(Value) * width * count);
+}
+
+INLINE void insertionSort(Sorter* s, Order order, int width, Value* records, int count) {
+    for (int i = 1; i < count; i++) {
+        Value* at = &records[i * width];
+        if (width == 1) {
+            Value v = *at;
+            for (; at > records && compareRecords(s, order, at - 1, &v) > 0; at--) {
+                *at = at[-1];
+            }
+            *at = v;
+            continue;
+        }
+        // swapped a value at a time, as records vary in width
+        for (; at > records && compareRecords(s, order, at - width, at) > 0; at -= width) {
+            for (int k = 0; k < width; k++) {
+                Value v = at[k];
+                at[k] = at[k - width];
+                at[k - width] = v;
+            }
+        }
+    }
+}
+
+// Merge the sorted runs [a, aEnd) and [b, bEnd) to out, taking from a first
+// while equal. Out overlaps neither, or b only from before it.
+INLINE void mergeTo(Sorter* s, Order order, int width, Value* a, Value* aEnd,
+        Value* b, Value* bEnd, Value* out) {
+    while (a < aEnd && b < bEnd) {
+        if (compareRecords(s, order, a, b) <= 0) {
+            moveRecords(out, a, width, 1);
+            a += width;
+        } else {
+            moveRecords(out, b, width, 1);
+            b += width;
+        }
+        out += width;
+    }
+    memcpy(out, a, sizeof(Value) * (aEnd - a));
+    out += aEnd - a;
+    // (which in mergeSort may already be where it belongs)
+    memmove(out, b, sizeof(Value) * (bEnd - b));
+}
+
+// Bottom up merge sort, of runs sorted by insertion first. Each merge moves
+// its first run to scratch.
+INLINE void mergeSort(Sorter* s, Order order, int width, Value* records, int count,
+        Value* scratch) {
+    for (int i = 0; i < count; i += INSERTION_MAX) {
+        int n = count - i < INSERTION_MAX ? count - i : INSERTION_MAX;
+        insertionSort(s, order, width, &records[i * width], n);
+    }
+    for (int run = INSERTION_MAX; run < count && !s->failed; run *= 2) {
+        for (int i = 0; i + run < count; i += 2 * run) {
+            Value* a = &records[i * width], * b = a + run * width;
+            int n = count - i - run < run ? count - i - run : run;
+            // runs already in order, as in sorted or nearly sorted groups
+            if (compareRecords(s, order, b - width, b) <= 0) continue;
+            memcpy(scratch, a, sizeof(Value) * width * run);
+            mergeTo(s, order, width, scratch, scratch + run * width, b, b + n * width, a);
+        }
+    }
+}
+
+// Keys as wide as doubles which order as the numbers do, -0 before 0.
+static inline u64 numberKey(double d) {
+    union { double d; u64 bits; } u = { d };
+    return u.bits >> 63 ? ~u.bits : u.bits | 1ull << 63;
+}
+
+static inline double keyNumber(u64 key) {
+    union { u64 bits; double d; } u = { key >> 63 ? key & ~(1ull << 63) : ~key };
+    return u.d;
+}
+
+// LSD radix sort of numbers, on the keys of their bits, skipping digits
+// all keys share (as the low bits of whole numbers). The keys are written over
+// the values, which are at least as wide, and back to numbers once sorted, so
+// scratch needs room for as many keys. Equal numbers are indistinguishable,
+// so it is as stable as needed, but for -0 and 0, which are equal yet keyed
+// apart (see hasNegativeZero).
+static void radixSort(Value* values, int count, u64* scratch) {
+    u8* bytes = (u8*) values;
+    u32* counts = GC_MALLOC_ATOMIC(sizeof(u32) * RADIX_PASSES * RADIX_SIZE);
+    memset(counts, 0, sizeof(u32) * RADIX_PASSES * RADIX_SIZE);
+    // key i only overwrites values up to i, already read (copied bytewise, as
+    // it aliases them)
+    for (int i = 0; i < count; i++) {
+        u64 key = numberKey(GET_NUMBER(values[i]));
+        memcpy(&bytes[i * sizeof(u64)], &key, sizeof(u64));
+        for (int pass = 0; pass < RADIX_PASSES; pass++) {
+            counts[pass * RADIX_SIZE + ((key >> (pass * RADIX_BITS)) & RADIX_MASK)]++;
+        }
+    }
+    u64* keys = (u64*) values, * other = scratch;
+    for (int pass = 0; pass < RADIX_PASSES; pass++) {
+        u32* c = &counts[pass * RADIX_SIZE];
+        int shift = pass * RADIX_BITS;
+        if (c[(keys[0] >> shift) & RADIX_MASK] == (u32) count) continue;
+        u32 sum = 0;
+        for (int d = 0; d < RADIX_SIZE; d++) {
+            u32 n = c[d];
+            c[d] = sum;
+            sum += n;
+        }
+        for (int i = 0; i < count; i++) {
+            u64 key = keys[i];
+            other[c[(key >> shift) & RADIX_MASK]++] = key;
+        }
+        u64* t = keys;
+        keys = other;
+        other = t;
+    }
+    if (keys != (u64*) values) memcpy(values, keys, sizeof(u64) * count);
+    GC_FREE(counts);
+    // from the last, as value i overwrites keys from i on, already read
+    for (int i = count - 1; i >= 0; i--) {
+        u64 key;
+        memcpy(&key, &bytes[i * sizeof(u64)], sizeof(u64));
+        values[i] = FROM_NUMBER(keyNumber(key));
+    }
+}
+
+// Whether -0 is among the numbers, which radixSort would order before every
+// 0 rather than keeping them in order as equal.
+static bool hasNegativeZero(const Value* values, int count) {
+    for (int i = 0; i < count; i++) {
+        double d = GET_NUMBER(values[i]);
+        if (d == 0 && signbit(d)) return true;
+    }
+    return false;
+}
+
+// The order to sort with, for which mergeSort is inlined: as given for values
+// alone, only for a single key of numbers or strings otherwise.
+static Order sortedAs(Sorter* s, Order order) {
+    if (s->width == 1) return order;
+    if (s->width == 2 && (order == ORDER_NUMBERS || order == ORDER_STRINGS)) return order;
+    return ORDER_KEYS;
+}
+
+// Sort records with scratch for as many (or as many keys, for numbers alone).
+static void sortRun(Sorter* s, Order order, Value* records, int count, Value* scratch) {
+    order = sortedAs(s, order);
+    if (s->width == 1) {
+        switch (order) {
+            case ORDER_NUMBERS: {
+                if (count >= RADIX_MIN && !hasNegativeZero(records, count)) {
+                    radixSort(records, count, (u64*) scratch);
+                } else {
+                    mergeSort(s, ORDER_NUMBERS, 1, records, count, scratch);
+                }
+            } break;
+            case ORDER_STRINGS: mergeSort(s, ORDER_STRINGS, 1, records, count, scratch); break;
+            case ORDER_SYMBOLS: mergeSort(s, ORDER_SYMBOLS, 1, records, count, scratch); break;
+            case ORDER_SCALARS: mergeSort(s, ORDER_SCALARS, 1, records, count, scratch); break;
+            case ORDER_CALL: mergeSort(s, ORDER_CALL, 1, records, count, scratch); break;
+            default: mergeSort(s, ORDER_ANY, 1, records, count, scratch); break;
+        }
+    } else {
+        switch (order) {
+            case ORDER_NUMBERS: mergeSort(s, ORDER_NUMBERS, 2, records, count, scratch); break;
+            case ORDER_STRINGS: mergeSort(s, ORDER_STRINGS, 2, records, count, scratch); break;
+            default: mergeSort(s, ORDER_KEYS, s->width, records, count, scratch); break;
+        }
+    }
+}
+
+// A sort split between threads: each sorts a run of the records, then runs
+// are merged pairwise in rounds, back and forth between records and scratch.
+// The merges of each round are split evenly between the threads, so that the
+// last, of two halves, is as parallel as the first.
+typedef struct sSortJob {
+    Sorter* sorter;
+    Order order;
+    Value* records, * scratch;
+    int count, threads;
+    int* bounds; // of the runs, runs + 1 of them
+    int runs;
+    Value* from, * to; // of the current round
+} SortJob;
+
+typedef struct sSortPart {
+    SortJob* job;
+    int index;
+    void (*fn)(SortJob* j, int index);
+} SortPart;
+
+static void sortPart(SortJob* j, int index) {
+    int width = j->sorter->width;
+    int begin = j->bounds[index], end = j->bounds[index + 1];
+    sortRun(j->sorter, j->order, &j->records[begin * width], end - begin,
+        &j->scratch[begin * width]);
+}
+
+// The number of records of a among the first k merged from a and b.
+INLINE int splitAt(Sorter* s, Order order, int width, int k, Value* a, int m,
+        Value* b, int n) {
+    int lo = k > n ? k - n : 0, hi = k < m ? k : m;
+    while (lo < hi) {
+        int i = lo + (hi - lo) / 2;
+        // a[i] is among them if it merges before b[k - i - 1]
+        if (compareRecords(s, order, &a[i * width], &b[(k - i - 1) * width]) <= 0) lo = i + 1;
+        else hi = i;
+    }
+    return lo;
+}
+
+INLINE void mergePartAs(SortJob* j, Order order, int width, int index) {
+    Sorter* s = j->sorter;
+    int lo = (long) j->count * index / j->threads;
+    int hi = (long) j->count * (index + 1) / j->threads;
+    for (int r = 0; r < j->runs; r += 2) {
+        int begin = j->bounds[r], mid = j->bounds[r + 1];
+        int end = r + 2 <= j->runs ? j->bounds[r + 2] : mid;
+        int x = lo > begin ? lo : begin, y = hi < end ? hi : end;
+        if (x >= y) continue;
+        Value* a = &j->from[begin * width], * b = &j->from[mid * width];
+        int m = mid - begin, n = end - mid;
+        int ax = splitAt(s, order, width, x - begin, a, m, b, n);
+        int ay = splitAt(s, order, width, y - begin, a, m, b, n);
+        int bx = x - begin - ax, by = y - begin - ay;
+        mergeTo(s, order, width, &a[ax * width], &a[ay * width], &b[bx * width],
+            &b[by * width], &j->to[x * width]);
+    }
+}
+
+static void mergePart(SortJob* j, int index) {
+    Sorter* s = j->sorter;
+    Order order = sortedAs(s, j->order);
+    if (s->width == 1) {
+        switch (order) {
+            case ORDER_NUMBERS: mergePartAs(j, ORDER_NUMBERS, 1, index); break;
+            case ORDER_STRINGS: mergePartAs(j, ORDER_STRINGS, 1, index); break;
+            case ORDER_SYMBOLS: mergePartAs(j, ORDER_SYMBOLS, 1, index); break;
+            default: mergePartAs(j, ORDER_SCALARS, 1, index); break;
+        }
+    } else {
+        switch (order) {
+            case ORDER_NUMBERS: mergePartAs(j, ORDER_NUMBERS, 2, index); break;
+            case ORDER_STRINGS: mergePartAs(j, ORDER_STRINGS, 2, index); break;
+            default: mergePartAs(j, ORDER_KEYS, s->width, index); break;
+        }
+    }
+}
+
+static void* runPart(void* arg) {
+    SortPart* p = arg;
+    p->fn(p->job, p->index);
+    return NULL;
+}
+
+// Call fn for each part of j, on a thread of its own but for the first.
+static void runParts(SortJob* j, void (*fn)(SortJob* j, int index)) {
+    SortPart parts[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    bool started[MAX_THREADS];
+    for (int i = 1; i < j->threads; i++) {
+        parts[i] = (SortPart) { j, i, fn };
+        started[i] = pthread_create(&threads[i], NULL, runPart, &parts[i]) == 0;
+    }
+    fn(j, 0);
+    for (int i = 1; i < j->threads; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+        else fn(j, i);
+    }
+}
+
+static void sortParallel(Sorter* s, Order order, Value* records, int count,
+        Value* scratch, int threads) {
+    SortJob j = { s, order, records, scratch, count, threads };
+    j.bounds = GC_MALLOC_ATOMIC(sizeof(int) * (threads + 1));
+    for (int i = 0; i <= threads; i++) j.bounds[i] = (long) count * i / threads;
+    j.runs = threads;
+    runParts(&j, sortPart);
+    j.from = records;
+    j.to = scratch;
+    while (j.runs > 1) {
+        runParts(&j, mergePart);
+        for (int i = 0; i <= (j.runs + 1) / 2; i++) {
+            j.bounds[i] = j.bounds[2 * i < j.runs ? 2 * i : j.runs];
+        }
+        j.runs = (j.runs + 1) / 2;
+        Value* t = j.from;
+        j.from = j.to;
+        j.to = t;
+    }
+    if (j.from != records) memcpy(records, j.from, sizeof(Value) * s->width * count);
+    GC_FREE(j.bounds);
+}
+
+// If comparing in order can call back into the VM, which only the thread
+// sorting may do.
+static bool calls(Sorter* s, Order order) {
+    if (order == ORDER_ANY || order == ORDER_CALL) return true;
+    for (int i = 0; order == ORDER_KEYS && i < s->keys; i++) {
+        if (s->orders[i] == ORDER_ANY) return true;
+    }
+    return false;
+}
+
+// Sort count records in place, split between threads if long enough and
+// order does not call back into the VM. Raises if a call does.
+static bool sortRecords(Sorter* s, Order order, Value* records, int count) {
+    int threads = parallelActive || calls(s, order) ? 1 : Parallel_threads();
+    if (threads > count / PARALLEL_MIN) threads = count / PARALLEL_MIN;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (threads < 1) threads = 1;
+    // numbers alone hold no pointers, nor then does scratch for them, which
+    // only needs room for their keys unless merged
+    bool numbers = s->width == 1 && order == ORDER_NUMBERS;
+    bool keysOnly = numbers && threads == 1 && count >= RADIX_MIN &&
+        !hasNegativeZero(records, count);
+    size_t size = (keysOnly ? sizeof(u64) : sizeof(Value) * s->width) * count;
+    Value* scratch = numbers ? GC_MALLOC_ATOMIC(size) : GC_MALLOC_IGNORE_OFF_PAGE(size);
+    if (threads > 1) sortParallel(s, order, records, count, scratch, threads);
+    else sortRun(s, order, records, count, scratch);
+    GC_FREE(scratch);
+    return !s->failed;
+}
+
+// Sort a copy of count values of stack from begin, as calls may grow the
+// stack and so move its values, and copy it back.
+static bool sortCopy(Sorter* s, Order order, Stack* stack, int begin, int count) {
+    Value* copy = GC_MALLOC_IGNORE_OFF_PAGE(sizeof(Value) * count);
+    memcpy(copy, &stack->values[begin], sizeof(Value) * count);
+    bool ok = sortRecords(s, order, copy, count);
+    if (ok) memcpy(&stack->values[begin], copy, sizeof(Value) * count);
+    GC_FREE(copy);
+    return ok;
+}
+
+bool Sort_values(VM* vm, AstNode* node, Stack* stack, int begin, int count) {
+    if (count < 2) return true;
+    Sorter s = { vm, node, 1, 1 };
+    Order order = orderOf(&stack->values[begin], count, 1);
+    if (order == ORDER_ANY) return sortCopy(&s, order, stack, begin, count);
+    return sortRecords(&s, order, &stack->values[begin], count);
+}
+
+bool Sort_with(VM* vm, AstNode* node, Value fn) {
+    int count = vm->stack->next - vm->base;
+    if (count < 2) return true;
+    Sorter s = { vm, node, 1, 1 };
+    s.fn = fn;
+    return sortCopy(&s, ORDER_CALL, vm->stack, vm->base, count);
+}
+
+// The key k gives value, a symbol to look up in it or anything to call on it.
+static bool keyOf(VM* vm, AstNode* node, Value k, Value value, Value* key) {
+    if (GET_TYPE(k) == TYPE_SYMBOL) {
+        if (GET_TYPE(value) != TYPE_CONTEXT) {
+            raiseType(vm, node, TYPE_CONTEXT);
+            return false;
+        }
+        Value* pv = Context_get(GET_CONTEXT(value), GET_SYMBOL(k));
+        if (!pv) {
+            raiseUnbound(vm, node, GET_SYMBOL(k));
+            return false;
+        }
+        *key = *pv;
+        return true;
+    }
+    int oldStk = vm->stack->next;
+    Stack_push(vm->stack, value);
+    if (!evalCall(vm, node, k, NULL)) return false;
+    if (vm->stack->next != oldStk + 1) {
+        raiseInvalid(vm, node, "sortby key returned incorrect amount of values");
+        return false;
+    }
+    *key = Stack_pop(vm->stack);
+    return true;
+}
+
+bool Sort_by(VM* vm, AstNode* node, Value keys, Value descending) {
+    Value* ks = &keys;
+    int keyCount = 1;
+    if (GET_TYPE(keys) == TYPE_LIST) {
+        ks = GET_LIST(keys)->values;
+        keyCount = GET_LIST(keys)->next;
+        if (!keyCount) {
+            raiseInvalid(vm, node, "sortby needs at least one key");
+            return false;
+        }
+    }
+    bool* desc = GC_MALLOC_ATOMIC(sizeof(bool) * keyCount);
+    if (GET_TYPE(descending) == TYPE_LIST) {
+        Stack* list = GET_LIST(descending);
+        if (list->next != keyCount) {
+            raiseInvalid(vm, node, "sortby needs a descending flag for each key");
+            return false;
+        }
+        for (int i = 0; i < keyCount; i++) desc[i] = isTruthy(list->values[i]);
+    } else {
+        for (int i = 0; i < keyCount; i++) desc[i] = isTruthy(descending);
+    }
+    int count = vm->stack->next - vm->base;
+    if (count < 2) return true;
+    // records of the keys of each value, then the value, the keys given by
+    // calls which may move the stack
+    int width = keyCount + 1;
+    Value* records = GC_MALLOC_IGNORE_OFF_PAGE(sizeof(Value) * width * count);
+    for (int i = 0; i < count; i++) {
+        records[i * width + keyCount] = vm->stack->values[vm->base + i];
+    }
+    for (int i = 0; i < count; i++) {
+        Value* r = &records[i * width];
+        for (int k = 0; k < keyCount; k++) {
+            if (!keyOf(vm, node, ks[k], r[keyCount], &r[k])) return false;
+        }
+    }
+    Order* orders = GC_MALLOC_ATOMIC(sizeof(Order) * keyCount);
+    for (int k = 0; k < keyCount; k++) orders[k] = orderOf(&records[k], count, width);
+    Sorter s = { vm, node, width, keyCount, orders, desc, desc[0] };
+    Order order = keyCount == 1 ? orders[0] : ORDER_KEYS;
+    if (!sortRecords(&s, order, records, count)) return false;
+    Value* values = &vm->stack->values[vm->base];
+    for (int i = 0; i < count; i++) values[i] = records[i * width + keyCount];
+    GC_FREE(records);
+    GC_FREE(orders);
+    GC_FREE(desc);
+    return true;
+}
@@ -0,0 +1,24 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+
+typedef struct sVM VM;
+typedef struct sAstNode AstNode;
+typedef struct sStack Stack;
+
+// Sort count values of stack from begin, in place, in the order of
+// valueCompare (see vm.c), keeping equal values in the order they were in.
+// Groups of only numbers, strings or symbols are compared without going
+// through valueCompare, numbers are radix sorted, and groups long enough
+// without contexts or lists are sorted by the threads pmap runs on (see
+// parallel.h), merging in parallel too. Raises if a _cmp metamethod does.
+bool Sort_values(VM* vm, AstNode* node, Stack* stack, int begin, int count);
+// Sort the current group by the keys of each value, given by keys once per
+// value: a symbol to look up in it, a closure to call on it, or a list of
+// them to compare by in turn. Descending is a bool, or a list of one for
+// each key. Sorted as by Sort_values, keeping values with equal keys in order.
+bool Sort_by(VM* vm, AstNode* node, Value keys, Value descending);
+// Sort the current group by calling fn on pairs of values, to return a number
+// less than, equal to or greater than 0 as the first orders before, with or
+// after the second.
+bool Sort_with(VM* vm, AstNode* node, Value fn);
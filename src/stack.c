@@ -2,34 +2,6 @@
 #include <assert.h>
 #include <gc/gc.h>
 
-// todo: stack pooling is kind of a memory leak, somehow wipe all pooled
-//       values to 0 occasionally? (does libgc allow a pre-gc hook?)
-static Stack* stackPooled;
-
-Stack* Stack_acquire(Stack* previous) {
-    Stack* result;
-    if (stackPooled) {
-        result = stackPooled;
-        stackPooled = result->previous;
-        result->previous = previous;
-        result->next = 0;
-    } else {
-        result = GC_MALLOC(sizeof(Stack));
-        *result = (Stack) { .previous = previous };
-    }
-    return result;
-}
-
-void Stack_release(Stack* stack) {
-    if (stack->capacity > 64) {
-        GC_FREE(stack->values);
-        GC_FREE(stack);
-    } else {
-        stack->previous = stackPooled;
-        stackPooled = stack;
-    }
-}
-
 void Stack_reserve(Stack* stack, int n) {
     int cap = stack->capacity;
     int oldCap = cap;
@@ -63,31 +35,27 @@ int Stack_size(Stack* stack) {
     return stack->next;
 }
 
-void Stack_move(Stack* from, Stack* to, int n) {
-    assert(from->next >= n && n >= 0);
-    if (to->next == 0 && from->next == n) {
-        Value* tmpv = from->values;
-        int tmpc = from->capacity;
-        from->values = to->values;
-        from->capacity = to->capacity;
-        to->values = tmpv;
-        to->capacity = tmpc;
-        to->next = n; from->next = 0;
-    } else {
-        from->next -= n;
-        Stack_reserve(to, n);
-        memcpy(
-            &to->values[to->next],
-            &from->values[from->next], sizeof(Value) * n);
-        to->next += n;
+Stack* Stack_split(Stack* stack, int begin) {
+    assert(begin >= 0 && begin <= stack->next);
+    Stack* result = GC_MALLOC(sizeof(Stack));
+    *result = (Stack) {};
+    int n = stack->next - begin;
+    if (n) {
+        Stack_reserve(result, n);
+        memcpy(result->values, &stack->values[begin], sizeof(Value) * n);
+        result->next = n;
     }
+    stack->next = begin;
+    return result;
 }
 
-void Stack_reverse(Stack* stack) {
-    for (int i = 0; i < stack->next / 2; i++) {
-        int other = stack->next - i - 1;
-        Value tmp = stack->values[i];
-        stack->values[i] = stack->values[other];
-        stack->values[other] = tmp;
+void Stack_reverse(Stack* stack, int begin) {
+    Value* values = &stack->values[begin];
+    int n = stack->next - begin;
+    for (int i = 0; i < n / 2; i++) {
+        int other = n - i - 1;
+        Value tmp = values[i];
+        values[i] = values[other];
+        values[other] = tmp;
     }
 }
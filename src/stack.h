@@ -8,15 +8,14 @@ struct sStack {
     Value* values;
     int next;
     int capacity;
-    Stack* previous;
 };
 
 // Stack* Stack_create(void);
-Stack* Stack_acquire(Stack* previous);
-void Stack_release(Stack* stack);
 void Stack_reserve(Stack* stack, int n);
 void Stack_push(Stack* stack, Value v);
 Value Stack_pop(Stack* stack);
 int Stack_size(Stack* stack);
-void Stack_move(Stack* from, Stack* to, int n);
-void Stack_reverse(Stack* stack);
+// Move the values from index begin onwards into a new stack.
+Stack* Stack_split(Stack* stack, int begin);
+// Reverse the order of the values from index begin onwards.
+void Stack_reverse(Stack* stack, int begin);
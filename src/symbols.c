@@ -1,43 +1,146 @@
 #include "symbols.h"
+#include "parallel.h"
+#include <pthread.h>
 
-static const char** entries;
-static int next;
-static int capacity;
+// Symbols are indices into entries, with an open-addressed hash table
+// (linear probing, power of two capacity) mapping names back to symbols.
+// Index 0 is unused so that 0 can mark empty slots.
+// Symbols may be interned from any thread, so the table is guarded by lock.
+// Names are read without it, so entries is replaced rather than reallocated
+// when it grows, leaving copies other threads may still read intact.
 
-Symbol Symbol_find(const char* symbol, int length) {
-    for (int i = 1; i < next; i++) {
-        const char* entry = entries[i];
-        if (strncmp(symbol, entry + 1, length) == 0 &&
-            entry[length + 1] == 0) {
-            return i;
+typedef struct sSymbolEntry {
+    const char* repr; // name prefixed by '#'
+    u32 length;
+    u32 hash;
+} SymbolEntry;
+
+static SymbolEntry* entries;
+static u32 next;
+static u32 capacity;
+static Symbol* buckets;
+static u32 bucketCapacity;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u32 hashName(const char* name, int length) {
+    // FNV-1a
+    u32 hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (u8) name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void bucketInsert(Symbol s) {
+    u32 mask = bucketCapacity - 1;
+    u32 i = entries[s].hash & mask;
+    while (buckets[i]) i = (i + 1) & mask;
+    buckets[i] = s;
+}
+
+static void bucketRemove(Symbol s) {
+    u32 mask = bucketCapacity - 1;
+    u32 i = entries[s].hash & mask;
+    while (buckets[i] != s) i = (i + 1) & mask;
+    // shift back any following entries which would no longer be reachable
+    u32 j = i;
+    while (1) {
+        j = (j + 1) & mask;
+        if (!buckets[j]) break;
+        u32 home = entries[buckets[j]].hash & mask;
+        bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+        if (movable) {
+            buckets[i] = buckets[j];
+            i = j;
+        }
+    }
+    buckets[i] = 0;
+}
+
+static void bucketGrow(void) {
+    bucketCapacity = bucketCapacity ? bucketCapacity * 2 : 128;
+    buckets = GC_MALLOC_ATOMIC(sizeof(Symbol) * bucketCapacity);
+    memset(buckets, 0, sizeof(Symbol) * bucketCapacity);
+    for (Symbol s = 1; s < next; s++) bucketInsert(s);
+}
+
+static Symbol lookup(const char* symbol, int length) {
+    if (!bucketCapacity) return 0;
+    u32 hash = hashName(symbol, length);
+    u32 mask = bucketCapacity - 1;
+    for (u32 i = hash & mask; buckets[i]; i = (i + 1) & mask) {
+        SymbolEntry* entry = &entries[buckets[i]];
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->repr + 1, symbol, length) == 0) {
+            return buckets[i];
         }
     }
+    return 0;
+}
+
+static void growEntries(void) {
+    SymbolEntry* grown = GC_MALLOC(sizeof(SymbolEntry) * capacity * 2);
+    memcpy(grown, entries, sizeof(SymbolEntry) * capacity);
+    capacity *= 2;
+    __atomic_store_n(&entries, grown, __ATOMIC_RELEASE);
+}
+
+Symbol Symbol_find(const char* symbol, int length) {
+    pthread_mutex_lock(&lock);
+    Symbol s = lookup(symbol, length);
+    if (s) {
+        pthread_mutex_unlock(&lock);
+        return s;
+    }
 
     if (next == capacity) {
         if (capacity == 0) {
-            entries = GC_MALLOC(sizeof(const char**) * 64);
+            entries = GC_MALLOC(sizeof(SymbolEntry) * 64);
             capacity = 64;
             next = 1;
-            entries[0] = "<ZERO>"; // unused
+            entries[0] = (SymbolEntry) { "<ZERO>" }; // unused
         } else {
-            capacity *= 2;
-            entries = GC_REALLOC(entries,
-                sizeof(const char**) * capacity);
+            growEntries();
         }
     }
-    
-    char* repr = GC_MALLOC(length + 2);
+    // keep load factor under 1/2
+    if ((next + 1) * 2 > bucketCapacity) bucketGrow();
+
+    char* repr = GC_MALLOC_ATOMIC(length + 2);
     repr[0] = '#';
     repr[length + 1] = 0;
     memcpy(repr + 1, symbol, length);
-    entries[next] = repr;
-    return next++;
+    s = next++;
+    entries[s] = (SymbolEntry) { repr, length, hashName(symbol, length) };
+    bucketInsert(s);
+    pthread_mutex_unlock(&lock);
+    return s;
+}
+
+Symbol Symbol_mark(void) {
+    pthread_mutex_lock(&lock);
+    Symbol mark = capacity == 0 ? 1 : next;
+    pthread_mutex_unlock(&lock);
+    return mark;
+}
+
+void Symbol_release(Symbol mark) {
+    // other threads may have interned symbols since the mark
+    if (Parallel_threaded()) return;
+    pthread_mutex_lock(&lock);
+    while (next > mark) {
+        next--;
+        bucketRemove(next);
+        entries[next] = (SymbolEntry) {};
+    }
+    pthread_mutex_unlock(&lock);
 }
 
 const char* Symbol_name(Symbol s) {
-    return entries[s] + 1;
+    return __atomic_load_n(&entries, __ATOMIC_ACQUIRE)[s].repr + 1;
 }
 
 const char* Symbol_repr(Symbol s) {
-    return entries[s];
+    return __atomic_load_n(&entries, __ATOMIC_ACQUIRE)[s].repr;
 }
@@ -3,5 +3,12 @@
 
 Symbol Symbol_find(const char* symbol, int length);
 
+// Transient symbols: every symbol interned after Symbol_mark() is discarded
+// by Symbol_release(mark), and its id reused. Only valid when none of those
+// symbols can still be referenced (e.g. the AST of a failed parse). Nothing
+// is released while other threads are evaluating (see parallel.h).
+Symbol Symbol_mark(void);
+void Symbol_release(Symbol mark);
+
 const char* Symbol_name(Symbol s);
 const char* Symbol_repr(Symbol s); // contains hash
@@ -0,0 +1,241 @@
+#include "task.h"
+#include "parallel.h"
+#include "vm.h"
+#include <gc/gc.h>
+#include <pthread.h>
+
+extern bool evalCall(VM* vm, AstNode* caller, Value v, Value* self);
+
+#define DEQUE_INITIAL 32
+
+const char* taskStatusNames[TASK_STATUS_COUNT] = {
+    "pending", "running", "done", "failed"
+};
+
+// Tasks waiting to run, in a ring from the oldest (top) to the newest. The
+// thread owning a deque takes from the bottom, others steal from the top.
+typedef struct sDeque {
+    pthread_mutex_t lock;
+    Task** tasks;
+    int top, count, capacity;
+} Deque;
+
+typedef struct sWorker {
+    VM vm;
+    pthread_t thread;
+} Worker;
+
+static atomic_bool started;
+static pthread_mutex_t startLock = PTHREAD_MUTEX_INITIALIZER;
+static bool pooled; // if there are threads besides those joining
+// one per thread of the pool, the first shared by threads outside it
+static Deque* deques;
+static int dequeCount;
+static Worker* workers; // dequeCount - 1 of them
+static _Thread_local int own; // index of this thread's deque
+static atomic_int queued; // tasks in deques
+static atomic_uint pushed; // tasks ever queued, for joiners to tell of new ones
+static atomic_int live; // tasks spawned but not finished, while pooled
+// workers with nothing to run, and threads joining with nothing to help
+// with, wait on these until something is queued or finishes
+static pthread_mutex_t waitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t taskQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t taskFinished = PTHREAD_COND_INITIALIZER;
+static atomic_int idle, waiting;
+
+static void push(Deque* d, Task* t) {
+    pthread_mutex_lock(&d->lock);
+    if (d->count == d->capacity) {
+        int capacity = d->capacity ? d->capacity * 2 : DEQUE_INITIAL;
+        Task** tasks = GC_MALLOC(sizeof(Task*) * capacity);
+        for (int i = 0; i < d->count; i++) {
+            tasks[i] = d->tasks[(d->top + i) % d->capacity];
+        }
+        d->tasks = tasks;
+        d->top = 0;
+        d->capacity = capacity;
+    }
+    d->tasks[(d->top + d->count++) % d->capacity] = t;
+    atomic_fetch_add(&queued, 1);
+    atomic_fetch_add(&pushed, 1);
+    pthread_mutex_unlock(&d->lock);
+}
+
+// Take the task at the top or bottom of a deque, or if root is not NULL, the
+// one nearest that end spawned by a VM with that root.
+static Task* take(Deque* d, bool steal, Context* root) {
+    Task* t = NULL;
+    pthread_mutex_lock(&d->lock);
+    for (int i = 0; i < d->count && !t; i++) {
+        int from = steal ? i : d->count - 1 - i; // counting from the top
+        Task* candidate = d->tasks[(d->top + from) % d->capacity];
+        if (root && candidate->spawner->root != root) continue;
+        t = candidate;
+        if (from == 0) {
+            d->tasks[d->top] = NULL;
+            d->top = (d->top + 1) % d->capacity;
+        } else {
+            // close the gap, moving those below it up
+            for (int k = from; k < d->count - 1; k++) {
+                Task** slot = &d->tasks[(d->top + k) % d->capacity];
+                *slot = d->tasks[(d->top + k + 1) % d->capacity];
+            }
+            d->tasks[(d->top + d->count - 1) % d->capacity] = NULL;
+        }
+        d->count--;
+        atomic_fetch_sub(&queued, 1);
+    }
+    pthread_mutex_unlock(&d->lock);
+    return t;
+}
+
+// The newest task of this thread's deque, else the oldest of another's, of
+// those spawned under root if not NULL.
+static Task* next(Context* root) {
+    if (!atomic_load(&queued)) return NULL;
+    Task* t = take(&deques[own], false, root);
+    for (int i = 1; !t && i < dequeCount; i++) {
+        t = take(&deques[(own + i) % dequeCount], true, root);
+    }
+    return t;
+}
+
+static void run(VM* vm, Task* t) {
+    atomic_store_explicit(&t->status, TASK_RUNNING, memory_order_relaxed);
+    int oldBase = vm->base, oldScopes = vm->scopes->next;
+    Stack_push(vm->scopes, FROM_NUMBER(oldBase));
+    vm->base = vm->stack->next;
+    bool ok = evalCall(vm, NULL, t->fn, NULL);
+    if (ok) {
+        int n = vm->stack->next - vm->base;
+        Stack_reserve(&t->results, n);
+        memcpy(t->results.values, &vm->stack->values[vm->base], sizeof(Value) * n);
+        t->results.next = n;
+    } else {
+        t->exSymbol = vm->exSymbol;
+        t->exMessage = vm->exMessage;
+        t->exTraceFirst = vm->exTraceFirst;
+        t->exTraceLast = vm->exTraceLast;
+        t->exSourceHasTrace = vm->exSourceHasTrace;
+        // the exception is the joiner's to raise, not this VM's
+        vm->exTraceFirst = vm->exTraceLast = NULL;
+        vm->exSourceHasTrace = false;
+    }
+    vm->stack->next = vm->base;
+    vm->scopes->next = oldScopes;
+    vm->base = oldBase;
+    t->fn = VAL_NIL;
+    atomic_store(&t->status, ok ? TASK_DONE : TASK_FAILED);
+    if (pooled && atomic_fetch_sub(&live, 1) == 1) parallelActive--;
+    if (atomic_load(&waiting)) {
+        pthread_mutex_lock(&waitLock);
+        pthread_cond_broadcast(&taskFinished);
+        pthread_mutex_unlock(&waitLock);
+    }
+}
+
+static void* runWorker(void* arg) {
+    Worker* w = arg;
+    own = w - workers + 1;
+    while (true) {
+        Task* t = next(NULL);
+        if (t) {
+            // spawned by an actor (see actor.h), which has a root of its own
+            if (t->spawner->root != w->vm.root) Parallel_share(&w->vm, t->spawner);
+            run(&w->vm, t);
+            continue;
+        }
+        pthread_mutex_lock(&waitLock);
+        atomic_fetch_add(&idle, 1);
+        while (!atomic_load(&queued)) pthread_cond_wait(&taskQueued, &waitLock);
+        atomic_fetch_sub(&idle, 1);
+        pthread_mutex_unlock(&waitLock);
+    }
+    return NULL;
+}
+
+static void startPool(VM* vm) {
+    pthread_mutex_lock(&startLock);
+    if (!atomic_load(&started)) {
+        dequeCount = Parallel_threads();
+        pooled = dequeCount > 1;
+        deques = GC_MALLOC_UNCOLLECTABLE(sizeof(Deque) * dequeCount);
+        for (int i = 0; i < dequeCount; i++) {
+            pthread_mutex_init(&deques[i].lock, NULL);
+        }
+        // uncollectable, as nothing else refers to the workers' VMs
+        workers = GC_MALLOC_UNCOLLECTABLE(sizeof(Worker) * dequeCount);
+        for (int i = 0; i < dequeCount - 1; i++) {
+            Worker* w = &workers[i];
+            VM_startup(&w->vm);
+            Parallel_share(&w->vm, vm);
+            // without it, its deque is left to be stolen from
+            if (pthread_create(&w->thread, NULL, runWorker, w) != 0) break;
+        }
+        atomic_store(&started, true);
+    }
+    pthread_mutex_unlock(&startLock);
+}
+
+Task* Task_spawn(VM* vm, Value fn) {
+    if (!atomic_load(&started)) startPool(vm);
+    Task* t = GC_MALLOC(sizeof(Task));
+    *t = (Task) { { NATIVE_TASK } };
+    atomic_init(&t->status, TASK_PENDING);
+    t->fn = fn;
+    t->spawner = vm;
+    // set before any other thread could run the task
+    if (pooled && atomic_fetch_add(&live, 1) == 0) parallelActive++;
+    push(&deques[own], t);
+    if (atomic_load(&idle)) {
+        pthread_mutex_lock(&waitLock);
+        pthread_cond_signal(&taskQueued);
+        pthread_mutex_unlock(&waitLock);
+    }
+    return t;
+}
+
+Task* Task_done(Value* values, int count) {
+    Task* t = GC_MALLOC(sizeof(Task));
+    *t = (Task) { { NATIVE_TASK } };
+    atomic_init(&t->status, TASK_DONE);
+    t->fn = VAL_NIL;
+    Stack_reserve(&t->results, count);
+    memcpy(t->results.values, values, sizeof(Value) * count);
+    t->results.next = count;
+    return t;
+}
+
+bool Task_join(VM* vm, Task* task) {
+    while (atomic_load_explicit(&task->status, memory_order_acquire) < TASK_DONE) {
+        unsigned seen = atomic_load(&pushed);
+        // only tasks spawned under this VM's root, as those of another actor
+        // (see actor.h) must not run with this one's root and prototypes
+        Task* t = next(vm->root);
+        if (t) {
+            run(vm, t);
+            continue;
+        }
+        // it is running on another thread
+        pthread_mutex_lock(&waitLock);
+        atomic_fetch_add(&waiting, 1);
+        while (atomic_load(&task->status) < TASK_DONE && atomic_load(&pushed) == seen) {
+            pthread_cond_wait(&taskFinished, &waitLock);
+        }
+        atomic_fetch_sub(&waiting, 1);
+        pthread_mutex_unlock(&waitLock);
+    }
+    if (atomic_load_explicit(&task->status, memory_order_acquire) == TASK_FAILED) {
+        vm->exSymbol = task->exSymbol;
+        vm->exMessage = task->exMessage;
+        vm->exTraceFirst = VM_copyTrace(task->exTraceFirst, &vm->exTraceLast);
+        vm->exSourceHasTrace = task->exSourceHasTrace;
+        return false;
+    }
+    Stack* results = &task->results;
+    Stack_reserve(vm->stack, results->next);
+    memcpy(&vm->stack->values[vm->stack->next], results->values,
+        sizeof(Value) * results->next);
+    vm->stack->next += results->next;
+    return true;
+}
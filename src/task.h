@@ -0,0 +1,48 @@
+#pragma once
+#include "common.h"
+#include "value.h"
+#include "stack.h"
+#include <stdatomic.h>
+
+typedef struct sVM VM;
+typedef struct sExceptionTrace ExceptionTrace;
+typedef struct sTask Task;
+
+// note: keep in sync with taskStatusNames in task.c
+typedef enum {
+    TASK_PENDING, // waiting in a deque
+    TASK_RUNNING,
+    TASK_DONE,
+    TASK_FAILED, // raised an exception
+    TASK_STATUS_COUNT
+} TaskStatus;
+
+// A closure evaluated by a pool of threads, and the future of its results.
+// Each thread of the pool has a VM of its own sharing the root, prototypes
+// and compiled code of the VM which started the pool, as for pmap (see
+// parallel.h), and a deque of tasks: it pushes tasks it spawns and pops them
+// at one end, while threads with none left steal the oldest from the other.
+// Threads joining a task run others spawned under the same root (so not
+// those of another actor) until it finishes.
+struct sTask {
+    Native header;
+    atomic_int status;
+    Value fn;
+    VM* spawner;
+    Stack results; // the group fn finished with, once done
+    // the exception fn raised, once failed
+    Symbol exSymbol;
+    const char* exMessage;
+    ExceptionTrace* exTraceFirst, * exTraceLast;
+    bool exSourceHasTrace;
+};
+
+extern const char* taskStatusNames[TASK_STATUS_COUNT];
+
+// Queue fn to be evaluated in a group of its own on the pool, started if not
+// already. With only one thread, tasks run when joined.
+Task* Task_spawn(VM* vm, Value fn);
+// A task already done, with the given results.
+Task* Task_done(Value* values, int count);
+// Wait for a task to finish, pushing its results, or raising its exception.
+bool Task_join(VM* vm, Task* task);
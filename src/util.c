@@ -1,6 +1,13 @@
 
 #include "common.h"
 #include "value.h"
+#include "actor.h"
+#include "array.h"
+#include "coroutine.h"
+#include "dict.h"
+#include "file.h"
+#include "iter.h"
+#include "task.h"
 #include "vm.h"
 #include "fruity.h"
 #include <gc/gc.h>
@@ -111,6 +118,7 @@ bool fpRequire(VM* vm, const char* sig) {
 extern void raiseUnbound(VM* vm, AstNode* node, Symbol sym);
 extern void raiseUnderflow(VM* vm, AstNode* node, int n);
 extern void raiseType(VM* vm, AstNode* node, Type type);
+extern void raiseNativeType(VM* vm, AstNode* node, NativeKind kind);
 extern void raiseInvalid(VM* vm, AstNode* node, const char* msg);
 extern void raiseInternal(VM* vm, const char* msg);
 
@@ -158,6 +166,13 @@ static bool extractValue(VM* vm, char kind, Value v, void* dst) {
             }
             *(Symbol*) dst = GET_SYMBOL(v);
         } break;
+        case 'b': {
+            if (t != TYPE_ODDBALL || GET_ODDBALL(v) > 1) {
+                raiseInvalid(vm, NULL, "expected bool");
+                return false;
+            }
+            *(bool*) dst = GET_ODDBALL(v) == 0;
+        } break;
         case 'v': {
             *(Value*) dst = v;
         } break;
@@ -180,7 +195,63 @@ static bool extractValue(VM* vm, char kind, Value v, void* dst) {
                 raiseType(vm, NULL, TYPE_BLOB);
                 return false;
             }
-            *(Blob**) dst = v.as_blob;
+            *(Blob**) dst = GET_BLOB(v);
+        } break;
+        case 'D': {
+            if (t != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_DICT) {
+                raiseNativeType(vm, NULL, NATIVE_DICT);
+                return false;
+            }
+            *(Dict**) dst = (Dict*) GET_NATIVE(v);
+        } break;
+        case 'S': {
+            if (t != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_SET) {
+                raiseNativeType(vm, NULL, NATIVE_SET);
+                return false;
+            }
+            *(Dict**) dst = (Dict*) GET_NATIVE(v);
+        } break;
+        case 'A': {
+            if (t != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_ARRAY) {
+                raiseNativeType(vm, NULL, NATIVE_ARRAY);
+                return false;
+            }
+            *(Array**) dst = (Array*) GET_NATIVE(v);
+        } break;
+        case 'I': {
+            if (t != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_ITERATOR) {
+                raiseNativeType(vm, NULL, NATIVE_ITERATOR);
+                return false;
+            }
+            *(Iterator**) dst = (Iterator*) GET_NATIVE(v);
+        } break;
+        case 'C': {
+            if (t != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_COROUTINE) {
+                raiseNativeType(vm, NULL, NATIVE_COROUTINE);
+                return false;
+            }
+            *(Coroutine**) dst = (Coroutine*) GET_NATIVE(v);
+        } break;
+        case 'T': {
+            if (t != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_TASK) {
+                raiseNativeType(vm, NULL, NATIVE_TASK);
+                return false;
+            }
+            *(Task**) dst = (Task*) GET_NATIVE(v);
+        } break;
+        case 'R': {
+            if (t != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_ACTOR) {
+                raiseNativeType(vm, NULL, NATIVE_ACTOR);
+                return false;
+            }
+            *(Actor**) dst = (Actor*) GET_NATIVE(v);
+        } break;
+        case 'F': {
+            if (t != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_FILE) {
+                raiseNativeType(vm, NULL, NATIVE_FILE);
+                return false;
+            }
+            *(File**) dst = (File*) GET_NATIVE(v);
         } break;
         default: {
             assert(0 && "invalid sig char");
@@ -204,24 +275,16 @@ bool fpExtract(VM* vm, const char* sig, ...) {
         } else reqstk++;
     }
     int stkSize = vm->stack->next;
-    if (expands) {
-        if (vm->stack->next < reqstk) {
-            raiseUnderflow(vm, NULL, reqstk);
-            return false;
-        }
-        vm->stack->next = 0;
-    } else {
-        if (vm->stack->next < reqstk) {
-            raiseUnderflow(vm, NULL, reqstk);
-            return false;
-        }
-        vm->stack->next -= reqstk;
+    if (stkSize - vm->base < reqstk) {
+        raiseUnderflow(vm, NULL, reqstk);
+        return false;
     }
+    vm->stack->next = expands ? vm->base : stkSize - reqstk;
 
     va_list args;
     va_start(args, sig);
 
-    int stki = expands ? 0 : stkSize - reqstk;
+    int stki = vm->stack->next;
     for (int i = 0; sig[i]; i++) {
         if (sig[i] == '*') {
             int* count = va_arg(args, int*);
@@ -252,7 +315,7 @@ bool fpExtract(VM* vm, const char* sig, ...) {
             void* dst = va_arg(args, void*);
             Value v = vm->stack->values[stki++];
             i++;
-            if (GET_TYPE(v) == TYPE_ODDBALL && v.as_int == 3) {
+            if (GET_TYPE(v) == TYPE_ODDBALL && GET_ODDBALL(v) == 3) {
                 *isSet = false;
             } else {
                 *isSet = true;
@@ -278,7 +341,7 @@ void fpPush(VM* vm, Value v) {
 }
 
 Value fpPop(VM* vm) {
-    if (vm->stack->next == 0) {
+    if (vm->stack->next == vm->base) {
         assert(0 && "stack underflow");
         exit(-1);
     }
@@ -286,7 +349,7 @@ Value fpPop(VM* vm) {
 }
 
 u32 fpStackSize(VM* vm) {
-    return vm->stack->next;
+    return vm->stack->next - vm->base;
 }
 
 Symbol fpIntern(const char* ident) {
@@ -467,15 +530,15 @@ const char* fpSprintf(const char* fmt, ...) {
     return result;
 }
 
+// lists are built in a group of their own, see openGroup in vm.c
 void fpBeginList(VM* vm) {
-    Stack* old = vm->stack;
-    vm->stack = GC_MALLOC(sizeof(Stack));
-    *vm->stack = (Stack) { .previous = old };
+    Stack_push(vm->scopes, FROM_NUMBER(vm->base));
+    vm->base = vm->stack->next;
 }
 
 void fpEndList(VM* vm) {
-    Stack* list = vm->stack;
-    vm->stack = vm->stack->previous;
+    Stack* list = Stack_split(vm->stack, vm->base);
+    vm->base = GET_NUMBER(Stack_pop(vm->scopes));
     Stack_push(vm->stack, FROM_LIST(list));
 }
 
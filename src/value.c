@@ -3,6 +3,13 @@
 #include "context.h"
 #include "fruity.h"
 #include "stack.h"
+#include "actor.h"
+#include "array.h"
+#include "coroutine.h"
+#include "dict.h"
+#include "file.h"
+#include "iter.h"
+#include "task.h"
 
 #include <stdarg.h>
 
@@ -59,17 +66,20 @@ const char* Value_repr(Value v, int depth) {
         }
         case TYPE_CONTEXT: {
             Context* ctx = GET_CONTEXT(v);
-            if (depth == 0 || ctx->count > 6) {
-                return gc_sprintf(":{<%d keys>}", ctx->count);
+            Shape* shape = ctx->shape;
+            int keyCount = Context_count(ctx);
+            if (depth == 0 || keyCount > 6) {
+                return gc_sprintf(":{<%d keys>}", keyCount);
             } else {
                 int count = 0;
                 int len = 3;
                 const char* keys[6];
                 const char* values[6];
-                for (int i = 0; i < ctx->capacity; i++) {
-                    if (!ctx->keys[i]) continue;
-                    keys[count] = Symbol_name(ctx->keys[i]);
-                    values[count] = Value_repr(ctx->values[i], depth - 1);
+                for (int i = 0; i < shape->capacity; i++) {
+                    Symbol key = Context_keyAt(ctx, i);
+                    if (!key) continue;
+                    keys[count] = Symbol_name(key);
+                    values[count] = Value_repr(ctx->values[shape->slots[i]], depth - 1);
                     len += 2 + strlen(keys[count]) + strlen(values[count]);
                     if (count) len += 1;
                     count++;
@@ -115,12 +125,62 @@ const char* Value_repr(Value v, int depth) {
         }
         case TYPE_BLOB:
             // todo: proper impl
-            return gc_sprintf("blob(<%d bytes>)", v.as_blob->size);
+            return gc_sprintf("blob(<%zu bytes>)", GET_BLOB_SIZE(v));
+        case TYPE_NATIVE: {
+            Native* native = GET_NATIVE(v);
+            switch (native->kind) {
+                case NATIVE_DICT: {
+                    return gc_sprintf("dict(<%d entries>)", ((Dict*) native)->count);
+                }
+                case NATIVE_SET: {
+                    return gc_sprintf("set(<%d values>)", ((Dict*) native)->count);
+                }
+                case NATIVE_RANGE: {
+                    Range* range = (Range*) native;
+                    return gc_sprintf("range(%g to %g)", range->first, range->last);
+                }
+                case NATIVE_ARRAY: {
+                    Array* array = (Array*) native;
+                    return gc_sprintf("array(<%d %s>)", array->length,
+                        arrayTypeNames[array->type]);
+                }
+                case NATIVE_ITERATOR: {
+                    return ((Iterator*) native)->done ? "iterator(<done>)" : "iterator(<...>)";
+                }
+                case NATIVE_COROUTINE: {
+                    return gc_sprintf("coroutine(<%s>)",
+                        coStatusNames[((Coroutine*) native)->status]);
+                }
+                case NATIVE_TASK: {
+                    return gc_sprintf("task(<%s>)",
+                        taskStatusNames[atomic_load(&((Task*) native)->status)]);
+                }
+                case NATIVE_ACTOR: {
+                    return gc_sprintf("actor(<%s>)",
+                        actorStatusNames[atomic_load(&((Actor*) native)->status)]);
+                }
+                case NATIVE_FILE: {
+                    File* file = (File*) native;
+                    return gc_sprintf("file(<%s%s>)", file->path,
+                        file->stream ? "" : ", closed");
+                }
+                default: return "native(<not impl>)";
+            }
+        }
     }
 }
 
-Value Value_makeBlob(int size, const u8* data) {
+Value Value_makeBlob(size_t size, const u8* data) {
     Blob* blob = GC_MALLOC(sizeof(Blob));
     *blob = (Blob) { data, size };
-    return (Value) { TYPE_BLOB, .as_blob = blob };
+    return FROM_BLOB(blob);
 }
+
+#ifdef FP_NAN_BOXING
+const char* Value_alignString(const char* s) {
+    int len = strlen(s);
+    char* copy = GC_MALLOC_ATOMIC(len + 1);
+    memcpy(copy, s, len + 1);
+    return copy;
+}
+#endif
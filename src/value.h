@@ -12,6 +12,7 @@ typedef struct sClosure Closure;
 typedef struct sNativeClosure NativeClosure;
 typedef struct sStack Stack;
 typedef struct sBlob Blob;
+typedef struct sNative Native;
 
 typedef enum {
     TYPE_NUMBER,
@@ -21,9 +22,29 @@ typedef enum {
     TYPE_CONTEXT,
     TYPE_CLOSURE,
     TYPE_LIST,
-    TYPE_BLOB
+    TYPE_BLOB,
+    TYPE_NATIVE // see Native below
 } Type;
 
+#define TYPE_COUNT 9
+
+// Kinds of native values, each with its own type symbol and prototype
+// note: keep in sync with nativeNames in vm.c
+typedef enum {
+    NATIVE_DICT,
+    NATIVE_SET,
+    NATIVE_ARRAY,
+    NATIVE_RANGE,
+    NATIVE_ITERATOR,
+    NATIVE_COROUTINE,
+    NATIVE_TASK,
+    NATIVE_ACTOR,
+    NATIVE_FILE,
+    NATIVE_KIND_COUNT
+} NativeKind;
+
+#ifndef FP_NAN_BOXING
+
 struct sValue {
     Type tag;
     union {
@@ -35,9 +56,61 @@ struct sValue {
         Closure* as_closure;
         Stack* as_list;
         Blob* as_blob;
+        Native* as_native;
     };
 };
 
+#else
+
+// NaN-boxed values (build with NAN_BOXING=1), 8 bytes on 64 bit platforms.
+// Doubles are stored offset by 2^49, so any encoding with the top 15 bits
+// clear is free. Pointers to 8 byte aligned objects are stored as is with
+// their type in the low 3 bits, so that the collector still sees them as
+// (interior) pointers. Blobs and natives are allocated 16 byte aligned and
+// share the blob tag, with bit 3 set for natives. Symbols and oddballs have
+// bit 48 set, their type in bits 32-34 and their payload in the low 32 bits.
+struct sValue {
+    u64 bits;
+};
+
+#define NB_DOUBLE_OFFSET (1ull << 49)
+#define NB_IMMEDIATE (1ull << 48)
+#define NB_CANONICAL_NAN 0x7ff8000000000000ull
+
+static inline Type nbType(Value v) {
+    if (v.bits >= NB_DOUBLE_OFFSET) return TYPE_NUMBER;
+    if (v.bits & NB_IMMEDIATE) return (Type) ((v.bits >> 32) & 7);
+    if ((v.bits & 15) == (8 | TYPE_BLOB)) return TYPE_NATIVE;
+    return (Type) (v.bits & 7);
+}
+
+static inline double nbNumber(Value v) {
+    union { u64 bits; double d; } u = { v.bits - NB_DOUBLE_OFFSET };
+    return u.d;
+}
+
+static inline Value nbFromNumber(double d) {
+    union { double d; u64 bits; } u = { d };
+    // NaN payloads could overflow into the pointer range, keep only the sign
+    if (d != d) u.bits = (u.bits & 1ull << 63) | NB_CANONICAL_NAN;
+    return (Value) { u.bits + NB_DOUBLE_OFFSET };
+}
+
+// Get an 8 byte aligned copy of a string, if it is not aligned already
+const char* Value_alignString(const char* s);
+
+static inline Value nbFromString(const char* s) {
+    if ((uintptr_t) s & 7) s = Value_alignString(s);
+    return (Value) { (uintptr_t) s | TYPE_STRING };
+}
+
+#define NB_POINTER(T, v) ((T*) (uintptr_t) ((v).bits & ~7ull))
+#define NB_FROM_POINTER(type, k) ((Value) { (uintptr_t) (k) | (type) })
+#define NB_FROM_IMMEDIATE(type, k) \
+    ((Value) { NB_IMMEDIATE | (u64) (type) << 32 | (u32) (k) })
+
+#endif
+
 struct sClosure {
     AstNode* node;
     Context* binding;
@@ -52,9 +125,28 @@ struct sNativeClosure {
 
 struct sBlob {
     const u8* data;
-    int size;
+    size_t size;
+    // what data points into if not the start of a collected allocation, as
+    // a blob or array viewing a mapped file (see builtin_mmap), or a blob a
+    // part of which this is (see builtin_blobsub), kept alive while it is
+    const void* owner;
 };
 
+// Header of values implemented in C, such as Dict (see dict.h) and Array
+// (see array.h)
+struct sNative {
+    NativeKind kind;
+};
+
+// The numbers of `first to last`, when passed straight from the to to a map,
+// filter or fold instead of being pushed one by one (see OP_RANGE)
+typedef struct sRange {
+    Native header;
+    double first, last;
+} Range;
+
+#ifndef FP_NAN_BOXING
+
 #define GET_TYPE(v) ((v).tag)
 #define GET_NUMBER(v) ((v).as_number)
 #define GET_SYMBOL(v) ((v).as_symbol)
@@ -63,8 +155,8 @@ struct sBlob {
 #define GET_CONTEXT(v) ((v).as_context)
 #define GET_CLOSURE(v) ((v).as_closure)
 #define GET_LIST(v) ((v).as_list)
-#define GET_BLOB_SIZE(v) ((v).as_blob->size)
-#define GET_BLOB_DATA(v) ((v).as_blob->data)
+#define GET_BLOB(v) ((v).as_blob)
+#define GET_NATIVE(v) ((v).as_native)
 
 #define FROM_NUMBER(k) ((Value) { TYPE_NUMBER, .as_number = (k) })
 #define FROM_SYMBOL(k) ((Value) { TYPE_SYMBOL, .as_symbol = (k) })
@@ -74,12 +166,47 @@ struct sBlob {
 #define FROM_CONTEXT(k) ((Value) { TYPE_CONTEXT, .as_context = (k) })
 #define FROM_CLOSURE(k) ((Value) { TYPE_CLOSURE, .as_closure = (k) })
 #define FROM_LIST(k) ((Value) { TYPE_LIST, .as_list = (k) })
+#define FROM_BLOB(k) ((Value) { TYPE_BLOB, .as_blob = (k) })
+#define FROM_NATIVE(k) ((Value) { TYPE_NATIVE, .as_native = (Native*) (k) })
+
+#else
+
+#define GET_TYPE(v) nbType(v)
+#define GET_NUMBER(v) nbNumber(v)
+#define GET_SYMBOL(v) ((Symbol) (u32) (v).bits)
+#define GET_STRING(v) NB_POINTER(const char, v)
+#define GET_ODDBALL(v) ((int) (u32) (v).bits)
+#define GET_CONTEXT(v) NB_POINTER(Context, v)
+#define GET_CLOSURE(v) NB_POINTER(Closure, v)
+#define GET_LIST(v) NB_POINTER(Stack, v)
+#define GET_BLOB(v) NB_POINTER(Blob, v)
+#define GET_NATIVE(v) ((Native*) (uintptr_t) ((v).bits & ~15ull))
+
+#define FROM_NUMBER(k) nbFromNumber(k)
+#define FROM_SYMBOL(k) NB_FROM_IMMEDIATE(TYPE_SYMBOL, k)
+#define FROM_STRING(k) nbFromString(k)
+#define FROM_BOOL(k) NB_FROM_IMMEDIATE(TYPE_ODDBALL, !(k))
+#define FROM_ODDBALL(k) NB_FROM_IMMEDIATE(TYPE_ODDBALL, k)
+#define FROM_CONTEXT(k) NB_FROM_POINTER(TYPE_CONTEXT, k)
+#define FROM_CLOSURE(k) NB_FROM_POINTER(TYPE_CLOSURE, k)
+#define FROM_LIST(k) NB_FROM_POINTER(TYPE_LIST, k)
+#define FROM_BLOB(k) NB_FROM_POINTER(TYPE_BLOB, k)
+#define FROM_NATIVE(k) NB_FROM_POINTER(8 | TYPE_BLOB, k)
+
+#endif
+
+#define GET_BLOB_SIZE(v) (GET_BLOB(v)->size)
+#define GET_BLOB_DATA(v) (GET_BLOB(v)->data)
+
+#define VAL_TRUE    FROM_ODDBALL(0)
+#define VAL_FALSE   FROM_ODDBALL(1)
+#define VAL_DEFAULT FROM_ODDBALL(2)
+#define VAL_NIL     FROM_ODDBALL(3)
 
-#define VAL_TRUE    ((Value) { TYPE_ODDBALL, .as_int = 0 })
-#define VAL_FALSE   ((Value) { TYPE_ODDBALL, .as_int = 1 })
-#define VAL_DEFAULT ((Value) { TYPE_ODDBALL, .as_int = 2 })
-#define VAL_NIL     ((Value) { TYPE_ODDBALL, .as_int = 3 })
+// internal: a frame slot for a variable that is not bound yet (see context.h)
+#define VAL_UNBOUND FROM_ODDBALL(-1)
+#define IS_UNBOUND(v) (GET_TYPE(v) == TYPE_ODDBALL && GET_ODDBALL(v) == -1)
 
 const char* Value_repr(Value v, int depth);
 
-Value Value_makeBlob(int size, const u8* data);
+Value Value_makeBlob(size_t size, const u8* data);
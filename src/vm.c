@@ -1,6 +1,11 @@
 #include "vm.h"
+#include "array.h"
+#include "compiler.h"
 #include "context.h"
+#include "iter.h"
+#include "parallel.h"
 #include "parser.h"
+#include "profiler.h"
 #include "stack.h"
 #include "value.h"
 #include <math.h>
@@ -13,7 +18,11 @@ typedef enum {
 
 static const char* typeNames[] = {
     "number", "symbol", "string", "oddball",
-    "context", "closure", "list", "blob"
+    "context", "closure", "list", "blob", "native"
+};
+
+static const char* nativeNames[] = {
+    "dict", "set", "array", "range", "iterator", "coroutine", "task", "actor", "file"
 };
 
 // todo: expose via header
@@ -21,20 +30,38 @@ extern const char* gc_sprintf(const char* fmt, ...);
 
 extern Stack* genTraceList(VM* vm);
 
-static bool evalNode(VM* vm, AstNode* node);
-static ResolveStatus chainResolve(VM* vm, AstNode* node,
+static bool execCode(VM* vm, Code* code, bool isBody);
+static ResolveStatus chainResolve(VM* vm, AstNode* node, InlineCache** ic,
     Context** base, AstChainElem** chainElem, Value* self);
+static Value* cachedGetSlow(VM* vm, InlineCache* ic, Context* ctx, Symbol key,
+    Context** holder);
+
+// Look up key from ctx, using the inline cache. Inlined for the commonest hit,
+// on a key of ctx itself, such as a local or a field of a context.
+static inline __attribute__((always_inline)) Value* cachedGet(VM* vm,
+    InlineCache* ic, Context* ctx, Symbol key, Context** holder) {
+    if (!ic->depth && ic->shape == ctx->shape &&
+        !IS_UNBOUND(ctx->values[ic->shapeSlot])) {
+        vm->icHits++;
+        *holder = ctx;
+        return &ctx->values[ic->shapeSlot];
+    }
+    return cachedGetSlow(vm, ic, ctx, key, holder);
+}
+
 Context* getContext(VM* vm, Value v);
 bool evalCall(VM* vm, AstNode* caller, Value v, Value* self);
 static bool applyOperator(VM* vm, AstNode* node, Value lhs, int op);
-static bool isTruthy(Value v);
-static bool evalAndPop(VM* vm, AstNode* node, Value* value);
+bool isTruthy(Value v);
 static bool evalSpecial(VM* vm, AstNode* node, int special, Value sub);
+static bool pushLazyRange(VM* vm, AstNode* node, Value sub);
 
 void raiseUnbound(VM* vm, AstNode* node, Symbol sym);
 void raiseUnbound2(VM* vm, AstNode* node, Symbol sym, Value value);
+void raiseUnboundKey(VM* vm, AstNode* node, Value key, const char* in);
 void raiseUnderflow(VM* vm, AstNode* node, int n);
 void raiseType(VM* vm, AstNode* node, Type type);
+void raiseNativeType(VM* vm, AstNode* node, NativeKind kind);
 void raiseInvalid(VM* vm, AstNode* node, const char* msg);
 void raiseInternal(VM* vm, const char* msg);
 static void traceNode(VM* vm, AstNode* node);
@@ -56,6 +83,11 @@ static const char* exNames[] = {
 void VM_startup(VM* vm) {
     vm->stack = GC_MALLOC(sizeof(Stack));
     *vm->stack = (Stack) {};
+    vm->base = 0;
+    vm->aux = GC_MALLOC(sizeof(Stack));
+    *vm->aux = (Stack) {};
+    vm->scopes = GC_MALLOC(sizeof(Stack));
+    *vm->scopes = (Stack) {};
     vm->root = NULL;
     vm->context = NULL;
     // todo: have these pre-initialized to fixed indices?
@@ -67,9 +99,12 @@ void VM_startup(VM* vm) {
     for (int i = 0; i < 5; i++) {
         vm->symExs[i] = Symbol_find(exNames[i], strlen(exNames[i]));
     }
-    for (int i = 0; i < 8; i++) {
+    for (int i = 0; i < TYPE_COUNT; i++) {
         vm->symTypes[i] = Symbol_find(typeNames[i], strlen(typeNames[i]));
     }
+    for (int i = 0; i < NATIVE_KIND_COUNT; i++) {
+        vm->symNatives[i] = Symbol_find(nativeNames[i], strlen(nativeNames[i]));
+    }
     vm->symKey = Symbol_find("key", 3);
     vm->symValue = Symbol_find("value", 5);
     vm->symMessage = Symbol_find("message", 7);
@@ -77,263 +112,610 @@ void VM_startup(VM* vm) {
     vm->symUApply = Symbol_find("_apply", 6);
     vm->symUCmp = Symbol_find("_cmp", 4);
     vm->symUEq = Symbol_find("_eq", 3);
+    vm->symUHash = Symbol_find("_hash", 5);
     vm->symUJoin = Symbol_find("_join", 5);
+    vm->symUNext = Symbol_find("_next", 5);
     vm->symUWith = Symbol_find("_with", 5);
     vm->modules = NULL;
     vm->moduleCount = 0;
-    for (int i = 0; i < 8; i++) {
-        if (i == TYPE_CONTEXT) continue;
+    for (int i = 0; i < TYPE_COUNT; i++) {
+        if (i == TYPE_CONTEXT || i == TYPE_NATIVE) continue;
         vm->typeProtos[i] = Context_create(NULL);
     }
+    for (int i = 0; i < NATIVE_KIND_COUNT; i++) {
+        vm->nativeProtos[i] = Context_create(NULL);
+    }
     vm->refProto = Context_create(NULL);
     vm->argProto = Context_create(NULL);
     vm->exProto = Context_create(NULL);
+    vm->callSites = NULL;
+    vm->callDepth = 0;
+    vm->callCapacity = 0;
+    vm->coroutine = NULL;
+    vm->coThread = NULL;
+    vm->actor = NULL;
+    memset(vm->spareFrames, 0, sizeof(vm->spareFrames));
+    memset(vm->spareCounts, 0, sizeof(vm->spareCounts));
 }
 
 bool VM_eval(VM* vm, Block* block) {
     if (block->first) {
-        if (!evalNode(vm, block->first)) return false;
+        if (!execCode(vm, fpCodeOf(block->first), false)) return false;
     }
     return true;
 }
 
 bool VM_evalModule(VM* vm, Block* block, Context* ctx) {
-    Stack* oldStack = vm->stack;
+    int oldBase = vm->base;
     Context* oldCtx = vm->context;
-    vm->stack = Stack_acquire(NULL);
+    // modules start with an empty group, with no access to the importer's
+    Stack_push(vm->scopes, FROM_NUMBER(-1));
+    vm->base = vm->stack->next;
     vm->context = ctx;
-    if (block->first) {
-        if (!evalNode(vm, block->first)) return false;
-    }
+    bool result = true;
+    if (block->first) result = execCode(vm, fpCodeOf(block->first), false);
+    vm->scopes->next--;
+    vm->stack->next = vm->base;
+    vm->base = oldBase;
+    if (!result) return false;
     vm->context = oldCtx;
-    Stack_release(vm->stack);
-    vm->stack = oldStack;
     return true;
 }
 
 #define PUSH(x) Stack_push(vm->stack, (x))
 
-static bool evalNode(VM* vm, AstNode* node) {
-    switch (node->kind) {
-        case AST_NUMBER: {
-            PUSH(FROM_NUMBER(node->as_number));
-        } break;
-        case AST_SYMBOL: {
-            PUSH(FROM_SYMBOL(node->as_symbol));
-        } break;
-        case AST_STRING: {
-            PUSH(FROM_STRING(node->as_string));
-        } break;
-        case AST_ODDBALL: {
-            PUSH(FROM_ODDBALL(node->as_int));
-        } break;
-        case AST_CLOSURE: {
+// Groups (and precalls) share vm->stack, each starting at its base. The base
+// of the enclosing group is kept on vm->scopes while one is open, and -1
+// marks the start of a module, whose groups cannot reach past it.
+
+static void openGroup(VM* vm) {
+    Stack_push(vm->scopes, FROM_NUMBER(vm->base));
+    vm->base = vm->stack->next;
+}
+
+// Close the current group, leaving its values to the enclosing group.
+static void closeGroup(VM* vm) {
+    vm->base = GET_NUMBER(Stack_pop(vm->scopes));
+}
+
+// Get the base of the group enclosing the current one, or -1 if none.
+static int outerBase(VM* vm) {
+    for (int i = vm->scopes->next - 1; i >= 0; i--) {
+        Value v = vm->scopes->values[i];
+        if (GET_TYPE(v) == TYPE_NUMBER) return GET_NUMBER(v);
+    }
+    return -1;
+}
+
+// Move the last n values of the enclosing group (which has them) to the end
+// of the current group, by lowering the current group's base.
+static void pullOuter(VM* vm, int n) {
+    Stack* s = vm->stack;
+    int count = s->next - vm->base;
+    vm->base -= n;
+    if (count == 0 || n == 0) return;
+    // rotate the pulled values past the current group's, via the free space
+    Stack_reserve(s, n);
+    Value* values = &s->values[vm->base];
+    memcpy(&values[count + n], values, sizeof(Value) * n);
+    memmove(values, &values[n], sizeof(Value) * count);
+    memcpy(&values[count], &values[count + n], sizeof(Value) * n);
+}
+
+// Close any groups, precalls and objects left open when the instruction at
+// pc failed, innermost first, matching what the tree walker used to leave
+// behind (precall arguments and partial objects remain on the stack).
+static void unwindScopes(VM* vm, Code* code, int pc) {
+    int closed = 0;
+    for (int i = pc - 1; i >= 0; i--) {
+        OpCode op = code->instrs[i].op;
+        switch (op) {
+            case OP_GROUP_END: case OP_PRECALL_END: case OP_OBJECT_END: {
+                closed++;
+            } break;
+            case OP_GROUP_BEGIN: case OP_PRECALL_BEGIN: {
+                if (closed) {
+                    closed--;
+                    break;
+                }
+                // precall arguments are kept, group values dropped
+                if (op == OP_GROUP_BEGIN) vm->stack->next = vm->base;
+                closeGroup(vm);
+            } break;
+            case OP_OBJECT_BEGIN: {
+                if (closed) {
+                    closed--;
+                    break;
+                }
+                Context* obj = vm->context;
+                Context_setParent(obj, NULL);
+                PUSH(FROM_CONTEXT(obj));
+                vm->context = GET_CONTEXT(Stack_pop(vm->scopes));
+            } break;
+            default: break;
+        }
+    }
+}
+
+// Quickening: instructions which have only seen numbers (or a local slot
+// lookup) rewrite themselves into a specialized form with a guard. When the
+// guard fails they revert to the generic form, up to QUICKEN_LIMIT times.
+#define QUICKEN_LIMIT 4
+
+static Value numOperator(int op, double a, double b) {
+    switch (op) {
+        case OPR_ADD: return FROM_NUMBER(a + b);
+        case OPR_SUB: return FROM_NUMBER(a - b);
+        case OPR_MUL: return FROM_NUMBER(a * b);
+        case OPR_DIV: return FROM_NUMBER(a / b);
+        case OPR_POW: return FROM_NUMBER(pow(a, b));
+        case OPR_MOD: return FROM_NUMBER(fmod(a, b));
+        case OPR_EQ: return FROM_BOOL(a == b);
+        case OPR_NEQ: return FROM_BOOL(a != b);
+        case OPR_LT: return FROM_BOOL(a < b);
+        case OPR_GT: return FROM_BOOL(a > b);
+        case OPR_LTEQ: return FROM_BOOL(!(a > b));
+        case OPR_GTEQ: return FROM_BOOL(!(a < b));
+        default: assert(0 && "not a numeric operator");
+    }
+}
+
+// Specialize an operator instruction about to be applied to two numbers.
+static void quickenOperator(VM* vm, Code* code, Instr* ip) {
+    static const u16 numOps[] = {
+        [OPR_ADD] = OP_ADD_NUM, [OPR_SUB] = OP_SUB_NUM,
+        [OPR_MUL] = OP_MUL_NUM, [OPR_DIV] = OP_DIV_NUM,
+        [OPR_POW] = OP_POW_NUM, [OPR_MOD] = OP_MOD_NUM,
+        [OPR_EQ] = OP_EQ_NUM, [OPR_NEQ] = OP_NEQ_NUM,
+        [OPR_LT] = OP_LT_NUM, [OPR_GT] = OP_GT_NUM,
+        [OPR_LTEQ] = OP_LTEQ_NUM, [OPR_GTEQ] = OP_GTEQ_NUM,
+        [OPR_CMP] = 0
+    };
+    u16 op = numOps[ip->arg];
+    if (!op) return;
+    bool isCompare = op >= OP_EQ_NUM;
+    if (isCompare && (ip[1].op == OP_BRANCH || ip[1].op == OP_LOOP_EXIT)) {
+        op += OP_EQ_NUM_BRANCH - OP_EQ_NUM;
+    }
+    ip->op = op;
+
+    // the rhs is a single local or constant, fuse the whole operation
+    if (ip - code->instrs < 2) return;
+    Instr* stash = ip - 2, * rhs = ip - 1;
+    if (stash->op != OP_STASH || stash->deopts >= QUICKEN_LIMIT) return;
+    if (rhs->op == OP_CONST) {
+        stash->op = OP_NUM_CONST;
+    } else if (rhs->op == OP_GETV_SLOT) {
+        stash->op = OP_NUM_LOCAL;
+    }
+}
+
+// Bind key, known to be at slot in ctx's shape.
+static void bindSlot(Context* ctx, int slot, Symbol key, Value v) {
+    // filling an unbound slot may need to invalidate caches
+    if (ctx->cached && IS_UNBOUND(ctx->values[slot])) {
+        Context_bind(ctx, key, v);
+    } else {
+        ctx->values[slot] = v;
+    }
+}
+
+#define SPARE_FRAME_LIMIT 32 // of each size
+
+// Create a frame as Context_createFrame does, reusing a spare one if any.
+static Context* createFrame(VM* vm, Context* parent, Shape* layout) {
+    int size = layout->count;
+    Context* ctx = size < SPARE_FRAME_SIZES ? vm->spareFrames[size] : NULL;
+    if (!ctx) return Context_createFrame(parent, layout);
+    vm->spareFrames[size] = ctx->parent;
+    vm->spareCounts[size]--;
+    // its values were unbound once released
+    *ctx = (Context) { .shape = layout, .values = (Value*) &ctx[1],
+        .parent = parent, .capacity = size };
+    return ctx;
+}
+
+// Keep the frame of a call which has returned to be reused by the next call
+// needing one of its size, unless it escaped (a closure, object, coroutine or
+// this refers to it) or outgrew its layout. Most calls then allocate nothing
+// for their frame, since their body creates no closures.
+static void releaseFrame(VM* vm, Context* ctx) {
+    int size = ctx->capacity;
+    if (ctx->escaped || ctx->values != (Value*) &ctx[1] ||
+        size >= SPARE_FRAME_SIZES || vm->spareCounts[size] == SPARE_FRAME_LIMIT) {
+        return;
+    }
+    // (so as not to keep what it referred to alive)
+    for (int i = 0; i < size; i++) ctx->values[i] = VAL_UNBOUND;
+    ctx->parent = vm->spareFrames[size];
+    vm->spareFrames[size] = ctx;
+    vm->spareCounts[size]++;
+}
+
+// Create the frame for a call to closure as the current context, and get the
+// code of its body (NULL if empty).
+static Code* enterClosure(VM* vm, Closure* closure, Value* self) {
+    Code* code = closure->node ? fpCodeOf(closure->node) : NULL;
+    if (code && code->frameShape) {
+        // self is always slot 0 (see fpResolveScopes)
+        vm->context = createFrame(vm, closure->binding, code->frameShape);
+        if (self) vm->context->values[0] = *self;
+    } else {
+        vm->context = Context_create(closure->binding);
+        if (self) Context_bind(vm->context, vm->symSelf, *self);
+    }
+    return code;
+}
+
+// Return to the context execCode was entered with, releasing the frame of the
+// last callee a tail call replaced the body with, if any. The frame of the
+// entry call is released by evalCall.
+static inline void leaveFrame(VM* vm, Context* entryCtx) {
+    if (vm->context != entryCtx) releaseFrame(vm, vm->context);
+    vm->context = entryCtx;
+}
+
+// Whether a call at ip is the last thing its body does, so that the body's
+// frame is no longer needed once the callee is entered.
+static inline bool isTailCall(Code* code, Instr* ip) {
+    Instr* next = ip + 1;
+    while (next->op == OP_JUMP) next = &code->instrs[next->arg];
+    return next->op == OP_RETURN;
+}
+
+// Run code, either a closure body (isBody) or the top level of a block.
+static bool execCode(VM* vm, Code* code, bool isBody) {
+    Instr* ip = code->instrs;
+    Stack* aux = vm->aux;
+    int auxBase = aux->next;
+    int scopesBase = vm->scopes->next;
+    Context* entryCtx = vm->context;
+    // a call in tail position of a body replaces it with the callee's,
+    // keeping the C stack and the aux/scopes stacks flat (see tailCall)
+    Value callee, calleeSelf;
+    bool calleeHasSelf;
+    AstNode* tailCaller = NULL;
+    #define CAN_TAIL_CALL() (isBody && isTailCall(code, ip) && \
+        aux->next == auxBase && vm->scopes->next == scopesBase && !vm->tracer)
+
+#ifdef __GNUC__
+    static void* dispatchTable[OP_COUNT] = {
+        [OP_CONST] = &&L_OP_CONST,
+        [OP_CLOSURE] = &&L_OP_CLOSURE,
+        [OP_OBJECT_BEGIN] = &&L_OP_OBJECT_BEGIN,
+        [OP_OBJECT_END] = &&L_OP_OBJECT_END,
+        [OP_CALLV] = &&L_OP_CALLV,
+        [OP_GETV] = &&L_OP_GETV,
+        [OP_SETV] = &&L_OP_SETV,
+        [OP_BINDV] = &&L_OP_BINDV,
+        [OP_HASV] = &&L_OP_HASV,
+        [OP_REFV] = &&L_OP_REFV,
+        [OP_PREBIND] = &&L_OP_PREBIND,
+        [OP_PREBIND_BEGIN] = &&L_OP_PREBIND_BEGIN,
+        [OP_PREBIND_END] = &&L_OP_PREBIND_END,
+        [OP_PRECALL_BEGIN] = &&L_OP_PRECALL_BEGIN,
+        [OP_PRECALL_END] = &&L_OP_PRECALL_END,
+        [OP_RESOLVE] = &&L_OP_RESOLVE,
+        [OP_CALL_RESOLVED] = &&L_OP_CALL_RESOLVED,
+        [OP_GROUP_BEGIN] = &&L_OP_GROUP_BEGIN,
+        [OP_GROUP_END] = &&L_OP_GROUP_END,
+        [OP_STASH] = &&L_OP_STASH,
+        [OP_OPERATOR] = &&L_OP_OPERATOR,
+        [OP_ARGUMENT] = &&L_OP_ARGUMENT,
+        [OP_DOTS] = &&L_OP_DOTS,
+        [OP_THEN_ELSE] = &&L_OP_THEN_ELSE,
+        [OP_UNTIL_DO] = &&L_OP_UNTIL_DO,
+        [OP_BRANCH] = &&L_OP_BRANCH,
+        [OP_LOOP_EXIT] = &&L_OP_LOOP_EXIT,
+        [OP_JUMP] = &&L_OP_JUMP,
+        [OP_APPLY] = &&L_OP_APPLY,
+        [OP_AND] = &&L_OP_AND,
+        [OP_OR] = &&L_OP_OR,
+        [OP_SPECIAL] = &&L_OP_SPECIAL,
+        [OP_RANGE] = &&L_OP_RANGE,
+        [OP_IMPORT] = &&L_OP_IMPORT,
+        [OP_THIS] = &&L_OP_THIS,
+        [OP_SIGBIND] = &&L_OP_SIGBIND,
+        [OP_RETURN] = &&L_OP_RETURN,
+        [OP_GETV_SLOT] = &&L_OP_GETV_SLOT,
+        [OP_ADD_NUM] = &&L_OP_ADD_NUM,
+        [OP_SUB_NUM] = &&L_OP_SUB_NUM,
+        [OP_MUL_NUM] = &&L_OP_MUL_NUM,
+        [OP_DIV_NUM] = &&L_OP_DIV_NUM,
+        [OP_POW_NUM] = &&L_OP_POW_NUM,
+        [OP_MOD_NUM] = &&L_OP_MOD_NUM,
+        [OP_EQ_NUM] = &&L_OP_EQ_NUM,
+        [OP_NEQ_NUM] = &&L_OP_NEQ_NUM,
+        [OP_LT_NUM] = &&L_OP_LT_NUM,
+        [OP_GT_NUM] = &&L_OP_GT_NUM,
+        [OP_LTEQ_NUM] = &&L_OP_LTEQ_NUM,
+        [OP_GTEQ_NUM] = &&L_OP_GTEQ_NUM,
+        [OP_EQ_NUM_BRANCH] = &&L_OP_EQ_NUM_BRANCH,
+        [OP_NEQ_NUM_BRANCH] = &&L_OP_NEQ_NUM_BRANCH,
+        [OP_LT_NUM_BRANCH] = &&L_OP_LT_NUM_BRANCH,
+        [OP_GT_NUM_BRANCH] = &&L_OP_GT_NUM_BRANCH,
+        [OP_LTEQ_NUM_BRANCH] = &&L_OP_LTEQ_NUM_BRANCH,
+        [OP_GTEQ_NUM_BRANCH] = &&L_OP_GTEQ_NUM_BRANCH,
+        [OP_NUM_LOCAL] = &&L_OP_NUM_LOCAL,
+        [OP_NUM_CONST] = &&L_OP_NUM_CONST
+    };
+    #define TARGET(op) case op: L_##op
+    #define DISPATCH() goto *dispatchTable[ip->op]
+#else
+    #define TARGET(op) case op
+    #define DISPATCH() goto dispatch
+    dispatch:
+#endif
+    #define NEXT() do { ip++; DISPATCH(); } while (0)
+    #define JUMP(target) do { ip = &code->instrs[target]; DISPATCH(); } while (0)
+
+    switch (ip->op) {
+        TARGET(OP_CONST): {
+            PUSH(code->consts[ip->arg]);
+        } NEXT();
+        TARGET(OP_CLOSURE): {
+            Context_escape(vm->context);
             Closure* closure = GC_MALLOC(sizeof(Closure));
-            *closure = (Closure) { node->sub, vm->context };
+            *closure = (Closure) { ip->node->sub, vm->context };
             PUSH(FROM_CLOSURE(closure));
-        } break;
-        case AST_OBJECT: {
-            Context* oldCtx = vm->context;
-            vm->context = Context_create(vm->context);
-            bool result = true;
-            if (node->sub) result = evalNode(vm, node->sub);
+        } NEXT();
+        TARGET(OP_OBJECT_BEGIN): {
+            Context_escape(vm->context);
+            Stack_push(vm->scopes, FROM_CONTEXT(vm->context));
+            vm->context = Context_createSized(vm->context, ip->arg);
+        } NEXT();
+        TARGET(OP_OBJECT_END): {
             if (vm->context->lock) {
-                raiseInvalid(vm, node, "context locked");
-                return false;
+                raiseInvalid(vm, ip->node, "context locked");
+                goto fail;
             }
-            vm->context->parent = NULL;
+            Context_setParent(vm->context, NULL);
+            // later objects from this site likely end up with the same shape
+            if (!parallelActive) code->instrs[ip->arg].arg = vm->context->shape->count;
             PUSH(FROM_CONTEXT(vm->context));
-            vm->context = oldCtx;
-            if (!result) return false;
-        } break;
-        case AST_CALLV: {
+            vm->context = GET_CONTEXT(Stack_pop(vm->scopes));
+        } NEXT();
+        TARGET(OP_CALLV): {
+            AstNode* node = ip->node;
             Context* base = vm->context;
             AstChainElem* chainElem = node->as_chain;
+            InlineCache* ic = &code->caches[ip->arg];
             Value self;
-            ResolveStatus rs = chainResolve(vm, node, &base, &chainElem, &self);
-            if (!rs) return false;
-            Value* pv = Context_get(base, chainElem->symbol);
+            ResolveStatus rs = chainResolve(vm, node, &ic, &base, &chainElem, &self);
+            if (!rs) goto fail;
+            Context* holder;
+            Value* pv = cachedGet(vm, ic, base, chainElem->symbol, &holder);
             if (!pv) {
                 raiseUnbound(vm, node, chainElem->symbol);
-                return false;
+                goto fail;
+            }
+            if (CAN_TAIL_CALL()) {
+                callee = *pv;
+                calleeSelf = self;
+                calleeHasSelf = rs == RESOLVE_SELF;
+                goto tailCall;
             }
             if (!evalCall(vm, node, *pv, rs == RESOLVE_SELF ? &self : NULL)) {
-                return false;
+                goto fail;
             }
-        } break;
-        case AST_GETV: {
+        } NEXT();
+        TARGET(OP_GETV): genericGetv: {
+            AstNode* node = ip->node;
             Context* base = vm->context;
             AstChainElem* chainElem = node->as_chain;
-            if (!chainResolve(vm, node, &base, &chainElem, NULL)) return false;
-            Value* pv = Context_get(base, chainElem->symbol);
+            InlineCache* ic = &code->caches[ip->arg];
+            if (!chainResolve(vm, node, &ic, &base, &chainElem, NULL)) goto fail;
+            Context* holder;
+            Value* pv = cachedGet(vm, ic, base, chainElem->symbol, &holder);
             if (!pv) {
                 raiseUnbound(vm, node, chainElem->symbol);
-                return false;
+                goto fail;
             }
             PUSH(*pv);
-        } break;
-        case AST_SETV: {
+            if (!chainElem->next && ic->shape == vm->context->shape &&
+                !ic->depth && ip->deopts < QUICKEN_LIMIT && !parallelActive) {
+                ip->op = OP_GETV_SLOT;
+            }
+        } NEXT();
+        TARGET(OP_SETV): {
+            AstNode* node = ip->node;
             Context* base = vm->context;
             AstChainElem* chainElem = node->as_chain;
-            if (!chainResolve(vm, node, &base, &chainElem, NULL)) return false;
-            if (vm->stack->next == 0) {
+            InlineCache* ic = &code->caches[ip->arg];
+            if (!chainResolve(vm, node, &ic, &base, &chainElem, NULL)) goto fail;
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
-                return false;
+                goto fail;
             }
             Value v = Stack_pop(vm->stack);
-            SetResult sr = Context_set(base, chainElem->symbol, v);
-            if (sr == SET_UNBOUND) {
+            Context* holder;
+            Value* pv = cachedGet(vm, ic, base, chainElem->symbol, &holder);
+            if (!pv) {
                 raiseUnbound(vm, node, chainElem->symbol);
-                return false;
-            } else if (sr == SET_LOCKED) {
+                goto fail;
+            } else if (holder->lock) {
                 raiseInvalid(vm, node, "context locked");
-                return false;
+                goto fail;
             }
-        } break;
-        case AST_BINDV: {
+            *pv = v;
+        } NEXT();
+        TARGET(OP_BINDV): {
+            AstNode* node = ip->node;
             Context* base = vm->context;
             AstChainElem* chainElem = node->as_chain;
-            if (!chainResolve(vm, node, &base, &chainElem, NULL)) return false;
-            if (vm->stack->next == 0) {
+            InlineCache* ic = &code->caches[ip->arg];
+            if (!chainResolve(vm, node, &ic, &base, &chainElem, NULL)) goto fail;
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
-                return false;
+                goto fail;
             } else if (base->lock) {
                 raiseInvalid(vm, node, "context locked");
-                return false;
+                goto fail;
             }
             Value v = Stack_pop(vm->stack);
-            Context_bind(base, chainElem->symbol, v);
-        } break;
-        case AST_HASV: {
+            if (base->shape == ic->shape && !ic->depth) {
+                bindSlot(base, ic->shapeSlot, chainElem->symbol, v);
+            } else {
+                Context_bind(base, chainElem->symbol, v);
+            }
+        } NEXT();
+        TARGET(OP_HASV): {
+            AstNode* node = ip->node;
             Context* base = vm->context;
             AstChainElem* chainElem = node->as_chain;
-            if (!chainResolve(vm, node, &base, &chainElem, NULL)) return false;
-            Value* pv = Context_get(base, chainElem->symbol);
+            InlineCache* ic = &code->caches[ip->arg];
+            if (!chainResolve(vm, node, &ic, &base, &chainElem, NULL)) goto fail;
+            Context* holder;
+            Value* pv = cachedGet(vm, ic, base, chainElem->symbol, &holder);
             PUSH(pv ? VAL_TRUE : VAL_FALSE);
-        } break;
-        case AST_REFV: {
+        } NEXT();
+        TARGET(OP_REFV): {
+            AstNode* node = ip->node;
             Context* base = vm->context;
             AstChainElem* chainElem = node->as_chain;
+            InlineCache* ic = &code->caches[ip->arg];
             Value self;
-            ResolveStatus rs = chainResolve(vm, node, &base, &chainElem, &self);
-            if (!rs) return false;
+            ResolveStatus rs = chainResolve(vm, node, &ic, &base, &chainElem, &self);
+            if (!rs) goto fail;
+            if (rs != RESOLVE_SELF) Context_escape(vm->context);
             Context* ref = Context_create(vm->refProto);
             // todo: should we just use the self that was resolved? or go up
             // parent chain to find context where already bound if possible?
             Context_bind(ref, vm->symSelf, rs == RESOLVE_SELF ? self : FROM_CONTEXT(vm->context));
             Context_bind(ref, vm->symKey, FROM_SYMBOL(chainElem->symbol));
-            Stack_push(vm->stack, FROM_CONTEXT(ref));
-        } break;
-        case AST_PREBIND: {
-            Context* base = vm->context;
-            AstChainElem* chainElem = node->as_chain;
-            if (!chainResolve(vm, node, &base, &chainElem, NULL)) return false;
-            if (base->lock) {
+            PUSH(FROM_CONTEXT(ref));
+        } NEXT();
+        TARGET(OP_PREBIND): {
+            AstNode* node = ip->node;
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, node->sub, 1);
+                goto fail;
+            } else if (vm->context->lock) {
                 raiseInvalid(vm, node, "context locked");
-                return false;
+                goto fail;
             }
-            // todo: evalAndPop?
-            Value v;
-            if (!evalAndPop(vm, node->sub, &v)) {
-                return false;
+            Value v = Stack_pop(vm->stack);
+            if (ip->arg >= 0 && vm->context->shape == code->frameShape) {
+                bindSlot(vm->context, ip->arg, node->as_chain->symbol, v);
+            } else {
+                Context_bind(vm->context, node->as_chain->symbol, v);
             }
-            Context_bind(base, chainElem->symbol, v);
-        } break;
-        case AST_PRECALL: {
+        } NEXT();
+        TARGET(OP_PREBIND_BEGIN): {
+            AstNode* node = ip->node;
             Context* base = vm->context;
             AstChainElem* chainElem = node->as_chain;
-            Value self;
-            ResolveStatus rs = chainResolve(vm, node, &base, &chainElem, &self);
-            if (!rs) return false;
-            Value* pv = Context_get(base, chainElem->symbol);
-            if (!pv) {
-                raiseUnbound(vm, node, chainElem->symbol);
-                return false;
+            InlineCache* ic = &code->caches[ip->arg];
+            if (!chainResolve(vm, node, &ic, &base, &chainElem, NULL)) goto fail;
+            if (base->lock) {
+                raiseInvalid(vm, node, "context locked");
+                goto fail;
             }
-            Stack* oldStk = vm->stack;
-            vm->stack = Stack_acquire(oldStk);
-            if (node->sub && !evalNode(vm, node->sub)) {
-                Stack_move(vm->stack, oldStk, vm->stack->next);
-                vm->stack = oldStk;
-                return false;
+            Stack_push(aux, FROM_CONTEXT(base));
+        } NEXT();
+        TARGET(OP_PREBIND_END): {
+            AstNode* node = ip->node;
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, node->sub, 1);
+                goto fail;
             }
-            bool result = evalCall(vm, node, *pv, rs == RESOLVE_SELF ? &self : NULL);
-            Stack_move(vm->stack, oldStk, vm->stack->next);
-            Stack_release(vm->stack);
-            vm->stack = oldStk;
-            if (!result) return false;
-        } break;
-        case AST_PRECALL_BARE: {
+            AstChainElem* chainElem = node->as_chain;
+            while (chainElem->next) chainElem = chainElem->next;
+            Value v = Stack_pop(vm->stack);
+            Context_bind(GET_CONTEXT(Stack_pop(aux)), chainElem->symbol, v);
+        } NEXT();
+        TARGET(OP_PRECALL_BEGIN):
+        TARGET(OP_RESOLVE): {
+            AstNode* node = ip->node;
             Context* base = vm->context;
             AstChainElem* chainElem = node->as_chain;
+            InlineCache* ic = &code->caches[ip->arg];
             Value self;
-            ResolveStatus rs = chainResolve(vm, node, &base, &chainElem, &self);
-            if (!rs) return false;
-            Value* pv = Context_get(base, chainElem->symbol);
+            ResolveStatus rs = chainResolve(vm, node, &ic, &base, &chainElem, &self);
+            if (!rs) goto fail;
+            Context* holder;
+            Value* pv = cachedGet(vm, ic, base, chainElem->symbol, &holder);
             if (!pv) {
                 raiseUnbound(vm, node, chainElem->symbol);
-                return false;
-            }
-            if (!evalNode(vm, node->sub)) {
-                return false;
-            }
-            if (!evalCall(vm, node, *pv, rs == RESOLVE_SELF ? &self : NULL)) {
-                return false;
-            }
-        } break;
-        case AST_OPERATOR: {
-            if (vm->stack->next == 0) {
-                raiseUnderflow(vm, node, 1);
-                return false;
-            }
-            Value lhs = Stack_pop(vm->stack);
-            // todo: eval and pop rhs?
-            //       may be faster for builtin ops?
-            if (!evalNode(vm, node->sub)) {
-                return false;
-            }
-            if (!applyOperator(vm, node, lhs, node->as_int)) {
-                return false;
+                goto fail;
+            }
+            Stack_push(aux, *pv);
+            if (rs == RESOLVE_SELF) Stack_push(aux, self);
+            if (ip->op == OP_PRECALL_BEGIN) openGroup(vm);
+        } NEXT();
+        TARGET(OP_PRECALL_END):
+        TARGET(OP_CALL_RESOLVED): {
+            AstNode* node = ip->node;
+            bool hasSelf = node->as_chain->next != NULL;
+            Value self;
+            if (hasSelf) self = Stack_pop(aux);
+            Value fn = Stack_pop(aux);
+            if (ip->op == OP_CALL_RESOLVED && CAN_TAIL_CALL()) {
+                callee = fn;
+                calleeSelf = self;
+                calleeHasSelf = hasSelf;
+                goto tailCall;
+            }
+            if (!evalCall(vm, node, fn, hasSelf ? &self : NULL)) goto fail;
+            if (ip->op == OP_PRECALL_END) goto closeScope;
+        } NEXT();
+        TARGET(OP_GROUP_BEGIN): {
+            openGroup(vm);
+        } NEXT();
+        TARGET(OP_GROUP_END): closeScope: {
+            closeGroup(vm);
+        } NEXT();
+        TARGET(OP_STASH): genericStash: {
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, ip->node, 1);
+                goto fail;
+            }
+            Stack_push(aux, Stack_pop(vm->stack));
+        } NEXT();
+        TARGET(OP_OPERATOR): genericOperator: {
+            Value lhs = Stack_pop(aux);
+            if (GET_TYPE(lhs) == TYPE_NUMBER && vm->stack->next > vm->base &&
+                GET_TYPE(vm->stack->values[vm->stack->next - 1]) == TYPE_NUMBER &&
+                ip->deopts < QUICKEN_LIMIT && !parallelActive) {
+                quickenOperator(vm, code, ip);
+            }
+            if (!applyOperator(vm, ip->node, lhs, ip->arg)) goto fail;
+        } NEXT();
+        TARGET(OP_ARGUMENT): {
+            AstNode* node = ip->node;
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, node->sub, 1);
+                goto fail;
             }
-        } break;
-        case AST_ARGUMENT: {
-            Value v;
-            if (!evalAndPop(vm, node->sub, &v)) return false;
+            Value v = Stack_pop(vm->stack);
             Context* ref = Context_create(vm->argProto);
             Context_bind(ref, vm->symKey, FROM_SYMBOL(node->as_symbol));
             Context_bind(ref, vm->symValue, v);
-            Stack_push(vm->stack, FROM_CONTEXT(ref));
-        } break;
-        case AST_GROUP: {
-            if (!node->sub) break;
-            Stack* old = vm->stack;
-            vm->stack = Stack_acquire(old);
-            bool result = evalNode(vm, node->sub);
-            if (result) Stack_move(vm->stack, old, vm->stack->next);
-            Stack_release(vm->stack);
-            vm->stack = old;
-            if (!result) return false;
-        } break;
-        case AST_DOTS: {
-            if (!vm->stack->previous) {
-                raiseUnderflow(vm, node, -1);
-                return false;
-            } else if (Stack_size(vm->stack->previous) < node->as_int) {
-                raiseUnderflow(vm, node, 1);
-                return false;
-            }
-            Stack_move(vm->stack->previous, vm->stack, node->as_int);
-        } break;
-        case AST_THEN_ELSE: {
-            if (vm->stack->next == 0) {
-                raiseUnderflow(vm, node, 1);
-                return false;
-            }
-            Value cond = Stack_pop(vm->stack);
+            PUSH(FROM_CONTEXT(ref));
+        } NEXT();
+        TARGET(OP_DOTS): {
+            int outer = outerBase(vm);
+            if (outer < 0) {
+                raiseUnderflow(vm, ip->node, -1);
+                goto fail;
+            } else if (vm->base - outer < ip->arg) {
+                raiseUnderflow(vm, ip->node, 1);
+                goto fail;
+            }
+            pullOuter(vm, ip->arg);
+        } NEXT();
+        TARGET(OP_THEN_ELSE): {
+            AstNode* node = ip->node;
             Value caseTrue, caseFalse;
-            if ((node->sub && !evalAndPop(vm, node->sub, &caseTrue)) ||
-                (node->as_node && !evalAndPop(vm, node->as_node, &caseFalse))) {
-                return false;
+            if (node->as_node) caseFalse = Stack_pop(aux);
+            if (node->sub) caseTrue = Stack_pop(aux);
+            Value cond = Stack_pop(aux);
+            if (CAN_TAIL_CALL()) {
+                bool taken = isTruthy(cond);
+                if (taken ? !node->sub : !node->as_node) NEXT();
+                callee = taken ? caseTrue : caseFalse;
+                calleeHasSelf = false;
+                goto tailCall;
             }
             if (isTruthy(cond)) {
                 // todo: should we pass node->sub/node->as_node for the caller node?
@@ -342,54 +724,107 @@ static bool evalNode(VM* vm, AstNode* node) {
                 // alternatively, could then/until nodes have their range expanded
                 // to include subs also? then would highlight whole region
                 if (node->sub && !evalCall(vm, node, caseTrue, NULL)) {
-                    return false;
+                    goto fail;
                 }
             } else {
                 if (node->as_node && !evalCall(vm, node, caseFalse, NULL)) {
-                    return false;
+                    goto fail;
                 }
             }
-        } break;
-        case AST_UNTIL_DO: {
+        } NEXT();
+        TARGET(OP_UNTIL_DO): {
+            AstNode* node = ip->node;
             Value caseUntil, caseDo;
-            if ((node->sub && !evalAndPop(vm, node->sub, &caseUntil)) ||
-                (node->as_node && !evalAndPop(vm, node->as_node, &caseDo))) {
-                return false;
-            }
+            if (node->as_node) caseDo = Stack_pop(aux);
+            if (node->sub) caseUntil = Stack_pop(aux);
             while (1) {
                 // eval until part (if true break)
                 if (node->sub) {
-                    if (node->sub && !evalCall(vm, node, caseUntil, NULL)) {
-                        return false;
-                    }
-                    if (vm->stack->next == 0) {
+                    if (!evalCall(vm, node, caseUntil, NULL)) goto fail;
+                    if (vm->stack->next == vm->base) {
                         raiseUnderflow(vm, node, 1);
-                        return false;
+                        goto fail;
                     }
                     Value cond = Stack_pop(vm->stack);
                     if (isTruthy(cond)) break;
                 }
                 // eval do part
                 if (node->as_node && !evalCall(vm, node, caseDo, NULL)) {
-                    return false;
+                    goto fail;
                 }
             }
-        } break;
-        case AST_SPECIAL: {
-            Value sub;
-            if (!evalAndPop(vm, node->sub, &sub)) return false;
-            if (!evalSpecial(vm, node, node->as_int, sub)) return false;
-        } break;
-        case AST_IMPORT: {
+        } NEXT();
+        TARGET(OP_BRANCH): {
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, ip->node, 1);
+                goto fail;
+            }
+            if (!isTruthy(Stack_pop(vm->stack))) JUMP(ip->arg);
+        } NEXT();
+        TARGET(OP_LOOP_EXIT): {
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, ip->node, 1);
+                goto fail;
+            }
+            if (isTruthy(Stack_pop(vm->stack))) JUMP(ip->arg);
+        } NEXT();
+        TARGET(OP_JUMP): {
+            JUMP(ip->arg);
+        }
+        TARGET(OP_APPLY): {
+            Value v = Stack_pop(vm->stack);
+            if (CAN_TAIL_CALL()) {
+                callee = v;
+                calleeHasSelf = false;
+                goto tailCall;
+            }
+            if (!evalCall(vm, ip->node, v, NULL)) goto fail;
+        } NEXT();
+        TARGET(OP_AND): {
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, ip->node, 1);
+                goto fail;
+            }
+            if (!isTruthy(vm->stack->values[vm->stack->next-1])) JUMP(ip->arg);
+            vm->stack->next--;
+        } NEXT();
+        TARGET(OP_OR): {
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, ip->node, 1);
+                goto fail;
+            }
+            if (isTruthy(vm->stack->values[vm->stack->next-1])) JUMP(ip->arg);
+            vm->stack->next--;
+        } NEXT();
+        TARGET(OP_SPECIAL): {
+            AstNode* node = ip->node;
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, node->sub, 1); // todo: this node is wrong i think
+                goto fail;
+            }
+            Value sub = Stack_pop(vm->stack);
+            if (!evalSpecial(vm, node, ip->arg, sub)) goto fail;
+        } NEXT();
+        TARGET(OP_RANGE): {
+            // a to consumed by the next instruction (see streamsRange)
+            if (vm->stack->next == vm->base) {
+                raiseUnderflow(vm, ip->node->sub, 1);
+                goto fail;
+            }
+            Value sub = Stack_pop(vm->stack);
+            if (!pushLazyRange(vm, ip->node, sub)) goto fail;
+        } NEXT();
+        TARGET(OP_IMPORT): {
+            AstNode* node = ip->node;
             AstChainElem* chain = node->as_chain;
             if (chain->symbol == (Symbol) -1) {
                 chain = chain->next;
                 if (!Module_importRel(vm, Symbol_name(chain->symbol), node->module)) {
-                    return false;
+                    goto fail;
                 }
             } else {
                 if (!Module_import(vm, Symbol_name(chain->symbol), false)) {
-                    return false;
+                    goto fail;
                 }
             }
             // todo: Module_import should probably just return Value
@@ -398,58 +833,212 @@ static bool evalNode(VM* vm, AstNode* node) {
                 Value* pv = Context_get(getContext(vm, v), chain->next->symbol);
                 if (!pv) {
                     raiseUnbound(vm, node, chain->next->symbol);
-                    return false;
+                    goto fail;
                 }
                 v = *pv;
                 chain = chain->next;
             }
             if (vm->context->lock) {
                 raiseInvalid(vm, node, "context locked");
-                return false;
+                goto fail;
             }
             if (node->sub) {
                 Context_bind(vm->context, node->sub->as_chain->symbol, v);
             } else {
                 Context_bind(vm->context, chain->symbol, v);
             }
-        } break;
-        case AST_THIS: {
+        } NEXT();
+        TARGET(OP_THIS): {
+            Context_escape(vm->context);
             PUSH(FROM_CONTEXT(vm->context));
-        } break;
-        case AST_SIGBIND: {
-            if (vm->stack->next == 0) {
+        } NEXT();
+        TARGET(OP_SIGBIND): {
+            AstNode* node = ip->node;
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
-                return false;
+                goto fail;
             }
             if (vm->context->lock) { // could happen with evalin
                 raiseInvalid(vm, node, "context locked");
-                return false;
+                goto fail;
             }
             Value v = Stack_pop(vm->stack);
-            Context_bind(vm->context, node->as_symbol, v);
-        } break;
+            if (ip->arg >= 0 && vm->context->shape == code->frameShape) {
+                bindSlot(vm->context, ip->arg, node->as_symbol, v);
+            } else {
+                Context_bind(vm->context, node->as_symbol, v);
+            }
+        } NEXT();
+        TARGET(OP_RETURN): {
+            leaveFrame(vm, entryCtx);
+            return true;
+        }
+        TARGET(OP_GETV_SLOT): {
+            InlineCache* ic = &code->caches[ip->arg];
+            Context* ctx = vm->context;
+            if (ctx->shape == ic->shape && !IS_UNBOUND(ctx->values[ic->shapeSlot])) {
+                PUSH(ctx->values[ic->shapeSlot]);
+                NEXT();
+            }
+            // code shared with other threads is left as is
+            if (parallelActive) goto genericGetv;
+            ip->op = OP_GETV;
+            ip->deopts++;
+        } DISPATCH();
+
+        // lhs is stashed on aux, rhs is on top of the stack
+        #define NUM_OPERANDS() \
+            (vm->stack->next > vm->base && \
+            GET_TYPE(aux->values[aux->next - 1]) == TYPE_NUMBER && \
+            GET_TYPE(vm->stack->values[vm->stack->next - 1]) == TYPE_NUMBER)
+        #define NUM_OPERATOR(opcode, result) \
+            TARGET(opcode): { \
+                if (!NUM_OPERANDS()) goto deoptOperator; \
+                double a = GET_NUMBER(aux->values[--aux->next]); \
+                double b = GET_NUMBER(vm->stack->values[vm->stack->next - 1]); \
+                vm->stack->values[vm->stack->next - 1] = (result); \
+            } NEXT();
+        // fused with the following branch or loop_exit, which is skipped
+        #define NUM_BRANCH(opcode, cond) \
+            TARGET(opcode): { \
+                if (!NUM_OPERANDS()) goto deoptOperator; \
+                double a = GET_NUMBER(aux->values[--aux->next]); \
+                double b = GET_NUMBER(vm->stack->values[--vm->stack->next]); \
+                if ((cond) == (ip[1].op == OP_LOOP_EXIT)) JUMP(ip[1].arg); \
+                ip += 2; \
+            } DISPATCH();
+
+        // note: keep in sync with numOperator
+        NUM_OPERATOR(OP_ADD_NUM, FROM_NUMBER(a + b))
+        NUM_OPERATOR(OP_SUB_NUM, FROM_NUMBER(a - b))
+        NUM_OPERATOR(OP_MUL_NUM, FROM_NUMBER(a * b))
+        NUM_OPERATOR(OP_DIV_NUM, FROM_NUMBER(a / b))
+        NUM_OPERATOR(OP_POW_NUM, FROM_NUMBER(pow(a, b)))
+        NUM_OPERATOR(OP_MOD_NUM, FROM_NUMBER(fmod(a, b)))
+        NUM_OPERATOR(OP_EQ_NUM, FROM_BOOL(a == b))
+        NUM_OPERATOR(OP_NEQ_NUM, FROM_BOOL(a != b))
+        NUM_OPERATOR(OP_LT_NUM, FROM_BOOL(a < b))
+        NUM_OPERATOR(OP_GT_NUM, FROM_BOOL(a > b))
+        // valueCompare treats NaN as equal to everything
+        NUM_OPERATOR(OP_LTEQ_NUM, FROM_BOOL(!(a > b)))
+        NUM_OPERATOR(OP_GTEQ_NUM, FROM_BOOL(!(a < b)))
+        NUM_BRANCH(OP_EQ_NUM_BRANCH, a == b)
+        NUM_BRANCH(OP_NEQ_NUM_BRANCH, a != b)
+        NUM_BRANCH(OP_LT_NUM_BRANCH, a < b)
+        NUM_BRANCH(OP_GT_NUM_BRANCH, a > b)
+        NUM_BRANCH(OP_LTEQ_NUM_BRANCH, !(a > b))
+        NUM_BRANCH(OP_GTEQ_NUM_BRANCH, !(a < b))
+
+        #undef NUM_OPERANDS
+        #undef NUM_OPERATOR
+        #undef NUM_BRANCH
+
+        deoptOperator: {
+            if (parallelActive) goto genericOperator;
+            ip->op = OP_OPERATOR;
+            ip->deopts++;
+        } DISPATCH();
+
+        // stash, getv/const, operator fused into one, for numbers only
+        TARGET(OP_NUM_LOCAL): {
+            InlineCache* ic = &code->caches[ip[1].arg];
+            Context* ctx = vm->context;
+            Stack* s = vm->stack;
+            if (s->next > vm->base && GET_TYPE(s->values[s->next - 1]) == TYPE_NUMBER &&
+                ctx->shape == ic->shape &&
+                GET_TYPE(ctx->values[ic->shapeSlot]) == TYPE_NUMBER) {
+                s->values[s->next - 1] = numOperator(ip[2].arg,
+                    GET_NUMBER(s->values[s->next - 1]),
+                    GET_NUMBER(ctx->values[ic->shapeSlot]));
+                ip += 3;
+                DISPATCH();
+            }
+            if (parallelActive) goto genericStash;
+            ip->op = OP_STASH;
+            ip->deopts++;
+        } DISPATCH();
+        TARGET(OP_NUM_CONST): {
+            Stack* s = vm->stack;
+            if (s->next > vm->base && GET_TYPE(s->values[s->next - 1]) == TYPE_NUMBER) {
+                s->values[s->next - 1] = numOperator(ip[2].arg,
+                    GET_NUMBER(s->values[s->next - 1]),
+                    GET_NUMBER(code->consts[ip[1].arg]));
+                ip += 3;
+                DISPATCH();
+            }
+            if (parallelActive) goto genericStash;
+            ip->op = OP_STASH;
+            ip->deopts++;
+        } DISPATCH();
         default: {
             assert(0 && "not impl");
         }
     }
-    if (node->next) return evalNode(vm, node->next);
-    else return true;
+
+    // as evalCall, but continuing in this loop rather than recursing
+    tailCall: {
+        while (GET_TYPE(callee) != TYPE_CLOSURE) {
+            Value* pv = Context_get(getContext(vm, callee), vm->symUApply);
+            if (!pv) {
+                PUSH(callee);
+                leaveFrame(vm, entryCtx);
+                return true;
+            }
+            calleeSelf = callee;
+            calleeHasSelf = true;
+            callee = *pv;
+        }
+        Closure* closure = GET_CLOSURE(callee);
+        if (!closure->binding) {
+            if (!evalCall(vm, ip->node, callee, calleeHasSelf ? &calleeSelf : NULL)) {
+                goto fail;
+            }
+            // (natives may look at the frame, so it is released after)
+            leaveFrame(vm, entryCtx);
+            return true;
+        }
+        tailCaller = ip->node;
+        vm->callSites[vm->callDepth - 1] = tailCaller;
+        if (vm->context != entryCtx) releaseFrame(vm, vm->context);
+        code = enterClosure(vm, closure, calleeHasSelf ? &calleeSelf : NULL);
+        if (!code) {
+            leaveFrame(vm, entryCtx);
+            return true;
+        }
+        ip = code->instrs;
+    } DISPATCH();
+
+    fail:
+    unwindScopes(vm, code, ip - code->instrs);
+    aux->next = auxBase;
+    vm->scopes->next = scopesBase;
+    vm->context = entryCtx;
+    // frames replaced by tail calls are gone, keep the most recent call site
+    if (tailCaller) traceNode(vm, tailCaller);
+    return false;
+
+    #undef TARGET
+    #undef DISPATCH
+    #undef NEXT
+    #undef JUMP
+    #undef CAN_TAIL_CALL
 }
 
-static ResolveStatus chainResolve(VM* vm, AstNode* node,
+static ResolveStatus chainResolve(VM* vm, AstNode* node, InlineCache** ic,
     Context** base, AstChainElem** chainElem, Value* self) {
     Value val;
     bool hasSelf = (*chainElem)->next != NULL;
     while ((*chainElem)->next) {
         if ((*chainElem)->symbol == (Symbol) -1) {
-            if (vm->stack->next == 0) {
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
                 return RESOLVE_FAIL;
             }
             val = Stack_pop(vm->stack);
             *base = getContext(vm, val);
         } else {
-            Value* pv = Context_get(*base, (*chainElem)->symbol);
+            Context* holder;
+            Value* pv = cachedGet(vm, *ic, *base, (*chainElem)->symbol, &holder);
             if (!pv) {
                 raiseUnbound(vm, node, (*chainElem)->symbol);
                 return RESOLVE_FAIL;
@@ -459,27 +1048,120 @@ static ResolveStatus chainResolve(VM* vm, AstNode* node,
             }
         }
         *chainElem = (*chainElem)->next;
+        (*ic)++;
     }
     if (hasSelf && self) *self = val;
     return hasSelf ? RESOLVE_SELF : RESOLVE_NOSELF;
 }
 
+// The rest of cachedGet. A hit is cached by the shape
+// of its holder (and of any contexts searched before it, which lack the key
+// by virtue of their shape), making lookups in contexts with the same keys a
+// direct slot load. Otherwise, for the part of the search that continues into
+// parent contexts, contexts searched through are marked so that binding a new
+// key in or reparenting one invalidates the cache. While other threads may be
+// reading the cache it is only read, and contexts are no longer marked.
+static __attribute__((noinline)) Value* cachedGetSlow(VM* vm, InlineCache* ic,
+    Context* ctx, Symbol key, Context** holder) {
+    Context* curr = ctx;
+    for (u32 i = 0; i < ic->depth && curr; i++) {
+        curr = curr->shape == ic->path[i] ? curr->parent : NULL;
+    }
+    if (curr && ic->shape == curr->shape &&
+        !IS_UNBOUND(curr->values[ic->shapeSlot])) {
+        vm->icHits++;
+        *holder = curr;
+        return &curr->values[ic->shapeSlot];
+    }
+    Value* pv = Context_getLocal(ctx, key);
+    if (pv) {
+        if (!ic->depth && !parallelActive) {
+            ic->shape = ctx->shape;
+            ic->shapeSlot = pv - ctx->values;
+        }
+        *holder = ctx;
+        return pv;
+    }
+    Context* start = ctx->parent;
+    if (!start) return NULL;
+    u32 epoch = Context_epoch(key);
+    CacheEntry* entry = &ic->mono;
+    if (entry->start == start && entry->epoch == epoch) goto hit;
+    if (ic->poly) {
+        for (int i = 0; i < IC_POLY_SIZE; i++) {
+            entry = &ic->poly[i];
+            if (entry->start == start && entry->epoch == epoch) goto hit;
+        }
+    }
+
+    vm->icMisses++;
+    bool fill = !parallelActive;
+    curr = start;
+    while (curr) {
+        pv = Context_getLocal(curr, key);
+        if (pv) break;
+        if (fill) curr->cached = true;
+        curr = curr->parent;
+    }
+    if (!pv) return NULL;
+    if (!fill) {
+        *holder = curr;
+        return pv;
+    }
+    if (!ic->mono.start || ic->mono.start == start) {
+        entry = &ic->mono;
+    } else {
+        if (!ic->poly) ic->poly = GC_MALLOC(sizeof(CacheEntry) * IC_POLY_SIZE);
+        entry = &ic->poly[ic->polyNext++ % IC_POLY_SIZE];
+    }
+    *entry = (CacheEntry) { start, curr, pv - curr->values, epoch };
+    *holder = curr;
+    return pv;
+
+    hit:
+    vm->icHits++;
+    *holder = entry->holder;
+    return &entry->holder->values[entry->slot];
+}
+
 Context* getContext(VM* vm, Value v) {
     Type t = GET_TYPE(v);
     if (t == TYPE_CONTEXT) {
         return GET_CONTEXT(v);
+    } else if (t == TYPE_NATIVE) {
+        return vm->nativeProtos[GET_NATIVE(v)->kind];
     } else {
         return vm->typeProtos[t];
     }
 }
 
+static void pushCallSite(VM* vm, AstNode* caller) {
+    if (vm->callDepth == vm->callCapacity) {
+        // the old array stays valid for a profiler sample in progress
+        int capacity = vm->callCapacity ? vm->callCapacity * 2 : 64;
+        AstNode** sites = GC_MALLOC(sizeof(AstNode*) * capacity);
+        if (vm->callDepth) {
+            memcpy(sites, vm->callSites, sizeof(AstNode*) * vm->callDepth);
+        }
+        vm->callSites = sites;
+        vm->callCapacity = capacity;
+    }
+    vm->callSites[vm->callDepth] = caller;
+    vm->callDepth++;
+}
+
 bool evalCall(VM* vm, AstNode* caller, Value v, Value* self) {
     if (GET_TYPE(v) == TYPE_CLOSURE) {
         Closure* closure = GET_CLOSURE(v);
+        pushCallSite(vm, caller);
+        CallTracer* tracer = vm->tracer;
+        if (tracer) Profiler_traceEnter(tracer, closure);
         if (!closure->binding) { // is native
             NativeClosure* nc = (NativeClosure*) closure;
             // todo: check native function correctly raised exception on failure
             bool result = ((NativeFn) nc->nativeFn)(vm);
+            if (tracer) Profiler_traceLeave(tracer);
+            vm->callDepth--;
             if (!result) {
                 if (!vm->exSourceHasTrace && !vm->exTraceFirst) {
                     vm->exSourceHasTrace = true;
@@ -490,13 +1172,14 @@ bool evalCall(VM* vm, AstNode* caller, Value v, Value* self) {
             return result;
         }
         Context* oldCtx = vm->context;
-        vm->context = Context_create(closure->binding);
-        if (self) {
-            Context_bind(vm->context, vm->symSelf, *self);
-        }
+        Code* code = enterClosure(vm, closure, self);
+        Context* frame = vm->context;
         bool result = true;
-        if (closure->node) result = evalNode(vm, closure->node);
+        if (code) result = execCode(vm, code, true);
+        if (result) releaseFrame(vm, frame);
+        if (tracer) Profiler_traceLeave(tracer);
         vm->context = oldCtx;
+        vm->callDepth--;
         if (!result) {
             traceNode(vm, caller);
             return false;
@@ -559,7 +1242,8 @@ bool valueCompare(VM* vm, AstNode* node, Value lhs, Value rhs, int* result) {
                 *result = compareNums(GET_NUMBER(cm), 0);
             }
         } break;
-        case TYPE_CLOSURE: {
+        case TYPE_CLOSURE:
+        case TYPE_NATIVE: {
             *result = 0;
         } break;
         case TYPE_LIST: {
@@ -588,7 +1272,7 @@ bool valueCompare(VM* vm, AstNode* node, Value lhs, Value rhs, int* result) {
     return true;
 }
 
-static bool valueEquality(VM* vm, AstNode* node, Value lhs, Value rhs, bool* result) {
+bool valueEquality(VM* vm, AstNode* node, Value lhs, Value rhs, bool* result) {
     Type t = GET_TYPE(lhs);
     if (GET_TYPE(rhs) != t) *result = false;
     else switch (t) {
@@ -627,6 +1311,9 @@ static bool valueEquality(VM* vm, AstNode* node, Value lhs, Value rhs, bool* res
         case TYPE_CLOSURE: {
             *result = false;
         } break;
+        case TYPE_NATIVE: {
+            *result = GET_NATIVE(lhs) == GET_NATIVE(rhs);
+        } break;
         case TYPE_LIST: {
             Stack* llist = GET_LIST(lhs), * rlist = GET_LIST(rhs);
             if (llist == rlist) {
@@ -642,6 +1329,11 @@ static bool valueEquality(VM* vm, AstNode* node, Value lhs, Value rhs, bool* res
                 }
             }
         } break;
+        case TYPE_BLOB: {
+            // as Dict compares them (see dict.c)
+            Blob* x = GET_BLOB(lhs), * y = GET_BLOB(rhs);
+            *result = x->size == y->size && !memcmp(x->data, y->data, x->size);
+        } break;
         default: {
             assert(0 && "not implemented");
         }
@@ -649,12 +1341,143 @@ static bool valueEquality(VM* vm, AstNode* node, Value lhs, Value rhs, bool* res
     return true;
 }
 
+static u32 hashBits(u64 x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return (u32) x;
+}
+
+static u32 hashBytes(const u8* data, size_t size) {
+    u32 h = 2166136261u;
+    for (size_t i = 0; i < size; i++) h = (h ^ data[i]) * 16777619u;
+    return h;
+}
+
+// Lists nested deeper than this are taken to contain themselves, so are not
+// hashed, rather than recursing until the C stack runs out.
+#define HASH_DEPTH_LIMIT 512
+
+static bool hashValue(VM* vm, AstNode* node, Value v, u32* hash, int depth) {
+    switch (GET_TYPE(v)) {
+        case TYPE_NUMBER: {
+            double d = GET_NUMBER(v);
+            if (d == 0) d = 0; // so -0 hashes as 0
+            u64 bits;
+            memcpy(&bits, &d, sizeof(bits));
+            *hash = hashBits(bits);
+        } break;
+        case TYPE_SYMBOL: {
+            *hash = hashBits(GET_SYMBOL(v));
+        } break;
+        case TYPE_STRING: {
+            const char* str = GET_STRING(v);
+            *hash = hashBytes((const u8*) str, strlen(str));
+        } break;
+        case TYPE_ODDBALL: {
+            *hash = hashBits(GET_ODDBALL(v) + 1);
+        } break;
+        case TYPE_BLOB: {
+            *hash = hashBytes(GET_BLOB_DATA(v), GET_BLOB_SIZE(v));
+        } break;
+        case TYPE_LIST: {
+            if (depth == HASH_DEPTH_LIMIT) {
+                raiseInvalid(vm, node, "cannot hash a list containing itself, or nested too deeply");
+                return false;
+            }
+            Stack* list = GET_LIST(v);
+            u32 h = 2166136261u;
+            for (int i = 0; i < list->next; i++) {
+                u32 element;
+                if (!hashValue(vm, node, list->values[i], &element, depth + 1)) return false;
+                h = (h ^ element) * 16777619u;
+            }
+            *hash = h;
+        } break;
+        case TYPE_CONTEXT: {
+            Value* pfn = Context_get(GET_CONTEXT(v), vm->symUHash);
+            if (!pfn) {
+                // equal contexts would hash differently by identity
+                if (Context_get(GET_CONTEXT(v), vm->symUEq)) {
+                    raiseUnbound2(vm, node, vm->symUHash, v);
+                    return false;
+                }
+                *hash = hashBits((uintptr_t) GET_CONTEXT(v));
+                break;
+            }
+            int oldStk = vm->stack->next;
+            if (!evalCall(vm, node, *pfn, &v)) return false;
+            if (vm->stack->next != oldStk + 1) {
+                raiseInvalid(vm, node, "_hash metamethod returned incorrect amount of values");
+                return false;
+            }
+            Value h = Stack_pop(vm->stack);
+            if (GET_TYPE(h) != TYPE_NUMBER) {
+                raiseInvalid(vm, node, "_hash metamethod returned incorrect type");
+                return false;
+            }
+            return hashValue(vm, node, h, hash, depth);
+        }
+        case TYPE_CLOSURE: {
+            *hash = hashBits((uintptr_t) GET_CLOSURE(v));
+        } break;
+        case TYPE_NATIVE: {
+            *hash = hashBits((uintptr_t) GET_NATIVE(v));
+        } break;
+    }
+    return true;
+}
+
+// Hash of a value consistent with equality as used by Dict (see dict.h).
+bool valueHash(VM* vm, AstNode* node, Value v, u32* hash) {
+    return hashValue(vm, node, v, hash, 0);
+}
+
+static bool isArray(Value v) {
+    return GET_TYPE(v) == TYPE_NATIVE && GET_NATIVE(v)->kind == NATIVE_ARRAY;
+}
+
+bool arrayOperand(VM* vm, AstNode* node, Value v, ArrayOperand* operand) {
+    if (isArray(v)) {
+        *operand = (ArrayOperand) { (Array*) GET_NATIVE(v), 0 };
+    } else if (GET_TYPE(v) == TYPE_NUMBER) {
+        *operand = (ArrayOperand) { NULL, GET_NUMBER(v) };
+    } else {
+        raiseNativeType(vm, node, NATIVE_ARRAY);
+        return false;
+    }
+    return true;
+}
+
+// Apply op elementwise to an array and an array or number, pushing the result.
+bool applyArrayOp(VM* vm, AstNode* node, ArrayOp op, Value lhs, Value rhs) {
+    ArrayOperand a, b;
+    if (!arrayOperand(vm, node, lhs, &a)) return false;
+    if (!arrayOperand(vm, node, rhs, &b)) return false;
+    Array* result = Array_binary(op, a, b);
+    if (!result) {
+        raiseInvalid(vm, node, "array lengths differ");
+        return false;
+    }
+    PUSH(FROM_NATIVE(result));
+    return true;
+}
+
 static bool applyOperator(VM* vm, AstNode* node, Value lhs, int op) {
-    if (vm->stack->next == 0) {
+    if (vm->stack->next == vm->base) {
         raiseUnderflow(vm, node, 1);
         return false;
     }
     Value rhs = Stack_pop(vm->stack);
+    if ((isArray(lhs) || isArray(rhs)) && op <= OPR_GTEQ) {
+        // (equality of an array and anything else is still by identity)
+        bool other = op == OPR_EQ || op == OPR_NEQ;
+        if (!other || ((isArray(lhs) || GET_TYPE(lhs) == TYPE_NUMBER) &&
+            (isArray(rhs) || GET_TYPE(rhs) == TYPE_NUMBER))) {
+            // ArrayOp matches OperatorKind up to OPR_GTEQ
+            return applyArrayOp(vm, node, (ArrayOp) op, lhs, rhs);
+        }
+    }
     switch (op) {
         case OPR_EQ: {
             bool result = false;
@@ -812,7 +1635,7 @@ static bool applyOperator(VM* vm, AstNode* node, Value lhs, int op) {
     return true;
 }
 
-static bool isTruthy(Value v) {
+bool isTruthy(Value v) {
     switch (GET_TYPE(v)) {
         case TYPE_ODDBALL: return
             GET_ODDBALL(v) == 0 || GET_ODDBALL(v) == 2;
@@ -820,68 +1643,316 @@ static bool isTruthy(Value v) {
     }
 }
 
-static bool evalAndPop(VM* vm, AstNode* node, Value* value) {
-    if (!evalNode(vm, node)) {
+// Move the last count values of the current group to aux, for iterating over
+// while their results replace them. Returns the index of the first on aux.
+static int setAside(VM* vm, int count) {
+    Stack* aux = vm->aux;
+    int first = aux->next;
+    Stack_reserve(aux, count);
+    vm->stack->next -= count;
+    memcpy(&aux->values[first], &vm->stack->values[vm->stack->next],
+        sizeof(Value) * count);
+    aux->next += count;
+    return first;
+}
+
+// Pop the operands of `lhs to sub`.
+static bool rangeBounds(VM* vm, AstNode* node, Value sub, double* first, double* last) {
+    if (vm->stack->next == vm->base) {
+        raiseUnderflow(vm, node, 1);
+        return false;
+    }
+    Value lhs = Stack_pop(vm->stack);
+    if (GET_TYPE(sub) != TYPE_NUMBER) {
+        raiseType(vm, node, TYPE_NUMBER);
         return false;
     }
-    if (vm->stack->next == 0) {
-        raiseUnderflow(vm, node, 1); // todo: this node is wrong i think
+    if (GET_TYPE(lhs) != TYPE_NUMBER) {
+        raiseType(vm, node, TYPE_NUMBER);
         return false;
     }
-    *value = Stack_pop(vm->stack);
+    *first = GET_NUMBER(lhs);
+    *last = GET_NUMBER(sub);
+    return true;
+}
+
+static void pushRange(VM* vm, double first, double last) {
+    if (first < last) {
+        for (double i = first; i < last; i++) {
+            Stack_push(vm->stack, FROM_NUMBER(i));
+        }
+    } else {
+        for (double i = first; i > last; i--) {
+            Stack_push(vm->stack, FROM_NUMBER(i));
+        }
+    }
+    Stack_push(vm->stack, FROM_NUMBER(last));
+}
+
+// Ranges are only made lazy when they start on an integer, so that their
+// numbers can be computed from first exactly as pushRange would count them.
+#define MAX_EXACT 9007199254740992.0 // 2^53
+
+static bool pushLazyRange(VM* vm, AstNode* node, Value sub) {
+    double first, last;
+    if (!rangeBounds(vm, node, sub, &first, &last)) return false;
+    if (first != floor(first) || fabs(first) >= MAX_EXACT || fabs(last) >= MAX_EXACT) {
+        pushRange(vm, first, last);
+        return true;
+    }
+    Range* range = GC_MALLOC(sizeof(Range));
+    *range = (Range) { { NATIVE_RANGE }, first, last };
+    PUSH(FROM_NATIVE(range));
+    return true;
+}
+
+static double rangeLength(Range* range) {
+    return ceil(fabs(range->last - range->first)) + 1;
+}
+
+static Value rangeAt(Range* range, double i) {
+    if (i == rangeLength(range) - 1) return FROM_NUMBER(range->last);
+    return FROM_NUMBER(range->first < range->last ? range->first + i : range->first - i);
+}
+
+// Pop the lazy range ending the current group, if any (see OP_RANGE).
+static Range* popRange(VM* vm) {
+    if (vm->stack->next == vm->base) return NULL;
+    Value v = vm->stack->values[vm->stack->next - 1];
+    if (GET_TYPE(v) != TYPE_NATIVE || GET_NATIVE(v)->kind != NATIVE_RANGE) return NULL;
+    vm->stack->next--;
+    return (Range*) GET_NATIVE(v);
+}
+
+// Follow the stack depth through an expression of only parameters, numbers,
+// operators and groups, returning false on anything else, which could call
+// into code looking further down the stack (or at its size).
+static bool simpleDepth(AstNode* node, int params, int* depth, int* lowest) {
+    for (; node; node = node->next) {
+        switch (node->kind) {
+            case AST_NUMBER: (*depth)++; break;
+            case AST_GETV: {
+                // only parameters, which are not contexts with metamethods
+                // when folding numbers
+                if (node->as_chain->next || node->depth != 0) return false;
+                if (node->slot < 1 || node->slot > params) return false;
+                (*depth)++;
+            } break;
+            case AST_OPERATOR: {
+                // pops its left operand, then pushes its result in place of
+                // the one value of its right operand
+                if (--(*depth) < *lowest) *lowest = *depth;
+                int inner = *depth, innerLowest = *depth;
+                if (!simpleDepth(node->sub, params, &inner, &innerLowest)) return false;
+                if (inner != *depth + 1 || innerLowest < *depth) return false;
+                (*depth)++;
+            } break;
+            case AST_GROUP: {
+                int inner = 0, innerLowest = 0;
+                if (!simpleDepth(node->sub, params, &inner, &innerLowest)) return false;
+                if (innerLowest < 0) return false;
+                *depth += inner;
+            } break;
+            default: return false;
+        }
+    }
     return true;
 }
 
+// Whether fn is known to take two values and leave one, such as
+// {a b => $a + $b} or dragon's add, so that folding it cannot tell a range
+// streamed in pieces from one pushed whole.
+static bool isBinary(Value fn) {
+    if (GET_TYPE(fn) != TYPE_CLOSURE) return false;
+    Closure* closure = GET_CLOSURE(fn);
+    if (!closure->binding) return false; // is native
+    AstNode* body = closure->node->sub;
+    int params = 0;
+    for (; body && body->kind == AST_SIGBIND; body = body->next) params++;
+    int depth = -params, lowest = -params;
+    if (!simpleDepth(body, params, &depth, &lowest)) return false;
+    return depth == -1 && lowest == -2;
+}
+
+// Folding works from the top of the group down, so the numbers of a range are
+// pushed below the values the fold is working on, from its last number back,
+// FOLD_CHUNK at a time. This is only done for binary functions (see isBinary),
+// others get the range pushed whole.
+#define FOLD_CHUNK 1024
+#define FOLD_MIN 32
+
+static bool foldRange(VM* vm, AstNode* node, Value fn, Range* range) {
+    Stack* s = vm->stack;
+    int start = s->next;
+    double remaining = rangeLength(range);
+    while (true) {
+        if (s->next < start) start = s->next;
+        int above = s->next - start;
+        if (above < FOLD_MIN) {
+            int n = remaining < FOLD_CHUNK ? remaining : FOLD_CHUNK;
+            Stack_reserve(s, n);
+            Value* values = &s->values[start];
+            memmove(&values[n], values, sizeof(Value) * above);
+            remaining -= n;
+            for (int i = 0; i < n; i++) values[i] = rangeAt(range, remaining + i);
+            s->next += n;
+        }
+        if (remaining == 0) return true;
+        if (!evalCall(vm, node, fn, NULL)) return false;
+    }
+}
+
+static bool isIterator(Value v) {
+    return GET_TYPE(v) == TYPE_NATIVE && GET_NATIVE(v)->kind == NATIVE_ITERATOR;
+}
+
+// Get the iterator making up the whole current group, if any. Mapping and
+// filtering one gives a new iterator doing so lazily, folding one consumes it.
+static Iterator* groupIterator(VM* vm) {
+    if (vm->stack->next - vm->base != 1) return NULL;
+    Value v = vm->stack->values[vm->base];
+    return isIterator(v) ? (Iterator*) GET_NATIVE(v) : NULL;
+}
+
+// Whether fn is binary (see isBinary) and only adds or multiplies its two
+// values, as {a b => $a + $b} or dragon's add do, so that folding from the
+// first value on gives what folding from the top would, up to rounding.
+static bool isAssociative(Value fn) {
+    if (!isBinary(fn)) return false;
+    AstNode* body = GET_CLOSURE(fn)->node->sub;
+    while (body->kind == AST_SIGBIND) body = body->next;
+    int operators = 0, seen = 0;
+    for (; body; body = body->next) {
+        AstNode* param = body;
+        if (body->kind == AST_OPERATOR) {
+            if (body->as_int != OPR_ADD && body->as_int != OPR_MUL) return false;
+            param = body->sub;
+            if (param->kind != AST_GETV || param->next) return false;
+            operators++;
+        } else if (body->kind != AST_GETV) {
+            return false;
+        }
+        // each parameter once, so neither is dropped
+        if (seen & (1 << param->slot)) return false;
+        seen |= 1 << param->slot;
+    }
+    return operators == 1;
+}
+
+// Fold an iterator. Its last value is not known until it is reached, so only
+// associative functions are folded as values come, from the first on. Others
+// get every value pushed, to be folded from the top as a group is.
+static bool foldIterator(VM* vm, AstNode* node, Value fn, Iterator* it) {
+    vm->stack->next--;
+    bool streamed = isAssociative(fn), first = true;
+    while (true) {
+        Value v;
+        bool done;
+        if (!Iterator_next(vm, node, it, &v, &done)) return false;
+        if (done) return true;
+        PUSH(v);
+        if (streamed && !first && !evalCall(vm, node, fn, NULL)) return false;
+        first = false;
+    }
+}
+
 static bool evalSpecial(VM* vm, AstNode* node, int special, Value sub) {
+    switch (special) {
+        case SPC_MAP: case SPC_FILTER: {
+            Iterator* it = groupIterator(vm);
+            if (!it) break;
+            IterKind kind = special == SPC_MAP ? ITER_MAP : ITER_FILTER;
+            vm->stack->values[vm->base] = FROM_NATIVE(Iterator_transform(kind, &it, 1, sub));
+            return true;
+        }
+        case SPC_FOLD: {
+            Iterator* it = groupIterator(vm);
+            if (it && !foldIterator(vm, node, sub, it)) return false;
+        } break;
+        case SPC_ZIP: {
+            // a group of only iterators is zipped lazily, in lockstep
+            int count = vm->stack->next - vm->base;
+            for (int i = 0; i < count; i++) {
+                if (!isIterator(vm->stack->values[vm->base + i])) count = 0;
+            }
+            if (!count) break;
+            Iterator** sources = GC_MALLOC(sizeof(Iterator*) * count);
+            for (int i = 0; i < count; i++) {
+                sources[i] = (Iterator*) GET_NATIVE(vm->stack->values[vm->base + i]);
+            }
+            vm->stack->next = vm->base;
+            PUSH(FROM_NATIVE(Iterator_transform(ITER_ZIP, sources, count, sub)));
+            return true;
+        }
+    }
     switch (special) {
         case SPC_MAP: {
-            if (vm->stack->next == 0) return true;
-            Stack* base = vm->stack;
-            vm->stack = Stack_acquire(base->previous);
-            for (int i = 0; i < base->next; i++) {
-                Stack_push(vm->stack, base->values[i]);
+            Range* range = popRange(vm);
+            int count = vm->stack->next - vm->base;
+            if (count) {
+                int first = setAside(vm, count);
+                for (int i = 0; i < count; i++) {
+                    Stack_push(vm->stack, vm->aux->values[first + i]);
+                    if (!evalCall(vm, node, sub, NULL)) return false;
+                }
+                vm->aux->next = first;
+            }
+            double length = range ? rangeLength(range) : 0;
+            for (double i = 0; i < length; i++) {
+                Stack_push(vm->stack, rangeAt(range, i));
                 if (!evalCall(vm, node, sub, NULL)) return false;
             }
-            Stack_release(base);
+        } break;
+        case SPC_PMAP: {
+            if (!Parallel_map(vm, node, sub)) return false;
         } break;
         case SPC_FOLD: {
-            while (vm->stack->next > 1) {
+            Range* range = popRange(vm);
+            if (range && !isBinary(sub)) {
+                pushRange(vm, range->first, range->last);
+            } else if (range && !foldRange(vm, node, sub, range)) {
+                return false;
+            }
+            while (vm->stack->next - vm->base > 1) {
                 if (!evalCall(vm, node, sub, NULL)) return false;
             }
         } break;
         case SPC_FILTER: {
-            if (vm->stack->next == 0) return true;
-            Stack* base = vm->stack;
-            vm->stack = Stack_acquire(base->previous);
-            for (int i = 0; i < base->next; i++) {
-                Stack_push(vm->stack, base->values[i]);
+            Range* range = popRange(vm);
+            int count = vm->stack->next - vm->base;
+            int first = setAside(vm, count);
+            double length = range ? rangeLength(range) : 0;
+            for (double i = 0; i < count + length; i++) {
+                Value v = i < count ? vm->aux->values[first + (int) i] : rangeAt(range, i - count);
+                Stack_push(vm->stack, v);
                 if (!evalCall(vm, node, sub, NULL)) return false;
-                if (vm->stack->next == 0) {
+                if (vm->stack->next == vm->base) {
                     raiseUnderflow(vm, node, 1);
                     return false;
                 }
                 if (isTruthy(Stack_pop(vm->stack))) {
-                    Stack_push(vm->stack, base->values[i]);
+                    Stack_push(vm->stack, v);
                 }
             }
-            Stack_release(base);
+            vm->aux->next = first;
         } break;
         case SPC_ZIP: {
-            Stack* newStack = Stack_acquire(vm->stack->previous);
-            while (vm->stack->next > 0) {
+            // results are collected on aux, the last value's first
+            Stack* aux = vm->aux;
+            int first = aux->next;
+            while (vm->stack->next > vm->base) {
                 if (!evalCall(vm, node, sub, NULL)) return false;
-                if (vm->stack->next == 0) {
+                if (vm->stack->next == vm->base) {
                     raiseUnderflow(vm, node, 1);
                     return false;
                 }
-                Stack_push(newStack, Stack_pop(vm->stack));
+                Stack_push(aux, Stack_pop(vm->stack));
             }
-            Stack_reverse(newStack);
-            Stack_release(vm->stack);
-            vm->stack = newStack;
+            Stack_reserve(vm->stack, aux->next - first);
+            while (aux->next > first) Stack_push(vm->stack, Stack_pop(aux));
         } break;
         case SPC_IS: {
-            if (vm->stack->next == 0) {
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
                 return false;
             }
@@ -909,12 +1980,12 @@ static bool evalSpecial(VM* vm, AstNode* node, int special, Value sub) {
             Stack_push(vm->stack, result ? VAL_TRUE : VAL_FALSE);
         } break;
         case SPC_AS: {
-            if (vm->stack->next == 0) {
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
                 return false;
             }
             Value lhs = vm->stack->values[vm->stack->next - 1];
-            bool subIsNil = sub.tag == TYPE_ODDBALL && GET_ODDBALL(sub) == 3;
+            bool subIsNil = GET_TYPE(sub) == TYPE_ODDBALL && GET_ODDBALL(sub) == 3;
             if (!subIsNil && GET_TYPE(sub) != TYPE_CONTEXT) {
                 raiseType(vm, node, TYPE_CONTEXT);
                 return false;
@@ -939,34 +2010,12 @@ static bool evalSpecial(VM* vm, AstNode* node, int special, Value sub) {
                     cc = cc->parent;
                 }
             }
-            lhsCtx->parent = subCtx;
+            Context_setParent(lhsCtx, subCtx);
         } break;
         case SPC_TO: {
-            if (vm->stack->next == 0) {
-                raiseUnderflow(vm, node, 1);
-                return false;
-            }
-            Value lhs = Stack_pop(vm->stack);
-            if (GET_TYPE(sub) != TYPE_NUMBER) {
-                raiseType(vm, node, TYPE_NUMBER);
-                return false;
-            }
-            if (GET_TYPE(lhs) != TYPE_NUMBER) {
-                raiseType(vm, node, TYPE_NUMBER);
-                return false;
-            }
-            double first = GET_NUMBER(lhs);
-            double last = GET_NUMBER(sub);
-            if (first < last) {
-                for (double i = first; i < last; i++) {
-                    Stack_push(vm->stack, FROM_NUMBER(i));
-                }
-            } else {
-                for (double i = first; i > last; i--) {
-                    Stack_push(vm->stack, FROM_NUMBER(i));
-                }
-            }
-            Stack_push(vm->stack, FROM_NUMBER(last));
+            double first, last;
+            if (!rangeBounds(vm, node, sub, &first, &last)) return false;
+            pushRange(vm, first, last);
         } break;
         case SPC_DOT: {
             if (GET_TYPE(sub) != TYPE_NUMBER) {
@@ -974,17 +2023,18 @@ static bool evalSpecial(VM* vm, AstNode* node, int special, Value sub) {
                 return false;
             }
             int n = (int) GET_NUMBER(sub);
-            if (!vm->stack->previous) {
+            int outer = outerBase(vm);
+            if (outer < 0) {
                 raiseUnderflow(vm, node, -1);
                 return false;
-            } else if (Stack_size(vm->stack->previous) < n) {
+            } else if (vm->base - outer < n) {
                 raiseUnderflow(vm, node, n);
                 return false;
             } else if (n < 0) {
                 raiseInvalid(vm, node, "dot amount must be non-negative");
                 return false;
             }
-            Stack_move(vm->stack->previous, vm->stack, n);
+            pullOuter(vm, n);
         } break;
         case SPC_JOIN: {
             // todo: define on vm
@@ -998,7 +2048,7 @@ static bool evalSpecial(VM* vm, AstNode* node, int special, Value sub) {
             }
         } break;
         case SPC_REPEAT: {
-            if (vm->stack->next == 0) {
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
                 return false;
             }
@@ -1013,7 +2063,7 @@ static bool evalSpecial(VM* vm, AstNode* node, int special, Value sub) {
             }
         } break;
         case SPC_WITH: {
-            if (vm->stack->next == 0) {
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
                 return false;
             }
@@ -1030,7 +2080,7 @@ static bool evalSpecial(VM* vm, AstNode* node, int special, Value sub) {
             }
         } break;
         case SPC_CATCH: {
-            if (vm->stack->next == 0) {
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
                 return false;
             }
@@ -1045,7 +2095,7 @@ static bool evalSpecial(VM* vm, AstNode* node, int special, Value sub) {
             }
         } break;
         case SPC_AND: case SPC_OR: {
-            if (vm->stack->next == 0) {
+            if (vm->stack->next == vm->base) {
                 raiseUnderflow(vm, node, 1);
                 return false;
             }
@@ -1078,6 +2128,15 @@ void raiseUnbound2(VM* vm, AstNode* node, Symbol sym, Value value) {
     traceNode(vm, node);
 }
 
+// for keys which are not symbols, e.g. of dicts
+void raiseUnboundKey(VM* vm, AstNode* node, Value key, const char* in) {
+    vm->exSymbol = vm->symExs[0];
+    vm->exMessage = gc_sprintf("key %s unbound in %s", Value_repr(key, 1), in);
+    vm->exTraceFirst = NULL;
+    vm->exSourceHasTrace = node != NULL;
+    traceNode(vm, node);
+}
+
 void raiseUnderflow(VM* vm, AstNode* node, int n) {
     vm->exSymbol = vm->symExs[1];
     if (n == -1) vm->exMessage = "metastack underflow";
@@ -1096,6 +2155,14 @@ void raiseType(VM* vm, AstNode* node, Type type) {
     traceNode(vm, node);
 }
 
+void raiseNativeType(VM* vm, AstNode* node, NativeKind kind) {
+    vm->exSymbol = vm->symExs[2];
+    vm->exMessage = gc_sprintf("expected value of type %s", nativeNames[kind]);
+    vm->exTraceFirst = NULL;
+    vm->exSourceHasTrace = node != NULL;
+    traceNode(vm, node);
+}
+
 void raiseInvalid(VM* vm, AstNode* node, const char* msg) {
     vm->exSymbol = vm->symExs[3];
     if (msg) vm->exMessage = gc_sprintf("invalid operation (%s)", msg);
@@ -1165,10 +2232,23 @@ static void traceNative(VM* vm, NativeClosure* nc) {
     vm->exTraceLast = trace;
 }
 
+ExceptionTrace* VM_copyTrace(ExceptionTrace* trace, ExceptionTrace** last) {
+    ExceptionTrace* first = NULL, ** link = &first;
+    *last = NULL;
+    for (; trace; trace = trace->next) {
+        ExceptionTrace* copy = GC_MALLOC(sizeof(ExceptionTrace));
+        *copy = *trace;
+        copy->next = NULL;
+        *link = *last = copy;
+        link = &copy->next;
+    }
+    return first;
+}
+
 void VM_dump(VM* vm) {
-    if (vm->stack->next == 0) return;
-    for (int i = 0; i < vm->stack->next; i++) {
-        if (i) putchar(' ');
+    if (vm->stack->next == vm->base) return;
+    for (int i = vm->base; i < vm->stack->next; i++) {
+        if (i > vm->base) putchar(' ');
         printf("%s", Value_repr(vm->stack->values[i], 1));
     }
     printf("\n");
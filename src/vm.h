@@ -7,6 +7,12 @@
 
 typedef struct sVM VM;
 typedef struct sExceptionTrace ExceptionTrace;
+typedef struct sCallTracer CallTracer;
+typedef struct sCoroutine Coroutine;
+typedef struct sCoThread CoThread;
+typedef struct sActor Actor;
+
+#define SPARE_FRAME_SIZES 16 // frames of fewer slots are kept for reuse
 
 struct sExceptionTrace {
     ModuleInfo* module;
@@ -18,7 +24,10 @@ struct sExceptionTrace {
 };
 
 struct sVM {
-    Stack* stack;
+    Stack* stack; // values of all open groups, contiguously
+    int base; // index on stack of the current group's first value
+    Stack* aux; // operands held by the evaluator between instructions
+    Stack* scopes; // enclosing bases/contexts of open groups and objects
     Symbol exSymbol; // 0 when no exception
     const char* exMessage;
     ExceptionTrace* exTraceFirst;
@@ -27,17 +36,37 @@ struct sVM {
     bool fullTrace, noLock;
     Context* root;
     Context* context;
-    Symbol symSelf, symThis, symOps[21], symExs[5], symTypes[8];
+    Symbol symSelf, symThis, symOps[21], symExs[5], symTypes[TYPE_COUNT];
     Symbol symKey, symValue, symMessage, symTrace;
-    Symbol symUApply, symUCmp, symUEq, symUJoin, symUWith;
+    Symbol symUApply, symUCmp, symUEq, symUHash, symUJoin, symUNext, symUWith;
+    Symbol symNatives[NATIVE_KIND_COUNT];
     // instead have a context exposed to fruity with module contexts bound within?
     ModuleInfo** modules;
     int moduleCount;
-    Context* typeProtos[8];
+    Context* typeProtos[TYPE_COUNT]; // except natives, see nativeProtos
+    Context* nativeProtos[NATIVE_KIND_COUNT];
     Context* refProto, * argProto, * exProto;
+    // inline cache statistics (see cachedGet in vm.c)
+    u64 icHits, icMisses;
+    // call sites of the closures and natives being evaluated, innermost last
+    // note: read from a signal handler by the sampling profiler
+    AstNode** callSites;
+    volatile int callDepth;
+    int callCapacity;
+    CallTracer* tracer; // NULL unless tracing calls (see profiler.h)
+    Coroutine* coroutine; // running coroutine, NULL if none (see coroutine.h)
+    CoThread* coThread; // the thread's own stack, once a coroutine has run
+    Actor* actor; // with the VM's mailbox, once needed (see actor.h)
+    // frames of calls returned from which did not escape, by size, linked
+    // through their parent (see releaseFrame in vm.c)
+    Context* spareFrames[SPARE_FRAME_SIZES];
+    int spareCounts[SPARE_FRAME_SIZES];
 };
 
 void VM_startup(VM* vm);
 bool VM_eval(VM* vm, Block* block);
 bool VM_evalModule(VM* vm, Block* block, Context* ctx);
 void VM_dump(VM* vm);
+// Copy the trace of an exception raised on another VM, to raise it again, as
+// raising appends to the trace.
+ExceptionTrace* VM_copyTrace(ExceptionTrace* trace, ExceptionTrace** last);